@@ -19,6 +19,9 @@
 #include "t_editor.h"
 #include "t_loader.h"
 #include "t_renamer.h"
+#include "t_filter.h"
+#include "t_aggregate.h"
+#include "t_sort.h"
 
 
 struct t_action_token {
@@ -31,13 +34,17 @@ struct t_action_token {
 /* keep this array sorted, as it is used with bsearch(3) */
 static struct t_action_token t_action_keywords[] = {
 	{ .word = "add",	.kind = T_ACTION_ADD,		.argc = 1 },
+	{ .word = "aggregate",	.kind = T_ACTION_AGGREGATE,	.argc = 1 },
 	{ .word = "backend",	.kind = T_ACTION_BACKEND,	.argc = 0 },
 	{ .word = "clear",	.kind = T_ACTION_CLEAR,		.argc = 1 },
+	{ .word = "digest",	.kind = T_ACTION_DIGEST,	.argc = 0 },
 	{ .word = "edit",	.kind = T_ACTION_EDIT,		.argc = 0 },
 	{ .word = "load",	.kind = T_ACTION_LOAD,		.argc = 1 },
 	{ .word = "print",	.kind = T_ACTION_PRINT,		.argc = 0 },
 	{ .word = "rename",	.kind = T_ACTION_RENAME,	.argc = 1 },
 	{ .word = "set",	.kind = T_ACTION_SET,		.argc = 1 },
+	{ .word = "sort",	.kind = T_ACTION_SORT,		.argc = 1 },
+	{ .word = "where",	.kind = T_ACTION_WHERE,		.argc = 1 },
 };
 
 
@@ -51,13 +58,22 @@ static void		 t_action_delete(struct t_action *victim);
 
 /* action methods */
 static int	t_action_add(struct t_action *self, struct t_tune *tune);
+static int	t_action_aggregate(struct t_action *self, struct t_tune *tune);
+static int	t_action_aggregate_finish(struct t_action *self);
 static int	t_action_backend(struct t_action *self, struct t_tune *tune);
 static int	t_action_clear(struct t_action *self, struct t_tune *tune);
+static int	t_action_digest(struct t_action *self, struct t_tune *tune);
 static int	t_action_edit(struct t_action *self, struct t_tune *tune);
 static int	t_action_load(struct t_action *self, struct t_tune *tune);
 static int	t_action_print(struct t_action *self, struct t_tune *tune);
 static int	t_action_rename(struct t_action *self, struct t_tune *tune);
+static int	t_action_rename_commit(struct t_action *self, int success);
+static int	t_action_rename_flush(struct t_action *self,
+		    t_actionQ_report *report, void *arg);
 static int	t_action_set(struct t_action *self, struct t_tune *tune);
+static int	t_action_sort(struct t_action *self, struct t_tune *tune);
+static int	t_action_sort_finish(struct t_action *self);
+static int	t_action_where(struct t_action *self, struct t_tune *tune);
 
 /* used to search in the t_action_keywords array */
 static int	t_action_token_cmp(const void *vstr, const void *vtoken);
@@ -117,6 +133,17 @@ t_actionQ_new(int *argc_p, char ***argv_p)
 		if (a == NULL)
 			goto cleanup;
 		TAILQ_INSERT_TAIL(aQ, a, entries);
+		if (a->kind == T_ACTION_RENAME) {
+			/* renames are planned from the original paths */
+			struct t_action *r;
+			TAILQ_FOREACH(r, aQ, entries) {
+				if (r != a && r->kind == T_ACTION_RENAME) {
+					warnx("only one rename action is allowed");
+					errno = EINVAL;
+					goto cleanup;
+				}
+			}
+		}
 
 		argc--;
 		argv++;
@@ -147,6 +174,108 @@ cleanup:
 }
 
 
+int
+t_actionQ_apply(struct t_actionQ *aQ, const char *path, struct stat *sb)
+{
+	int write = 0, success = 1, deferred = 0;
+	struct t_action *a;
+	struct t_tune *tune;
+
+	assert(aQ != NULL);
+	assert(path != NULL);
+
+	/* find if any action need write access */
+	TAILQ_FOREACH(a, aQ, entries)
+		write += a->write;
+
+	/* check file path and access */
+	if (access(path, (write ? (R_OK | W_OK) : R_OK)) == -1) {
+		warn("%s", path);
+		return (-1);
+	}
+
+	if ((tune = t_tune_new(path)) == NULL) {
+		if (errno == ENOMEM)
+			err(EXIT_FAILURE, "malloc");
+		warnx("%s: unsupported file format", path);
+		return (-1);
+	}
+
+	/* apply every actions */
+	TAILQ_FOREACH(a, aQ, entries) {
+		int status = a->apply(a, tune);
+		if (status == T_ACTION_SKIP) {
+			/* filtered out, keep what was done so far */
+			break;
+		} else if (status != 0) {
+			/*
+			 * prevent further action on this particular
+			 * file.
+			 */
+			success = 0;
+			break;
+		}
+	}
+	if (write && success) {
+		/* all actions went well and at least one of them
+		   require the tags to be written back to the file */
+		if (t_tune_save(tune) == -1) {
+			warnx("%s: could not write tags to the file,",
+			    t_tune_path(tune));
+			success = 0;
+		}
+	}
+	if (sb != NULL && stat(t_tune_path(tune), sb) == -1)
+		success = 0;
+	/* the deferred work (like a rename) is only kept for saved files */
+	TAILQ_FOREACH(a, aQ, entries) {
+		if (a->commit != NULL && a->commit(a, success) == 1)
+			deferred = 1;
+	}
+	t_tune_delete(tune);
+
+	if (!success)
+		return (-1);
+	return (deferred ? T_ACTION_DEFERRED : 0);
+}
+
+
+int
+t_actionQ_flush(struct t_actionQ *aQ, t_actionQ_report *report, void *arg)
+{
+	int success = 1;
+	struct t_action *a;
+
+	assert(aQ != NULL);
+
+	TAILQ_FOREACH(a, aQ, entries) {
+		if (a->flush != NULL && a->flush(a, report, arg) != 0)
+			success = 0;
+	}
+
+	return (success ? 0 : -1);
+}
+
+
+int
+t_actionQ_finish(struct t_actionQ *aQ)
+{
+	int success = 1;
+	struct t_action *a;
+
+	assert(aQ != NULL);
+
+	if (t_actionQ_flush(aQ, NULL, NULL) != 0)
+		success = 0;
+	TAILQ_FOREACH(a, aQ, entries) {
+		if (a->finish != NULL && a->finish(a) != 0)
+			success = 0;
+	}
+
+	return (success ? 0 : -1);
+}
+
+
 void
 t_actionQ_delete(struct t_actionQ *aQ)
 {
@@ -210,6 +339,14 @@ t_action_new(enum t_actionkind kind, const char *arg)
 		a->write = 1;
 		a->apply = t_action_add;
 		break;
+	case T_ACTION_AGGREGATE:
+		assert(arg != NULL);
+		/* t_aggregate_new() warn about what is wrong */
+		if ((a->opaque = t_aggregate_new(arg)) == NULL)
+			goto cleanup;
+		a->apply  = t_action_aggregate;
+		a->finish = t_action_aggregate_finish;
+		break;
 	case T_ACTION_BACKEND:
 		a->apply = t_action_backend;
 		break;
@@ -223,6 +360,9 @@ t_action_new(enum t_actionkind kind, const char *arg)
 		a->write = 1;
 		a->apply = t_action_clear;
 		break;
+	case T_ACTION_DIGEST:
+		a->apply = t_action_digest;
+		break;
 	case T_ACTION_EDIT:
 		a->write = 1;
 		a->apply = t_action_edit;
@@ -246,14 +386,16 @@ t_action_new(enum t_actionkind kind, const char *arg)
 			warn("empty rename pattern");
 			goto cleanup;
 		}
-		a->opaque = t_rename_parse(arg);
+		a->opaque = t_rename_plan_new(arg);
 		if (a->opaque == NULL) {
-			errno = EINVAL;
-			warn("rename: bad rename pattern");
+			if (errno == EINVAL)
+				warn("rename: bad rename pattern");
 			goto cleanup;
 		}
 		a->write = 1;
-		a->apply = t_action_rename;
+		a->apply  = t_action_rename;
+		a->commit = t_action_rename_commit;
+		a->flush  = t_action_rename_flush;
 		break;
 	case T_ACTION_SET: /* very similar to T_ACTION_ADD */
 		assert(arg != NULL);
@@ -274,6 +416,21 @@ t_action_new(enum t_actionkind kind, const char *arg)
 		a->write = 1;
 		a->apply = t_action_set;
 		break;
+	case T_ACTION_SORT:
+		assert(arg != NULL);
+		/* t_sort_new() warn about what is wrong */
+		if ((a->opaque = t_sort_new(arg)) == NULL)
+			goto cleanup;
+		a->apply  = t_action_sort;
+		a->finish = t_action_sort_finish;
+		break;
+	case T_ACTION_WHERE:
+		assert(arg != NULL);
+		/* t_filter_parse() warn about what is wrong */
+		if ((a->opaque = t_filter_parse(arg)) == NULL)
+			goto cleanup;
+		a->apply = t_action_where;
+		break;
 	default: /* unexpected, unhandled t_actionkind */
 		errno = EINVAL;
 		goto cleanup;
@@ -308,7 +465,16 @@ t_action_delete(struct t_action *victim)
 			free(victim->opaque);
 			break;
 		case T_ACTION_RENAME:
-			t_rename_pattern_delete(victim->opaque);
+			t_rename_plan_delete(victim->opaque);
+			break;
+		case T_ACTION_WHERE:
+			t_filter_delete(victim->opaque);
+			break;
+		case T_ACTION_AGGREGATE:
+			t_aggregate_delete(victim->opaque);
+			break;
+		case T_ACTION_SORT:
+			t_sort_delete(victim->opaque);
 			break;
 		default:
 			/* do nada */
@@ -351,6 +517,32 @@ cleanup:
 }
 
 
+static int
+t_action_aggregate(struct t_action *self, struct t_tune *tune)
+{
+	const struct t_taglist *tlist;
+
+	assert(self != NULL);
+	assert(self->kind == T_ACTION_AGGREGATE);
+	assert(tune != NULL);
+
+	if ((tlist = t_tune_taglist(tune)) == NULL)
+		return (-1);
+	return (t_aggregate_add(self->opaque, tlist) == 0 ? 0 : -1);
+}
+
+
+static int
+t_action_aggregate_finish(struct t_action *self)
+{
+
+	assert(self != NULL);
+	assert(self->kind == T_ACTION_AGGREGATE);
+
+	return (t_aggregate_print(self->opaque) == 0 ? 0 : -1);
+}
+
+
 static int
 t_action_backend(t__unused struct t_action *self, struct t_tune *tune)
 {
@@ -406,6 +598,30 @@ cleanup:
 }
 
 
+static int
+t_action_digest(t__unused struct t_action *self, struct t_tune *tune)
+{
+	uint8_t digest[T_TAGLIST_DIGEST_SIZE];
+	char hex[2 * T_TAGLIST_DIGEST_SIZE + 1];
+	const struct t_taglist *tlist;
+	size_t i;
+
+	assert(self != NULL);
+	assert(self->kind == T_ACTION_DIGEST);
+	assert(tune != NULL);
+
+	if ((tlist = t_tune_taglist(tune)) == NULL)
+		return (-1);
+	if (t_taglist_digest(tlist, digest) == -1)
+		return (-1);
+
+	for (i = 0; i < sizeof(digest); i++)
+		(void)snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+	(void)printf("%s %s\n", hex, t_tune_path(tune));
+	return (0);
+}
+
+
 static int
 t_action_edit(t__unused struct t_action *self, struct t_tune *tune)
 {
@@ -437,17 +653,19 @@ t_action_print(t__unused struct t_action *self, struct t_tune *tune)
 {
 	int nprinted, success = 0;
 	char *fmtdata = NULL;
-	struct t_taglist *tlist = NULL;
+	const struct t_taglist *tlist;
 	extern const struct t_format *Fflag;
 
 	assert(self != NULL);
 	assert(self->kind == T_ACTION_PRINT);
 	assert(tune != NULL);
 
-	tlist = t_tune_tags(tune);
+	tlist = t_tune_taglist(tune);
 	if (tlist == NULL)
 		goto cleanup;
 
+	if (t_format_load(Fflag) == -1)
+		goto cleanup;
 	fmtdata = Fflag->tags2fmt(tlist, t_tune_path(tune));
 	if (fmtdata == NULL)
 		goto cleanup;
@@ -460,7 +678,6 @@ t_action_print(t__unused struct t_action *self, struct t_tune *tune)
 
 	/* FALLTHROUGH */
 cleanup:
-	t_taglist_delete(tlist);
 	free(fmtdata);
 	return (success ? 0 : -1);
 }
@@ -474,11 +691,34 @@ t_action_rename(struct t_action *self, struct t_tune *tune)
 	assert(self->kind == T_ACTION_RENAME);
 	assert(tune != NULL);
 
-	int success = (t_rename(tune, self->opaque) == 0);
+	int success = (t_rename_plan_add(self->opaque, tune) == 0);
 	return (success ? 0 : -1);
 }
 
 
+static int
+t_action_rename_commit(struct t_action *self, int success)
+{
+
+	assert(self != NULL);
+	assert(self->kind == T_ACTION_RENAME);
+
+	return (t_rename_plan_commit(self->opaque, success));
+}
+
+
+static int
+t_action_rename_flush(struct t_action *self, t_actionQ_report *report,
+    void *arg)
+{
+
+	assert(self != NULL);
+	assert(self->kind == T_ACTION_RENAME);
+
+	return (t_rename_plan_run(self->opaque, report, arg) == 0 ? 0 : -1);
+}
+
+
 static int
 t_action_set(struct t_action *self, struct t_tune *tune)
 {
@@ -525,6 +765,47 @@ t_action_set(struct t_action *self, struct t_tune *tune)
 }
 
 
+static int
+t_action_sort(struct t_action *self, struct t_tune *tune)
+{
+	const struct t_taglist *tlist;
+
+	assert(self != NULL);
+	assert(self->kind == T_ACTION_SORT);
+	assert(tune != NULL);
+
+	if ((tlist = t_tune_taglist(tune)) == NULL)
+		return (-1);
+	return (t_sort_add(self->opaque, tlist, t_tune_path(tune)) == 0 ? 0 : -1);
+}
+
+
+static int
+t_action_sort_finish(struct t_action *self)
+{
+
+	assert(self != NULL);
+	assert(self->kind == T_ACTION_SORT);
+
+	return (t_sort_print(self->opaque) == 0 ? 0 : -1);
+}
+
+
+static int
+t_action_where(struct t_action *self, struct t_tune *tune)
+{
+	const struct t_taglist *tlist;
+
+	assert(self != NULL);
+	assert(self->kind == T_ACTION_WHERE);
+	assert(tune != NULL);
+
+	if ((tlist = t_tune_taglist(tune)) == NULL)
+		return (-1);
+	return (t_filter_match(self->opaque, tlist) ? 0 : T_ACTION_SKIP);
+}
+
+
 /* used to search in the t_action_keywords array */
 static int
 t_action_token_cmp(const void *vstr, const void *vtoken)
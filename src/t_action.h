@@ -5,6 +5,8 @@
  *
  * tagutil actions.
  */
+#include <sys/stat.h>
+
 #include "t_config.h"
 #include "t_toolkit.h"
 #include "t_tune.h"
@@ -14,21 +16,58 @@
 enum t_actionkind {
 	/* user options */
 	T_ACTION_ADD,		/* add:TAG=VALUE	add tag */
+	T_ACTION_AGGREGATE,	/* aggregate:TAG,...	tag statistics */
 	T_ACTION_BACKEND,	/* backend		show backend */
 	T_ACTION_CLEAR,		/* clear:TAG		clear tag */
+	T_ACTION_DIGEST,	/* digest		show tags digest */
 	T_ACTION_EDIT,		/* edit			edit with $EDITOR */
 	T_ACTION_LOAD,		/* load:PATH		load file */
 	T_ACTION_PRINT,		/* print		display tags */
 	T_ACTION_RENAME,	/* rename:PATTERN	rename files */
 	T_ACTION_SET,		/* set:TAG=VALUE	set tags */
+	T_ACTION_SORT,		/* sort:TAG,...		sorted display */
+	T_ACTION_WHERE,		/* where:EXPR		filter files */
 };
 
+/*
+ * returned by an action apply routine when the following actions must not be
+ * applied to the tune (this is not an error).
+ */
+#define	T_ACTION_SKIP	1
+
+/*
+ * returned by t_actionQ_apply() when the actions went well but some of their
+ * work (like a rename) is deferred until the next t_actionQ_flush().
+ */
+#define	T_ACTION_DEFERRED	2
+
+/*
+ * called by t_actionQ_flush() for each file whose work was deferred, once it
+ * has been carried out. npath is the file's path from then on, success is 0
+ * if the work failed.
+ */
+typedef void	t_actionQ_report(const char *path, const char *npath,
+		    int success, void *arg);
+
 /* action with (or without) argument to proceed */
 struct t_action {
 	enum t_actionkind kind;
 	void	*opaque; /* argument of the action */
 	int	write; /* 1 if the action need write access, 0 otherwise */
+	/* return 0 on success, -1 on error or T_ACTION_SKIP */
 	int (*apply)(struct t_action *self, struct t_tune *tune);
+	/* keep the work deferred by apply once the file is done and its tags
+	   were saved (success is 1), or drop it. may be NULL. return 1 if
+	   some work is left for flush, 0 otherwise */
+	int (*commit)(struct t_action *self, int success);
+	/* carry out the work deferred by apply (like renames) and pass the
+	   outcome for each file to report when not NULL, may be NULL. return 0
+	   on success, -1 on error */
+	int (*flush)(struct t_action *self, t_actionQ_report *report,
+	    void *arg);
+	/* called once after the last file, may be NULL. return 0 on success,
+	   -1 on error */
+	int (*finish)(struct t_action *self);
 	TAILQ_ENTRY(t_action)	entries;
 };
 /* action queue head */
@@ -51,6 +90,49 @@ TAILQ_HEAD(t_actionQ, t_action);
  */
 struct t_actionQ	*t_actionQ_new(int *argc_p, char ***argv_p);
 
+/*
+ * apply all the actions of a queue to a file, and write its tags back if
+ * needed.
+ *
+ * @param path
+ *   The file's path.
+ *
+ * @param sb
+ *   If not NULL, set to the stat(2) of the file after the actions were applied
+ *   (a rename is deferred, so the file is still at path).
+ *
+ * @return
+ *   0 on success, T_ACTION_DEFERRED on success when the file has work left for
+ *   t_actionQ_flush(), -1 on error. A warning is displayed for errors and the
+ *   program exit if malloc(3) failed.
+ */
+int	t_actionQ_apply(struct t_actionQ *aQ, const char *path, struct stat *sb);
+
+/*
+ * carry out the work deferred by the actions of a queue for the files
+ * processed so far (for example the rename action plan every renames until
+ * then).
+ *
+ * @param report
+ *   If not NULL, called with arg for each file for which t_actionQ_apply()
+ *   returned T_ACTION_DEFERRED, in the same order.
+ *
+ * @return
+ *   0 on success, -1 on error.
+ */
+int	t_actionQ_flush(struct t_actionQ *aQ, t_actionQ_report *report,
+	    void *arg);
+
+/*
+ * flush and finish all the actions of a queue, once every file has been
+ * processed (for example the aggregate action display its statistics). The
+ * outcome of the deferred work is not reported, see t_actionQ_flush().
+ *
+ * @return
+ *   0 on success, -1 on error.
+ */
+int	t_actionQ_finish(struct t_actionQ *aQ);
+
 /*
  * destroy (free memory) of an action queue.
  */
@@ -0,0 +1,405 @@
+/*
+ * t_aggregate.c
+ *
+ * streaming statistics about tag values (the aggregate action).
+ *
+ * Exact counts are kept in an open addressing hash table (linear probing,
+ * grown to keep it at most half full) per key. Approximated distinct counts
+ * use a HyperLogLog, see Flajolet et al. "HyperLogLog: the analysis of a
+ * near-optimal cardinality estimation algorithm" (2007).
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "t_config.h"
+#include "t_toolkit.h"
+#include "t_tag.h"
+#include "t_taglist.h"
+#include "t_format.h"
+#include "t_aggregate.h"
+
+
+#define	T_AGGREGATE_HLL_SIZE	(1 << T_AGGREGATE_HLL_BITS)
+/* initial size of the hash tables, a power of two */
+#define	T_AGGREGATE_INITSIZE	64
+
+/* a value and the number of files having it */
+struct t_aggregate_slot {
+	char		*val; /* NULL for an empty slot */
+	uint64_t	 hash;
+	unsigned long	 count;
+	unsigned long	 seen; /* the last file counted */
+};
+
+struct t_aggregate_key {
+	char		*key;
+	int		 approx; /* 1 for a #KEY */
+	unsigned long	 missing;
+	/* exact counts */
+	size_t		 count; /* used slots */
+	size_t		 size;  /* allocated slots, a power of two */
+	struct t_aggregate_slot	*slots;
+	/* HyperLogLog registers, for approx */
+	uint8_t		*registers;
+};
+
+struct t_aggregate {
+	unsigned long	files;
+	size_t		nkeys;
+	struct t_aggregate_key	keys[];
+};
+
+
+static uint64_t	t_aggregate_hash(const char *s);
+static int	t_aggregate_count(struct t_aggregate_key *k, const char *val,
+		    unsigned long file);
+static void	t_aggregate_hll_add(struct t_aggregate_key *k, uint64_t h);
+static unsigned long	t_aggregate_hll_estimate(const struct t_aggregate_key *k);
+static int	t_aggregate_print_key(const struct t_aggregate *ag,
+		    const struct t_aggregate_key *k);
+/* qsort(3) comparison, by decreasing count and then by value */
+static int	t_aggregate_slotcmp(const void *va, const void *vb);
+
+
+struct t_aggregate *
+t_aggregate_new(const char *keys)
+{
+	struct t_aggregate *ag;
+	struct t_aggregate_key *k;
+	const char *c, *end;
+	size_t i, nkeys;
+
+	assert(keys != NULL);
+
+	nkeys = 1;
+	for (c = keys; *c != '\0'; c++)
+		nkeys += (*c == ',');
+
+	ag = calloc(1, sizeof(struct t_aggregate) +
+	    nkeys * sizeof(struct t_aggregate_key));
+	if (ag == NULL)
+		return (NULL);
+	ag->nkeys = nkeys;
+
+	for (i = 0, c = keys; i < nkeys; i++, c = end + 1) {
+		k = &ag->keys[i];
+		if ((end = strchr(c, ',')) == NULL)
+			end = c + strlen(c);
+		if (*c == '#') {
+			k->approx = 1;
+			c++;
+		}
+		if (c == end) {
+			warnx("aggregate: empty tag key in `%s'", keys);
+			errno = EINVAL;
+			goto error_label;
+		}
+		if ((k->key = strndup(c, end - c)) == NULL)
+			goto error_label;
+		if (k->approx) {
+			k->registers = calloc(T_AGGREGATE_HLL_SIZE, 1);
+			if (k->registers == NULL)
+				goto error_label;
+		}
+	}
+
+	return (ag);
+error_label:
+	t_aggregate_delete(ag);
+	return (NULL);
+}
+
+
+int
+t_aggregate_add(struct t_aggregate *ag, const struct t_taglist *tlist)
+{
+	struct t_aggregate_key *k;
+	const struct t_tag *t;
+	size_t i;
+	int found;
+
+	assert(ag != NULL);
+	assert(tlist != NULL);
+
+	ag->files++;
+	for (i = 0; i < ag->nkeys; i++) {
+		k = &ag->keys[i];
+		found = 0;
+		TAILQ_FOREACH(t, tlist->tags, entries) {
+			if (t_tag_keycmp(t->key, k->key) != 0)
+				continue;
+			found = 1;
+			if (k->approx)
+				t_aggregate_hll_add(k, t_aggregate_hash(t->val));
+			else if (t_aggregate_count(k, t->val, ag->files) == -1)
+				return (-1);
+		}
+		if (!found)
+			k->missing++;
+	}
+
+	return (0);
+}
+
+
+int
+t_aggregate_print(const struct t_aggregate *ag)
+{
+	size_t i;
+
+	assert(ag != NULL);
+
+	for (i = 0; i < ag->nkeys; i++) {
+		if (t_aggregate_print_key(ag, &ag->keys[i]) == -1)
+			return (-1);
+	}
+
+	return (0);
+}
+
+
+void
+t_aggregate_delete(struct t_aggregate *ag)
+{
+	struct t_aggregate_key *k;
+	size_t i, j;
+
+	if (ag != NULL) {
+		for (i = 0; i < ag->nkeys; i++) {
+			k = &ag->keys[i];
+			for (j = 0; j < k->size; j++)
+				free(k->slots[j].val);
+			free(k->slots);
+			free(k->registers);
+			free(k->key);
+		}
+	}
+	free(ag);
+}
+
+
+/*
+ * FNV-1a followed by the MurmurHash3 finalizer, so that every bit of the
+ * result depend on every byte of s (HyperLogLog use the high bits).
+ */
+static uint64_t
+t_aggregate_hash(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	assert(s != NULL);
+
+	for (; *s != '\0'; s++) {
+		h ^= (unsigned char)*s;
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return (h);
+}
+
+
+/*
+ * count val for the file number file in the hash table of k.
+ *
+ * @return
+ *   -1 on error (malloc(3) failed), 0 on success.
+ */
+static int
+t_aggregate_count(struct t_aggregate_key *k, const char *val,
+    unsigned long file)
+{
+	struct t_aggregate_slot *s, *slots;
+	uint64_t h;
+	size_t i, j, size;
+
+	assert(k != NULL);
+	assert(val != NULL);
+
+	/* grow the table first, so there is always an empty slot */
+	if (2 * (k->count + 1) > k->size) {
+		size = (k->size == 0 ? T_AGGREGATE_INITSIZE : 2 * k->size);
+		if ((slots = calloc(size, sizeof(*slots))) == NULL)
+			return (-1);
+		for (i = 0; i < k->size; i++) {
+			if (k->slots[i].val == NULL)
+				continue;
+			j = k->slots[i].hash & (size - 1);
+			while (slots[j].val != NULL)
+				j = (j + 1) & (size - 1);
+			slots[j] = k->slots[i];
+		}
+		free(k->slots);
+		k->slots = slots;
+		k->size  = size;
+	}
+
+	h = t_aggregate_hash(val);
+	for (i = h & (k->size - 1); ; i = (i + 1) & (k->size - 1)) {
+		s = &k->slots[i];
+		if (s->val == NULL) {
+			if ((s->val = strdup(val)) == NULL)
+				return (-1);
+			s->hash = h;
+			k->count++;
+			break;
+		}
+		if (s->hash == h && strcmp(s->val, val) == 0)
+			break;
+	}
+	if (s->seen != file) {
+		s->seen = file;
+		s->count++;
+	}
+
+	return (0);
+}
+
+
+static void
+t_aggregate_hll_add(struct t_aggregate_key *k, uint64_t h)
+{
+	uint64_t w;
+	size_t j;
+	uint8_t rho;
+
+	assert(k != NULL);
+	assert(k->registers != NULL);
+
+	/* the first bits select the register, rho is the position of the first
+	   1 bit in the others */
+	j = h >> (64 - T_AGGREGATE_HLL_BITS);
+	w = h << T_AGGREGATE_HLL_BITS;
+	for (rho = 1; rho <= 64 - T_AGGREGATE_HLL_BITS; rho++) {
+		if (w & (UINT64_C(1) << 63))
+			break;
+		w <<= 1;
+	}
+	if (rho > k->registers[j])
+		k->registers[j] = rho;
+}
+
+
+static unsigned long
+t_aggregate_hll_estimate(const struct t_aggregate_key *k)
+{
+	const double m = T_AGGREGATE_HLL_SIZE;
+	double sum = 0, e;
+	size_t j, zeros = 0;
+
+	assert(k != NULL);
+	assert(k->registers != NULL);
+
+	for (j = 0; j < T_AGGREGATE_HLL_SIZE; j++) {
+		sum += ldexp(1.0, -k->registers[j]);
+		zeros += (k->registers[j] == 0);
+	}
+	e = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+	/* small range correction (linear counting). With a 64 bits hash, there
+	   is no need for the large range one. */
+	if (e <= 2.5 * m && zeros > 0)
+		e = m * log(m / zeros);
+
+	return ((unsigned long)(e + 0.5));
+}
+
+
+static int
+t_aggregate_print_key(const struct t_aggregate *ag,
+    const struct t_aggregate_key *k)
+{
+	int nprinted, success = 0;
+	unsigned long distinct;
+	char *title = NULL, *fmtdata = NULL, buf[64];
+	const struct t_aggregate_slot **sorted = NULL;
+	struct t_taglist *tlist = NULL;
+	size_t i, n;
+	extern const struct t_format *Fflag;
+
+	assert(ag != NULL);
+	assert(k != NULL);
+
+	if ((tlist = t_taglist_new()) == NULL)
+		goto cleanup;
+	distinct = (k->approx ? t_aggregate_hll_estimate(k) : k->count);
+	(void)snprintf(buf, sizeof(buf), "%lu", ag->files);
+	if (t_taglist_insert(tlist, "files", buf) == -1)
+		goto cleanup;
+	(void)snprintf(buf, sizeof(buf), "%lu", k->missing);
+	if (t_taglist_insert(tlist, "missing", buf) == -1)
+		goto cleanup;
+	(void)snprintf(buf, sizeof(buf), "%lu", distinct);
+	if (t_taglist_insert(tlist, "distinct", buf) == -1)
+		goto cleanup;
+
+	if (k->count > 0) {
+		sorted = calloc(k->count, sizeof(*sorted));
+		if (sorted == NULL)
+			goto cleanup;
+		for (i = n = 0; i < k->size; i++) {
+			if (k->slots[i].val != NULL)
+				sorted[n++] = &k->slots[i];
+		}
+		assert(n == k->count);
+		qsort(sorted, n, sizeof(*sorted), t_aggregate_slotcmp);
+		for (i = 0; i < n; i++) {
+			char *val;
+			int status;
+			if (asprintf(&val, "%lu %s", sorted[i]->count,
+			    sorted[i]->val) < 0)
+				goto cleanup;
+			status = t_taglist_insert(tlist, k->key, val);
+			free(val);
+			if (status == -1)
+				goto cleanup;
+		}
+	}
+
+	if (asprintf(&title, "aggregate:%s%s", (k->approx ? "#" : ""),
+	    k->key) < 0) {
+		title = NULL;
+		goto cleanup;
+	}
+	if (t_format_load(Fflag) == -1)
+		goto cleanup;
+	if ((fmtdata = Fflag->tags2fmt(tlist, title)) == NULL)
+		goto cleanup;
+	nprinted = printf("%s\n", fmtdata);
+	if (nprinted > 0) {
+		// +1 for the trailing \n
+		success = ((unsigned)nprinted == (strlen(fmtdata) + 1));
+	}
+
+	/* FALLTHROUGH */
+cleanup:
+	free(fmtdata);
+	free(title);
+	free(sorted);
+	t_taglist_delete(tlist);
+	return (success ? 0 : -1);
+}
+
+
+static int
+t_aggregate_slotcmp(const void *va, const void *vb)
+{
+	const struct t_aggregate_slot *a, *b;
+
+	assert(va != NULL);
+	assert(vb != NULL);
+
+	a = *(const struct t_aggregate_slot * const *)va;
+	b = *(const struct t_aggregate_slot * const *)vb;
+
+	if (a->count != b->count)
+		return (a->count > b->count ? -1 : 1);
+	return (strcmp(a->val, b->val));
+}
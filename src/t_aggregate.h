@@ -0,0 +1,62 @@
+#ifndef T_AGGREGATE_H
+#define T_AGGREGATE_H
+/*
+ * t_aggregate.h
+ *
+ * streaming statistics about tag values (the aggregate action).
+ *
+ * For each aggregated key, the number of files having each value is counted
+ * in a hash table as files are added, so the memory used depends on the
+ * number of distinct values and not on the number of files. For a key given
+ * as #KEY only the number of distinct values is estimated, with a HyperLogLog
+ * of constant size (about 1% of error).
+ */
+#include "t_config.h"
+#include "t_taglist.h"
+
+
+/* HyperLogLog precision, it use 2^T_AGGREGATE_HLL_BITS one byte registers */
+#define	T_AGGREGATE_HLL_BITS	14
+
+struct t_aggregate;
+
+/*
+ * create an aggregate for the comma separated list of tag keys keys, like
+ * `genre,#artist'.
+ *
+ * @return
+ *   A t_aggregate that should be passed to t_aggregate_delete() after use, or
+ *   NULL on error and errno is set to EINVAL (a warning is displayed) or ENOMEM.
+ */
+struct t_aggregate	*t_aggregate_new(const char *keys);
+
+/*
+ * count the values of the aggregated keys in tlist (a file).
+ *
+ * A file having the same value more than once is counted once for it. tlist
+ * is not referenced after the call.
+ *
+ * @return
+ *   -1 on error (malloc(3) failed), 0 on success.
+ */
+int	t_aggregate_add(struct t_aggregate *ag, const struct t_taglist *tlist);
+
+/*
+ * display the statistics using the -F format.
+ *
+ * For each key a tag list is displayed, with the number of files counted,
+ * the number of files without the key, the number of distinct values and
+ * then (unless approximated) one `KEY: COUNT VALUE' tag for each value, by
+ * decreasing count.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_aggregate_print(const struct t_aggregate *ag);
+
+/*
+ * free an aggregate and all its values.
+ */
+void	t_aggregate_delete(struct t_aggregate *ag);
+
+#endif /* ndef T_AGGREGATE_H */
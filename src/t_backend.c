@@ -3,17 +3,91 @@
  *
  * backends functions for tagutil
  */
+#if defined(WITH_PLUGINS)
+#	include <fcntl.h>
+#endif
+
 #include "t_config.h"
 #include "t_toolkit.h"
 
 #include "t_backend.h"
+#if defined(WITH_PLUGINS)
+#	include "t_plugin.h"
+#endif
 
 
 struct t_backend	*t_ftflac_backend(void) t__weak;
 struct t_backend	*t_ftoggvorbis_backend(void) t__weak;
+struct t_backend	*t_ftid3v2_backend(void) t__weak;
 struct t_backend	*t_fttaglib_backend(void) t__weak;
 struct t_backend	*t_ftid3v1_backend(void) t__weak;
 
+#if defined(WITH_PLUGINS)
+/*
+ * backends built as plugins. Until loaded by t_backend_load(), their entry in
+ * the backend queue is a proxy with only libid and desc set (they must match
+ * the plugin's ones). match() check the file signature so that a plugin is
+ * not loaded for files it can't handle.
+ */
+struct t_backend_plugin {
+	struct t_backend	 proxy;
+	const char		*module;
+	const char		*symbol;
+	int			(*match)(int fd);
+	int			 failed; /* 1 if the plugin could not be loaded */
+};
+
+#if defined(WITH_FLAC)
+static int	t_backend_match_flac(int fd);
+static struct t_backend_plugin	t_ftflac_plugin = {
+	.proxy	= {
+		.libid	= "libFLAC",
+		.desc	= "Free Lossless Audio Codec (FLAC) files format",
+	},
+	.module	= "t_ftflac",
+	.symbol	= "t_ftflac_backend",
+	.match	= t_backend_match_flac,
+};
+#endif
+#if defined(WITH_OGGVORBIS)
+static int	t_backend_match_ogg(int fd);
+static struct t_backend_plugin	t_ftoggvorbis_plugin = {
+	.proxy	= {
+		.libid	= "libvorbis",
+		.desc	= "Ogg/Vorbis files format",
+	},
+	.module	= "t_ftoggvorbis",
+	.symbol	= "t_ftoggvorbis_backend",
+	.match	= t_backend_match_ogg,
+};
+#endif
+#if defined(WITH_TAGLIB)
+static int	t_backend_match_any(int fd);
+static struct t_backend_plugin	t_fttaglib_plugin = {
+	.proxy	= {
+		.libid	= "TagLib",
+		.desc	= "various file formats, using TagLib properties",
+	},
+	.module	= "t_fttaglib",
+	.symbol	= "t_fttaglib_backend",
+	.match	= t_backend_match_any,
+};
+#endif
+
+static struct t_backend_plugin	*t_backend_plugins[] = {
+#if defined(WITH_FLAC)
+	&t_ftflac_plugin,
+#endif
+#if defined(WITH_OGGVORBIS)
+	&t_ftoggvorbis_plugin,
+#endif
+#if defined(WITH_TAGLIB)
+	&t_fttaglib_plugin,
+#endif
+	NULL,
+};
+#endif /* WITH_PLUGINS */
+
 
 const struct t_backendQ *
 t_all_backends(void)
@@ -27,14 +101,30 @@ t_all_backends(void)
 		/* FLAC files support using libflac */
 		if (t_ftflac_backend != NULL)
 			TAILQ_INSERT_TAIL(&bQ, t_ftflac_backend(), entries);
+#if defined(WITH_PLUGINS) && defined(WITH_FLAC)
+		else
+			TAILQ_INSERT_TAIL(&bQ, &t_ftflac_plugin.proxy, entries);
+#endif
 
 		/* Ogg/Vorbis files support using libogg/libvorbis */
 		if (t_ftoggvorbis_backend != NULL)
 			TAILQ_INSERT_TAIL(&bQ, t_ftoggvorbis_backend(), entries);
+#if defined(WITH_PLUGINS) && defined(WITH_OGGVORBIS)
+		else
+			TAILQ_INSERT_TAIL(&bQ, &t_ftoggvorbis_plugin.proxy, entries);
+#endif
+
+		/* mp3 ID3v2.3 and ID3v2.4 files support */
+		if (t_ftid3v2_backend != NULL)
+			TAILQ_INSERT_TAIL(&bQ, t_ftid3v2_backend(), entries);
 
 		/* Multiple files types support using TagLib */
 		if (t_fttaglib_backend != NULL)
 			TAILQ_INSERT_TAIL(&bQ, t_fttaglib_backend(), entries);
+#if defined(WITH_PLUGINS) && defined(WITH_TAGLIB)
+		else
+			TAILQ_INSERT_TAIL(&bQ, &t_fttaglib_plugin.proxy, entries);
+#endif
 
 		/* mp3 ID3v1.1 files types support */
 		if (t_ftid3v1_backend != NULL)
@@ -45,3 +135,163 @@ t_all_backends(void)
 
 	return (&bQ);
 }
+
+
+int
+t_backend_load(const struct t_backend *b, const char *path)
+{
+#if defined(WITH_PLUGINS)
+	struct t_backend_plugin *p;
+	const struct t_backend *plugin;
+	size_t i;
+	int fd, match;
+#endif
+
+	assert(b != NULL);
+	assert(path != NULL);
+
+	if (b->init != NULL)
+		return (0);
+#if defined(WITH_PLUGINS)
+	for (i = 0; (p = t_backend_plugins[i]) != NULL; i++) {
+		if (&p->proxy == b)
+			break;
+	}
+	if (p == NULL || p->failed)
+		return (-1);
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (-1);
+	match = p->match(fd);
+	(void)close(fd);
+	if (!match)
+		return (-1);
+
+	if ((plugin = t_plugin_load(p->module, p->symbol)) == NULL) {
+		/* don't try again for the next files */
+		p->failed = 1;
+		return (-1);
+	}
+	p->proxy.init  = plugin->init;
+	p->proxy.read  = plugin->read;
+	p->proxy.write = plugin->write;
+	p->proxy.clear = plugin->clear;
+	return (0);
+#else
+	return (-1);
+#endif
+}
+
+
+/* write statistics */
+static unsigned long	t_backend_ninplace;
+static unsigned long	t_backend_nrewrite;
+static unsigned long	t_backend_nrefused;
+
+
+size_t
+t_backend_padding(size_t current)
+{
+	size_t grown;
+	extern size_t	 Pflag_reserve;
+	extern unsigned	 Pflag_growth;
+
+	grown = current * Pflag_growth;
+	/* overflow check */
+	if (Pflag_growth > 0 && grown / Pflag_growth != current)
+		grown = current;
+
+	return (grown > Pflag_reserve ? grown : Pflag_reserve);
+}
+
+
+int
+t_backend_may_rewrite(const char *path)
+{
+	extern int Rflag;
+
+	assert(path != NULL);
+
+	if (Rflag) {
+		warnx("%s: not enough padding and rewrite refused (-R)", path);
+		t_backend_nrefused++;
+		return (0);
+	}
+	return (1);
+}
+
+
+void
+t_backend_count_write(int inplace)
+{
+
+	if (inplace)
+		t_backend_ninplace++;
+	else
+		t_backend_nrewrite++;
+}
+
+
+void
+t_backend_stats(FILE *fp)
+{
+
+	assert(fp != NULL);
+
+	(void)fprintf(fp, "in place writes:  %lu\n", t_backend_ninplace);
+	(void)fprintf(fp, "full rewrites:    %lu\n", t_backend_nrewrite);
+	(void)fprintf(fp, "refused rewrites: %lu\n", t_backend_nrefused);
+}
+
+
+#if defined(WITH_PLUGINS)
+#if defined(WITH_FLAC)
+/*
+ * FLAC stream marker, possibly preceded by an ID3v2 tag (libFLAC skip it).
+ */
+static int
+t_backend_match_flac(int fd)
+{
+	unsigned char hdr[10];
+	off_t offset;
+
+	if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return (0);
+	if (memcmp(hdr, "ID3", 3) == 0) {
+		offset = 10 + ((off_t)(hdr[6] & 0x7F) << 21 |
+		    (off_t)(hdr[7] & 0x7F) << 14 | (off_t)(hdr[8] & 0x7F) << 7 |
+		    (off_t)(hdr[9] & 0x7F));
+		if (hdr[5] & 0x10) /* footer */
+			offset += 10;
+		if (pread(fd, hdr, 4, offset) != 4)
+			return (0);
+	}
+	return (memcmp(hdr, "fLaC", 4) == 0);
+}
+#endif
+
+
+#if defined(WITH_OGGVORBIS)
+static int
+t_backend_match_ogg(int fd)
+{
+	unsigned char hdr[4];
+
+	if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return (0);
+	return (memcmp(hdr, "OggS", 4) == 0);
+}
+#endif
+
+
+#if defined(WITH_TAGLIB)
+/*
+ * TagLib handle a lot of formats, it pick one from the file extension.
+ */
+static int
+t_backend_match_any(t__unused int fd)
+{
+	return (1);
+}
+#endif
+#endif /* WITH_PLUGINS */
@@ -73,4 +73,57 @@ TAILQ_HEAD(t_backendQ, t_backend);
  */
 const struct t_backendQ	*t_all_backends(void);
 
+/*
+ * make sure a backend from t_all_backends() is ready to be used for a file.
+ *
+ * Backends built as plugins have NULL member functions until loaded by this
+ * function, which is only done for files matching the signature of the format
+ * they handle. For other backends this is a no-op.
+ *
+ * @return
+ *   0 if b->init can be called for path, -1 otherwise.
+ */
+int	t_backend_load(const struct t_backend *b, const char *path);
+
+/*
+ * padding policy for backends able to update tags in place.
+ *
+ * When the new tags don't fit into the file's padding, the whole file has to
+ * be rewritten. Since it is rewritten anyway, the backend should reserve
+ * enough padding so that the following writes can be done in place.
+ *
+ * @param current
+ *   The size (in bytes) of the padding that was too small to hold the new
+ *   tags.
+ *
+ * @return
+ *   The padding size (in bytes) to reserve while rewriting the file.
+ */
+size_t	t_backend_padding(size_t current);
+
+/*
+ * check if a backend is allowed to rewrite the whole file (see the
+ * --no-rewrite option). A warning is displayed if not.
+ *
+ * @param path
+ *   The path of the file to rewrite, used for the warning message.
+ *
+ * @return
+ *   1 if the file can be rewritten, 0 otherwise.
+ */
+int	t_backend_may_rewrite(const char *path);
+
+/*
+ * account a successful write, displayed at exit with the --stats option.
+ *
+ * @param inplace
+ *   1 if the tags were updated in place, 0 if the whole file was rewritten.
+ */
+void	t_backend_count_write(int inplace);
+
+/*
+ * display the write statistics gathered by t_backend_count_write().
+ */
+void	t_backend_stats(FILE *fp);
+
 #endif /* ndef T_BACKEND_H */
@@ -0,0 +1,444 @@
+/*
+ * t_cache.c
+ *
+ * persistent tag cache.
+ *
+ * The cache file layout is a header, followed by the entries sorted by device
+ * and inode (so that they can be searched in place with bsearch(3)), followed
+ * by the data area. The data of an entry is a sequence of NUL terminated
+ * strings: the backend libid and then each tag key and value. Integers are
+ * stored in native byte order, the cache file is not meant to be shared across
+ * machines.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "t_config.h"
+#include "t_toolkit.h"
+#include "t_taglist.h"
+#include "t_cache.h"
+
+
+#define	T_CACHE_MAGIC	"tagutil"
+#define	T_CACHE_VERSION	1
+
+struct t_cache_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	count;	/* number of entries */
+};
+
+struct t_cache_entry {
+	uint64_t	dev;
+	uint64_t	ino;
+	int64_t		size;
+	int64_t		mtime_sec;
+	int64_t		mtime_nsec;
+	int64_t		ctime_sec;
+	int64_t		ctime_nsec;
+	uint64_t	offset;	/* of the data, from the start of the data area */
+	uint64_t	len;	/* of the data */
+};
+
+/* an entry with its data, either from the cache file or stored */
+struct t_cache_record {
+	struct t_cache_entry	 e;
+	char			*data;
+	size_t			 seq;	/* t_cache_store() call order */
+};
+
+static struct {
+	char	*path;
+	char	*map;	/* the cache file, mmap(2)'ed */
+	size_t	 mapsize;
+	const struct t_cache_entry	*entries; /* in map */
+	size_t	 count;
+	char	*data;	/* the data area, in map */
+	size_t	 datasize;
+	struct t_cache_record	*stored;
+	size_t	 nstored;
+	size_t	 capacity;
+} t_cache;
+
+
+static void	t_cache_key(struct t_cache_entry *e, const struct stat *sb);
+static int	t_cache_cmp(const void *a, const void *b);
+static int	t_cache_seqcmp(const void *a, const void *b);
+static int	t_cache_write(FILE *fp, const struct t_cache_record *out,
+		    size_t count);
+
+
+int
+t_cache_open(const char *path)
+{
+	const struct t_cache_header *h;
+	struct stat st;
+	int fd = -1;
+
+	assert(path != NULL);
+	assert(t_cache.path == NULL);
+
+	if ((t_cache.path = strdup(path)) == NULL)
+		return (-1);
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno == ENOENT)
+			return (0); /* empty cache */
+		goto error;
+	}
+	if (fstat(fd, &st) == -1)
+		goto error;
+	if (st.st_size == 0) {
+		(void)close(fd);
+		return (0);
+	}
+	t_cache.mapsize = (size_t)st.st_size;
+	t_cache.map = mmap(NULL, t_cache.mapsize, PROT_READ, MAP_SHARED, fd, 0);
+	if (t_cache.map == MAP_FAILED) {
+		t_cache.map = NULL;
+		goto error;
+	}
+	(void)close(fd);
+	fd = -1;
+
+	h = (const struct t_cache_header *)(void *)t_cache.map;
+	if (t_cache.mapsize < sizeof(struct t_cache_header) ||
+	    memcmp(h->magic, T_CACHE_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != T_CACHE_VERSION ||
+	    h->count > (t_cache.mapsize - sizeof(struct t_cache_header)) /
+	    sizeof(struct t_cache_entry)) {
+		/* start over, the file will be replaced on t_cache_close() */
+		warnx("%s: invalid cache file, ignored", path);
+		(void)munmap(t_cache.map, t_cache.mapsize);
+		t_cache.map = NULL;
+		return (0);
+	}
+	t_cache.count    = h->count;
+	t_cache.entries  = (const struct t_cache_entry *)(const void *)
+	    (t_cache.map + sizeof(struct t_cache_header));
+	t_cache.data     = (char *)(void *)(t_cache.entries + t_cache.count);
+	t_cache.datasize = t_cache.mapsize - (size_t)(t_cache.data - t_cache.map);
+	return (0);
+error:
+	if (fd != -1)
+		(void)close(fd);
+	free(t_cache.path);
+	t_cache.path = NULL;
+	return (-1);
+}
+
+
+int
+t_cache_enabled(void)
+{
+
+	return (t_cache.path != NULL);
+}
+
+
+struct t_taglist *
+t_cache_lookup(const struct stat *sb, const char **libid)
+{
+	struct t_cache_entry key;
+	const struct t_cache_entry *e;
+	struct t_taglist *tlist;
+	const char *p, *end, *k;
+
+	assert(sb != NULL);
+	assert(libid != NULL);
+
+	if (t_cache.count == 0)
+		return (NULL);
+
+	t_cache_key(&key, sb);
+	e = bsearch(&key, t_cache.entries, t_cache.count,
+	    sizeof(struct t_cache_entry), t_cache_cmp);
+	if (e == NULL || e->size != key.size ||
+	    e->mtime_sec != key.mtime_sec || e->mtime_nsec != key.mtime_nsec ||
+	    e->ctime_sec != key.ctime_sec || e->ctime_nsec != key.ctime_nsec)
+		return (NULL);
+
+	/* the data must be NUL terminated and within the data area */
+	if (e->offset > t_cache.datasize || e->len == 0 ||
+	    e->len > t_cache.datasize - e->offset)
+		return (NULL);
+	p   = t_cache.data + e->offset;
+	end = p + e->len;
+	if (end[-1] != '\0')
+		return (NULL);
+
+	if ((tlist = t_taglist_new()) == NULL)
+		return (NULL);
+	*libid = p;
+	p += strlen(p) + 1;
+	while (p < end) {
+		k  = p;
+		p += strlen(p) + 1;
+		if (p == end) /* a key without value */
+			goto error;
+		if (t_taglist_insert(tlist, k, p) == -1)
+			goto error;
+		p += strlen(p) + 1;
+	}
+
+	return (tlist);
+error:
+	t_taglist_delete(tlist);
+	return (NULL);
+}
+
+
+int
+t_cache_store(const struct stat *sb, const char *libid,
+    const struct t_taglist *tlist)
+{
+	struct t_cache_record *r;
+	const struct t_tag *t;
+	size_t len;
+	char *p;
+
+	assert(sb != NULL);
+	assert(libid != NULL);
+	assert(tlist != NULL);
+
+	if (t_cache.nstored == t_cache.capacity) {
+		size_t capacity = t_cache.capacity ? t_cache.capacity * 2 : 64;
+		if (capacity > SIZE_MAX / sizeof(struct t_cache_record)) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		r = realloc(t_cache.stored,
+		    capacity * sizeof(struct t_cache_record));
+		if (r == NULL)
+			return (-1);
+		t_cache.stored   = r;
+		t_cache.capacity = capacity;
+	}
+
+	len = strlen(libid) + 1;
+	TAILQ_FOREACH(t, tlist->tags, entries)
+		len += t->klen + 1 + t->vlen + 1;
+	if ((p = malloc(len)) == NULL)
+		return (-1);
+
+	r = &t_cache.stored[t_cache.nstored];
+	t_cache_key(&r->e, sb);
+	r->e.len = len;
+	r->data  = p;
+	r->seq   = t_cache.nstored++;
+	len = strlen(libid) + 1;
+	(void)memcpy(p, libid, len);
+	p += len;
+	TAILQ_FOREACH(t, tlist->tags, entries) {
+		(void)memcpy(p, t->key, t->klen + 1);
+		p += t->klen + 1;
+		(void)memcpy(p, t->val, t->vlen + 1);
+		p += t->vlen + 1;
+	}
+
+	return (0);
+}
+
+
+int
+t_cache_close(void)
+{
+	struct t_cache_record *out = NULL;
+	size_t i, j, n;
+	char *tempfile = NULL;
+	FILE *fp = NULL;
+	int fd, k, ret = -1;
+
+	if (t_cache.path == NULL)
+		return (0);
+	if (t_cache.nstored == 0) {
+		ret = 0;
+		goto cleanup;
+	}
+
+	/* sort the stored entries, keeping only the last one for each file */
+	qsort(t_cache.stored, t_cache.nstored, sizeof(struct t_cache_record),
+	    t_cache_seqcmp);
+	for (i = n = 0; i < t_cache.nstored; i++) {
+		if (i + 1 < t_cache.nstored &&
+		    t_cache_cmp(&t_cache.stored[i], &t_cache.stored[i + 1]) == 0) {
+			free(t_cache.stored[i].data);
+			continue;
+		}
+		t_cache.stored[n++] = t_cache.stored[i];
+	}
+	t_cache.nstored = n;
+
+	/* merge them with the cache file entries */
+	out = calloc(t_cache.count + t_cache.nstored, sizeof(struct t_cache_record));
+	if (out == NULL)
+		goto cleanup;
+	i = j = n = 0;
+	while (i < t_cache.count || j < t_cache.nstored) {
+		int cmp;
+		if (i == t_cache.count)
+			cmp = 1;
+		else if (j == t_cache.nstored)
+			cmp = -1;
+		else
+			cmp = t_cache_cmp(&t_cache.entries[i], &t_cache.stored[j]);
+		if (cmp < 0) {
+			const struct t_cache_entry *e = &t_cache.entries[i++];
+			/* drop the entries pointing outside the data area */
+			if (e->offset > t_cache.datasize ||
+			    e->len > t_cache.datasize - e->offset)
+				continue;
+			out[n].e    = *e;
+			out[n].data = t_cache.data + e->offset;
+			n++;
+		} else {
+			if (cmp == 0) /* replaced */
+				i++;
+			out[n++] = t_cache.stored[j++];
+		}
+	}
+
+	/* write the new cache file next to the old one and replace it */
+	if (asprintf(&tempfile, "%s.XXXXXX", t_cache.path) < 0) {
+		tempfile = NULL;
+		goto cleanup;
+	}
+	if ((fd = mkstemp(tempfile)) == -1)
+		goto cleanup;
+	if (t_fchmod_umask(fd) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		(void)close(fd);
+		goto cleanup;
+	}
+	if (t_cache_write(fp, out, n) == -1)
+		goto cleanup;
+	k = fclose(fp);
+	fp = NULL;
+	if (k != 0)
+		goto cleanup;
+	if (rename(tempfile, t_cache.path) == -1)
+		goto cleanup;
+	free(tempfile);
+	tempfile = NULL;
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	if (ret == -1)
+		warn("%s", t_cache.path);
+	if (fp != NULL)
+		(void)fclose(fp);
+	if (tempfile != NULL) {
+		(void)unlink(tempfile);
+		free(tempfile);
+	}
+	free(out);
+	for (i = 0; i < t_cache.nstored; i++)
+		free(t_cache.stored[i].data);
+	free(t_cache.stored);
+	if (t_cache.map != NULL)
+		(void)munmap(t_cache.map, t_cache.mapsize);
+	free(t_cache.path);
+	bzero(&t_cache, sizeof(t_cache));
+	return (ret);
+}
+
+
+/*
+ * fill the file identity and version fields of e from sb.
+ */
+static void
+t_cache_key(struct t_cache_entry *e, const struct stat *sb)
+{
+
+	assert(e != NULL);
+	assert(sb != NULL);
+
+	bzero(e, sizeof(struct t_cache_entry));
+	e->dev        = (uint64_t)sb->st_dev;
+	e->ino        = (uint64_t)sb->st_ino;
+	e->size       = (int64_t)sb->st_size;
+	e->mtime_sec  = (int64_t)sb->st_mtim.tv_sec;
+	e->mtime_nsec = (int64_t)sb->st_mtim.tv_nsec;
+	e->ctime_sec  = (int64_t)sb->st_ctim.tv_sec;
+	e->ctime_nsec = (int64_t)sb->st_ctim.tv_nsec;
+}
+
+
+/*
+ * compare two entries (or records, e is their first member) by file identity.
+ */
+static int
+t_cache_cmp(const void *a, const void *b)
+{
+	const struct t_cache_entry *x = a, *y = b;
+
+	if (x->dev != y->dev)
+		return (x->dev < y->dev ? -1 : 1);
+	if (x->ino != y->ino)
+		return (x->ino < y->ino ? -1 : 1);
+	return (0);
+}
+
+
+/*
+ * compare two records by file identity, and then by t_cache_store() call
+ * order.
+ */
+static int
+t_cache_seqcmp(const void *a, const void *b)
+{
+	const struct t_cache_record *x = a, *y = b;
+	int cmp;
+
+	if ((cmp = t_cache_cmp(&x->e, &y->e)) != 0)
+		return (cmp);
+	return (x->seq < y->seq ? -1 : (x->seq > y->seq));
+}
+
+
+/*
+ * write the header, the entries and the data area of a cache file.
+ */
+static int
+t_cache_write(FILE *fp, const struct t_cache_record *out, size_t count)
+{
+	struct t_cache_header h;
+	struct t_cache_entry e;
+	uint64_t offset = 0;
+	size_t i;
+
+	assert(fp != NULL);
+
+	if (count > UINT32_MAX) {
+		errno = EFBIG;
+		return (-1);
+	}
+	bzero(&h, sizeof(h));
+	(void)memcpy(h.magic, T_CACHE_MAGIC, sizeof(h.magic));
+	h.version = T_CACHE_VERSION;
+	h.count   = (uint32_t)count;
+	if (fwrite(&h, sizeof(h), 1, fp) != 1)
+		return (-1);
+
+	for (i = 0; i < count; i++) {
+		e = out[i].e;
+		e.offset = offset;
+		offset  += e.len;
+		if (fwrite(&e, sizeof(e), 1, fp) != 1)
+			return (-1);
+	}
+	for (i = 0; i < count; i++) {
+		if (fwrite(out[i].data, (size_t)out[i].e.len, 1, fp) != 1)
+			return (-1);
+	}
+
+	return (0);
+}
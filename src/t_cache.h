@@ -0,0 +1,76 @@
+#ifndef T_CACHE_H
+#define T_CACHE_H
+/*
+ * t_cache.h
+ *
+ * persistent tag cache (see the -C option).
+ *
+ * The cache file map a file identity (device and inode) to the tags read from
+ * the file and the libid of the backend used. An entry is only valid while the
+ * file's size, modification time and change time are the ones recorded with
+ * it, so that checking the cache for an unchanged file cost a single stat(2).
+ *
+ * The cache file is mapped in memory by t_cache_open() and never modified.
+ * New entries are kept in memory and t_cache_close() write a new cache file
+ * that replace the old one. When two tagutil processes share a cache file, the
+ * last one to exit wins (the entries of the other are lost, not corrupted).
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "t_config.h"
+#include "t_taglist.h"
+
+
+/*
+ * open the cache file at path. A missing file is an empty cache, it will be
+ * created by t_cache_close().
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_cache_open(const char *path);
+
+/*
+ * @return
+ *   1 if a cache file has been opened, 0 otherwise.
+ */
+int	t_cache_enabled(void);
+
+/*
+ * find the cached tags of a file.
+ *
+ * @param sb
+ *   The stat(2) of the file.
+ *
+ * @param libid
+ *   Set to the libid of the backend used to read the tags. It is valid until
+ *   t_cache_close() is called.
+ *
+ * @return
+ *   NULL if the file is not in the cache (or its entry is outdated) or on
+ *   error, the tags otherwise. The caller should pass the returned t_taglist to
+ *   t_taglist_delete() after use.
+ */
+struct t_taglist	*t_cache_lookup(const struct stat *sb, const char **libid);
+
+/*
+ * add or replace the entry of a file. Entries stored are not seen by
+ * t_cache_lookup() before the next run.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_cache_store(const struct stat *sb, const char *libid,
+	    const struct t_taglist *tlist);
+
+/*
+ * write the new cache file if entries were stored, and release all the
+ * resources used by the cache.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_cache_close(void);
+
+#endif /* ndef T_CACHE_H */
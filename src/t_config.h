@@ -49,10 +49,11 @@
 
 /*
  * macOS is the only known platform to provide these alternatives names to POSIX
- * st_mtim members.
+ * st_mtim and st_ctim members.
  */
 #if defined(__APPLE__)
 #	define st_mtim st_mtimespec
+#	define st_ctim st_ctimespec
 #endif
 
 #endif /* ndef T_CONFIG_H */
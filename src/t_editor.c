@@ -30,6 +30,8 @@ t_edit(struct t_tune *tune)
 	assert(tune != NULL);
 
 	/* convert the tags into the requested format */
+	if (t_format_load(Fflag) == -1)
+		goto out;
 	tlist = t_tune_tags(tune);
 	if (tlist == NULL)
 		goto out;
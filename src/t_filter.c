@@ -0,0 +1,363 @@
+/*
+ * t_filter.c
+ *
+ * tag list filters for tagutil.
+ *
+ * Expressions are compiled by a recursive descent parser into a tree, which is
+ * then evaluated for each tag list.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "t_config.h"
+#include "t_toolkit.h"
+#include "t_tag.h"
+#include "t_taglist.h"
+#include "t_filter.h"
+
+
+/* characters ending a key and a value */
+#define	T_FILTER_KEYEND	"=!<>&|()"
+#define	T_FILTER_VALEND	"&|()"
+
+
+/* parser rules, each one advance *cp past what it parsed */
+static struct t_filter	*t_filter_or(const char **cp);
+static struct t_filter	*t_filter_and(const char **cp);
+static struct t_filter	*t_filter_unary(const char **cp);
+static struct t_filter	*t_filter_comparison(const char **cp);
+static char		*t_filter_word(const char **cp, const char *end);
+
+static struct t_filter	*t_filter_new(enum t_filter_op op,
+			    struct t_filter *lhs, struct t_filter *rhs);
+static int		 t_filter_number(const char *s, double *d);
+static int		 t_filter_eval(const struct t_filter *f,
+			    const struct t_taglist *tlist);
+
+
+struct t_filter *
+t_filter_parse(const char *expr)
+{
+	struct t_filter *f;
+	const char *c = expr;
+
+	assert(expr != NULL);
+
+	if ((f = t_filter_or(&c)) == NULL)
+		return (NULL);
+	if (*c != '\0') {
+		/* only an unbalanced `)' can stop the parser early */
+		warnx("where: unexpected `%c' in `%s'", *c, expr);
+		t_filter_delete(f);
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	return (f);
+}
+
+
+int
+t_filter_match(const struct t_filter *filter, const struct t_taglist *tlist)
+{
+
+	assert(filter != NULL);
+	assert(tlist != NULL);
+
+	return (t_filter_eval(filter, tlist));
+}
+
+
+int
+t_filter_value_match(const struct t_filter *filter, const char *val)
+{
+	double d;
+	int cmp;
+
+	assert(filter != NULL);
+	assert(val != NULL);
+
+	if (filter->op == T_FILTER_HAS)
+		return (1);
+
+	if (filter->isnum && t_filter_number(val, &d))
+		cmp = (d < filter->num ? -1 : (d > filter->num));
+	else
+		cmp = strcmp(val, filter->val);
+
+	switch (filter->op) {
+	case T_FILTER_LT:
+		return (cmp < 0);
+	case T_FILTER_LE:
+		return (cmp <= 0);
+	case T_FILTER_GT:
+		return (cmp > 0);
+	case T_FILTER_GE:
+		return (cmp >= 0);
+	case T_FILTER_EQ: /* FALLTHROUGH */
+	case T_FILTER_NE:
+		return (cmp == 0);
+	default:
+		/* not a comparison */
+		ABANDON_SHIP();
+	}
+}
+
+
+void
+t_filter_delete(struct t_filter *filter)
+{
+
+	if (filter != NULL) {
+		t_filter_delete(filter->lhs);
+		t_filter_delete(filter->rhs);
+		free(filter->key);
+		free(filter->val);
+	}
+	free(filter);
+}
+
+
+/* or := and ('|' and)* */
+static struct t_filter *
+t_filter_or(const char **cp)
+{
+	struct t_filter *f, *rhs, *or;
+
+	if ((f = t_filter_and(cp)) == NULL)
+		return (NULL);
+	while (**cp == '|') {
+		*cp += 1;
+		if ((rhs = t_filter_and(cp)) == NULL)
+			goto error_label;
+		if ((or = t_filter_new(T_FILTER_OR, f, rhs)) == NULL) {
+			t_filter_delete(rhs);
+			goto error_label;
+		}
+		f = or;
+	}
+
+	return (f);
+error_label:
+	t_filter_delete(f);
+	return (NULL);
+}
+
+
+/* and := unary ('&' unary)* */
+static struct t_filter *
+t_filter_and(const char **cp)
+{
+	struct t_filter *f, *rhs, *and;
+
+	if ((f = t_filter_unary(cp)) == NULL)
+		return (NULL);
+	while (**cp == '&') {
+		*cp += 1;
+		if ((rhs = t_filter_unary(cp)) == NULL)
+			goto error_label;
+		if ((and = t_filter_new(T_FILTER_AND, f, rhs)) == NULL) {
+			t_filter_delete(rhs);
+			goto error_label;
+		}
+		f = and;
+	}
+
+	return (f);
+error_label:
+	t_filter_delete(f);
+	return (NULL);
+}
+
+
+/* unary := '!' unary | '(' or ')' | comparison */
+static struct t_filter *
+t_filter_unary(const char **cp)
+{
+	struct t_filter *f, *not;
+
+	switch (**cp) {
+	case '!':
+		*cp += 1;
+		if ((f = t_filter_unary(cp)) == NULL)
+			return (NULL);
+		if ((not = t_filter_new(T_FILTER_NOT, f, NULL)) == NULL) {
+			t_filter_delete(f);
+			return (NULL);
+		}
+		return (not);
+	case '(':
+		*cp += 1;
+		if ((f = t_filter_or(cp)) == NULL)
+			return (NULL);
+		if (**cp != ')') {
+			warnx("where: missing closing `)'");
+			t_filter_delete(f);
+			errno = EINVAL;
+			return (NULL);
+		}
+		*cp += 1;
+		return (f);
+	default:
+		return (t_filter_comparison(cp));
+	}
+}
+
+
+/* comparison := key [('=' | '!=' | '<' | '<=' | '>' | '>=') value] */
+static struct t_filter *
+t_filter_comparison(const char **cp)
+{
+	struct t_filter *f;
+	const char *c;
+
+	if ((f = t_filter_new(T_FILTER_HAS, NULL, NULL)) == NULL)
+		return (NULL);
+	if ((f->key = t_filter_word(cp, T_FILTER_KEYEND)) == NULL)
+		goto error_label;
+	if (*f->key == '\0') {
+		warnx("where: missing tag key");
+		errno = EINVAL;
+		goto error_label;
+	}
+
+	c = *cp;
+	switch (*c) {
+	case '=':
+		f->op = T_FILTER_EQ;
+		c += 1;
+		break;
+	case '!':
+		if (c[1] != '=') {
+			warnx("where: expected `!=' after `%s'", f->key);
+			errno = EINVAL;
+			goto error_label;
+		}
+		f->op = T_FILTER_NE;
+		c += 2;
+		break;
+	case '<':
+		f->op = (c[1] == '=' ? T_FILTER_LE : T_FILTER_LT);
+		c += (c[1] == '=' ? 2 : 1);
+		break;
+	case '>':
+		f->op = (c[1] == '=' ? T_FILTER_GE : T_FILTER_GT);
+		c += (c[1] == '=' ? 2 : 1);
+		break;
+	default:
+		/* a key alone */
+		return (f);
+	}
+	*cp = c;
+
+	if ((f->val = t_filter_word(cp, T_FILTER_VALEND)) == NULL)
+		goto error_label;
+	f->isnum = t_filter_number(f->val, &f->num);
+
+	return (f);
+error_label:
+	t_filter_delete(f);
+	return (NULL);
+}
+
+
+/*
+ * read a key or a value, up to a character in end (or the end of the string).
+ * `\' escape the next character.
+ */
+static char *
+t_filter_word(const char **cp, const char *end)
+{
+	struct sbuf *sb;
+	const char *c;
+	char *ret = NULL;
+
+	if ((sb = sbuf_new_auto()) == NULL)
+		return (NULL);
+
+	for (c = *cp; *c != '\0' && strchr(end, *c) == NULL; c++) {
+		if (*c == '\\') {
+			c += 1;
+			if (*c == '\0')
+				break;
+		}
+		(void)sbuf_putc(sb, *c);
+	}
+	*cp = c;
+
+	if (sbuf_finish(sb) != -1)
+		ret = strdup(sbuf_data(sb));
+	sbuf_delete(sb);
+	return (ret);
+}
+
+
+static struct t_filter *
+t_filter_new(enum t_filter_op op, struct t_filter *lhs, struct t_filter *rhs)
+{
+	struct t_filter *f;
+
+	if ((f = calloc(1, sizeof(struct t_filter))) == NULL)
+		return (NULL);
+	f->op  = op;
+	f->lhs = lhs;
+	f->rhs = rhs;
+
+	return (f);
+}
+
+
+/*
+ * parse s as a (finite, decimal) number.
+ *
+ * @return
+ *   1 if s is a number and then d is set, 0 otherwise.
+ */
+static int
+t_filter_number(const char *s, double *d)
+{
+	char *endptr;
+
+	assert(s != NULL);
+	assert(d != NULL);
+
+	/* reject what strtod(3) accept but doesn't look like a number to us,
+	   like leading spaces, "inf" or "nan". */
+	if (!isdigit((unsigned char)*s) && *s != '-' && *s != '+' && *s != '.')
+		return (0);
+	errno = 0;
+	*d = strtod(s, &endptr);
+	return (*endptr == '\0' && errno == 0 && isfinite(*d));
+}
+
+
+static int
+t_filter_eval(const struct t_filter *f, const struct t_taglist *tlist)
+{
+	const struct t_tag *t;
+
+	assert(f != NULL);
+	assert(tlist != NULL);
+
+	switch (f->op) {
+	case T_FILTER_OR:
+		return (t_filter_eval(f->lhs, tlist) || t_filter_eval(f->rhs, tlist));
+	case T_FILTER_AND:
+		return (t_filter_eval(f->lhs, tlist) && t_filter_eval(f->rhs, tlist));
+	case T_FILTER_NOT:
+		return (!t_filter_eval(f->lhs, tlist));
+	default:
+		/* a comparison, see below */
+		break;
+	}
+
+	TAILQ_FOREACH(t, tlist->tags, entries) {
+		if (t_tag_keycmp(t->key, f->key) == 0 &&
+		    t_filter_value_match(f, t->val))
+			return (f->op != T_FILTER_NE);
+	}
+
+	return (f->op == T_FILTER_NE);
+}
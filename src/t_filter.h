@@ -0,0 +1,90 @@
+#ifndef T_FILTER_H
+#define T_FILTER_H
+/*
+ * t_filter.h
+ *
+ * tag list filters for tagutil (used by the where action).
+ */
+#include "t_config.h"
+#include "t_taglist.h"
+
+
+/* filter expression node kinds */
+enum t_filter_op {
+	T_FILTER_OR,	/* lhs | rhs */
+	T_FILTER_AND,	/* lhs & rhs */
+	T_FILTER_NOT,	/* !lhs */
+	T_FILTER_HAS,	/* key */
+	T_FILTER_EQ,	/* key=val */
+	T_FILTER_NE,	/* key!=val */
+	T_FILTER_LT,	/* key<val */
+	T_FILTER_LE,	/* key<=val */
+	T_FILTER_GT,	/* key>val */
+	T_FILTER_GE,	/* key>=val */
+};
+
+/*
+ * a compiled filter expression, as a tree. Exposed so that other data
+ * structures than t_taglist can be searched (see t_index.c).
+ */
+struct t_filter {
+	enum t_filter_op	 op;
+	struct t_filter		*lhs; /* for T_FILTER_OR, T_FILTER_AND and T_FILTER_NOT */
+	struct t_filter		*rhs; /* for T_FILTER_OR and T_FILTER_AND */
+	char			*key; /* for the comparisons */
+	char			*val; /* for the comparisons but T_FILTER_HAS */
+	int			 isnum; /* 1 if val is a number */
+	double			 num;   /* val as a number, when isnum is set */
+};
+
+
+/*
+ * compile a filter expression.
+ *
+ * An expression is made of comparisons like `genre=Jazz' or `year<1970',
+ * combined with `&' (and), `|' (or), `!' (not) and parenthesis. `&' has
+ * precedence over `|'. Supported comparisons operators are = != < <= > and >=,
+ * a key alone is true when the tag list has at least one such tag. Keys are
+ * compared case-insensitively, values are compared as numbers when both are
+ * numbers and as strings otherwise. A comparison is true if any tag with the
+ * given key match, except for != which is true if none is equal. A `\'
+ * escape the next character, so that values can contain operators.
+ *
+ * @return
+ *   NULL on error (the expression is malformed or malloc(3) failed), a filter
+ *   to be passed to t_filter_delete() after use otherwise.
+ */
+struct t_filter	*t_filter_parse(const char *expr);
+
+/*
+ * evaluate a filter on a tag list.
+ *
+ * The evaluation stop as soon as the result is known, and each comparison
+ * stop at the first matching tag.
+ *
+ * @return
+ *   1 if the tag list match the filter, 0 otherwise.
+ */
+int	t_filter_match(const struct t_filter *filter,
+	    const struct t_taglist *tlist);
+
+/*
+ * test a tag value against a comparison node.
+ *
+ * @param filter
+ *   A comparison node, i.e. neither T_FILTER_OR, T_FILTER_AND nor
+ *   T_FILTER_NOT.
+ *
+ * @return
+ *   1 if a tag with the filter's key and the given value would satisfy the
+ *   comparison, 0 otherwise. For T_FILTER_NE, 1 if the value is equal (a !=
+ *   comparison is true when no tag is equal).
+ */
+int	t_filter_value_match(const struct t_filter *filter, const char *val);
+
+/*
+ * free all memory associated with a filter.
+ */
+void	t_filter_delete(struct t_filter *filter);
+
+#endif /* ndef T_FILTER_H */
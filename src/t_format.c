@@ -7,11 +7,55 @@
 #include "t_toolkit.h"
 
 #include "t_format.h"
+#if defined(WITH_PLUGINS)
+#	include "t_plugin.h"
+#endif
 
 
 struct t_format	*t_yaml_format(void) t__weak;
 struct t_format	*t_json_format(void) t__weak;
 
+#if defined(WITH_PLUGINS)
+/*
+ * formats built as plugins, see t_backend.c. The YAML format is built as a
+ * plugin too since it is not needed by every action (e.g. backend).
+ */
+struct t_format_plugin {
+	struct t_format	 proxy;
+	const char	*module;
+	const char	*symbol;
+};
+
+static struct t_format_plugin	t_yaml_plugin = {
+	.proxy	= {
+		.libid		= "libyaml",
+		.fileext	= "yml",
+		.desc		= "YAML - YAML Ain't Markup Language",
+	},
+	.module	= "t_yaml",
+	.symbol	= "t_yaml_format",
+};
+#if defined(WITH_JSON)
+static struct t_format_plugin	t_json_plugin = {
+	.proxy	= {
+		.libid		= "jansson",
+		.fileext	= "json",
+		.desc		= "JSON - JavaScript Object Notation",
+	},
+	.module	= "t_json",
+	.symbol	= "t_json_format",
+};
+#endif
+
+static struct t_format_plugin	*t_format_plugins[] = {
+	&t_yaml_plugin,
+#if defined(WITH_JSON)
+	&t_json_plugin,
+#endif
+	NULL,
+};
+#endif /* WITH_PLUGINS */
+
 
 const struct t_formatQ *
 t_all_formats(void)
@@ -26,13 +70,52 @@ t_all_formats(void)
 		/* YAML */
 		if (t_yaml_format != NULL)
 			TAILQ_INSERT_TAIL(&fQ, t_yaml_format(), entries);
+#if defined(WITH_PLUGINS)
+		else
+			TAILQ_INSERT_TAIL(&fQ, &t_yaml_plugin.proxy, entries);
+#endif
 
 		/* JSON */
 		if (t_json_format != NULL)
 			TAILQ_INSERT_TAIL(&fQ, t_json_format(), entries);
+#if defined(WITH_PLUGINS) && defined(WITH_JSON)
+		else
+			TAILQ_INSERT_TAIL(&fQ, &t_json_plugin.proxy, entries);
+#endif
 
 		initialized = 1;
 	}
 
 	return (&fQ);
 }
+
+
+int
+t_format_load(const struct t_format *fmt)
+{
+#if defined(WITH_PLUGINS)
+	struct t_format_plugin *p;
+	const struct t_format *plugin;
+	size_t i;
+#endif
+
+	assert(fmt != NULL);
+
+	if (fmt->tags2fmt != NULL)
+		return (0);
+#if defined(WITH_PLUGINS)
+	for (i = 0; (p = t_format_plugins[i]) != NULL; i++) {
+		if (&p->proxy == fmt)
+			break;
+	}
+	if (p == NULL)
+		return (-1);
+	if ((plugin = t_plugin_load(p->module, p->symbol)) == NULL)
+		return (-1);
+	p->proxy.tags2fmt = plugin->tags2fmt;
+	p->proxy.fmt2tags = plugin->fmt2tags;
+	return (0);
+#else
+	return (-1);
+#endif
+}
@@ -61,4 +61,13 @@ TAILQ_HEAD(t_formatQ, t_format);
  */
 const struct t_formatQ	*t_all_formats(void);
 
+/*
+ * make sure a format from t_all_formats() is ready to be used, i.e. load it
+ * if it is built as a plugin. See t_backend_load().
+ *
+ * @return
+ *   0 on success, -1 on error (a warning is displayed).
+ */
+int	t_format_load(const struct t_format *fmt);
+
 #endif /* ndef T_FORMAT_H */
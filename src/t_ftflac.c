@@ -13,6 +13,7 @@
 
 #include "t_config.h"
 #include "t_backend.h"
+#include "t_rewrite.h"
 
 
 static const char libid[] = "libFLAC";
@@ -20,10 +21,19 @@ static const char libid[] = "libFLAC";
 
 struct t_ftflac_data {
 	const char		*libid; /* pointer to libid */
+	const char		*path; /* used for warning messages */
 	FLAC__Metadata_Chain	*chain;
 	FLAC__StreamMetadata	*vocomments; /* Vorbis Comments */
 };
 
+/* a read only view of a file ending where the audio frames start, see
+   t_ftflac_rewrite() */
+struct t_ftflac_io {
+	int	fd;
+	off_t	offset;
+	off_t	end;
+};
+
 
 struct t_backend	*t_ftflac_backend(void);
 
@@ -32,6 +42,26 @@ static struct t_taglist	*t_ftflac_read(void *opaque);
 static int		 t_ftflac_write(void *opaque, const struct t_taglist *tlist);
 static void		 t_ftflac_clear(void *opaque);
 
+/* helper for t_ftflac_write(), compute the Vorbis Comment block length */
+static void		 t_ftflac_vocomments_length(FLAC__StreamMetadata *vocomments);
+/* helper for t_ftflac_write(), reserve padding before a full rewrite */
+static int		 t_ftflac_grow_padding(struct t_ftflac_data *data);
+/* helpers for t_ftflac_write(), rewrite the whole file */
+static int		 t_ftflac_rewrite(struct t_ftflac_data *data);
+static int		 t_ftflac_copy_blocks(FLAC__Metadata_Chain *dst,
+			    FLAC__Metadata_Chain *src);
+static int		 t_ftflac_audio_offset(int fd, off_t *first, off_t *audio);
+static void		 t_ftflac_align_padding(struct t_ftflac_data *data,
+			    const struct t_rewrite *rw, off_t first, off_t audio);
+static size_t		 t_ftflac_io_read(void *ptr, size_t size, size_t nmemb,
+			    FLAC__IOHandle handle);
+static int		 t_ftflac_io_seek(FLAC__IOHandle handle, FLAC__int64 offset,
+			    int whence);
+static FLAC__int64	 t_ftflac_io_tell(FLAC__IOHandle handle);
+static int		 t_ftflac_io_eof(FLAC__IOHandle handle);
+static size_t		 t_ftflac_io_write(const void *ptr, size_t size,
+			    size_t nmemb, FLAC__IOHandle handle);
+
 struct t_backend *
 t_ftflac_backend(void)
 {
@@ -54,13 +84,18 @@ t_ftflac_init(const char *path)
 {
 	FLAC__Metadata_Iterator *it;
 	struct t_ftflac_data *data;
+	size_t plen;
+	char *p;
 
 	assert(path != NULL);
 
-	data = calloc(1, sizeof(struct t_ftflac_data));
+	plen = strlen(path);
+	data = calloc(1, sizeof(struct t_ftflac_data) + plen + 1);
 	if (data == NULL)
 		goto error0;
 	data->libid = libid;
+	data->path = p = (char *)(data + 1);
+	(void)memcpy(p, path, plen + 1);
 
 	data->chain = FLAC__metadata_chain_new();
 	if (data->chain == NULL)
@@ -148,33 +183,65 @@ t_ftflac_write(void *opaque, const struct t_taglist *tlist)
 {
 	struct t_ftflac_data *data;
 	struct t_tag *t;
+	FLAC__StreamMetadata_VorbisComment *vc;
 	FLAC__StreamMetadata_VorbisComment_Entry e;
+	FLAC__bool inplace;
+	uint32_t i;
+	int ret = 0;
 
 	assert(opaque != NULL);
 	data = opaque;
 	assert(data->libid == libid);
 
-	/* clear all the tags */
-	while (data->vocomments->data.vorbis_comment.num_comments > 0) {
-		if (!FLAC__metadata_object_vorbiscomment_delete_comment(data->vocomments, 0))
-			return (-1);
-	}
-
-	/* load the tlist */
+	/*
+	 * rebuild the comments in one pass: the array is resized once to the
+	 * exact count of tags (libFLAC free the entries beyond it) and each
+	 * new entry is moved in place of the old one.
+	 */
+	if (tlist->count > UINT32_MAX)
+		return (-1);
+	if (!FLAC__metadata_object_vorbiscomment_resize_comments(data->vocomments, (uint32_t)tlist->count))
+		return (-1);
+	vc = &data->vocomments->data.vorbis_comment;
+	i = 0;
 	TAILQ_FOREACH(t, tlist->tags, entries) {
-		if (!FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair(&e, t->key, t->val))
-			return (-1);
-		if(!FLAC__metadata_object_vorbiscomment_append_comment(data->vocomments, e, /* copy */false)) {
-			free(e.entry);
-			return (-1);
+		assert(i < vc->num_comments);
+		if (!FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair(&e, t->key, t->val)) {
+			ret = -1;
+			break;
 		}
+		free(vc->comments[i].entry);
+		vc->comments[i++] = e;
 	}
+	t_ftflac_vocomments_length(data->vocomments);
+	if (ret == -1)
+		return (-1);
 
-	/* do the write */
+	/*
+	 * do the write. The whole file has to be rewritten when the new
+	 * metadata don't fit into the existing padding, so we check first and
+	 * reserve some padding in that case (see t_backend_padding()). The
+	 * padding must not be used by libFLAC after it has been grown,
+	 * otherwise it would shrink it back to fit the original metadata
+	 * length.
+	 */
 	FLAC__metadata_chain_sort_padding(data->chain);
-	if (!FLAC__metadata_chain_write(data->chain, /* padding */true, /* preserve_file_stats */false))
+	inplace = !FLAC__metadata_chain_check_if_tempfile_needed(data->chain, /* padding */true);
+	if (!inplace) {
+		if (!t_backend_may_rewrite(data->path))
+			return (-1);
+		if (t_ftflac_grow_padding(data) == -1)
+			return (-1);
+		/* the grown padding may fill exactly the original space */
+		inplace = !FLAC__metadata_chain_check_if_tempfile_needed(data->chain, /* padding */false);
+	}
+	if (inplace) {
+		if (!FLAC__metadata_chain_write(data->chain, /* padding */true, /* preserve_file_stats */false))
+			return (-1);
+	} else if (t_ftflac_rewrite(data) == -1)
 		return (-1);
 
+	t_backend_count_write(inplace);
 	return (0);
 }
 
@@ -191,3 +258,380 @@ t_ftflac_clear(void *opaque)
 	FLAC__metadata_chain_delete(data->chain);
 	free(data);
 }
+
+
+/*
+ * libFLAC update the block length on each comment insertion or deletion, we
+ * do it once after having rebuilt the whole array.
+ */
+static void
+t_ftflac_vocomments_length(FLAC__StreamMetadata *vocomments)
+{
+	const FLAC__StreamMetadata_VorbisComment *vc;
+	uint32_t i, length;
+
+	assert(vocomments != NULL);
+	assert(vocomments->type == FLAC__METADATA_TYPE_VORBIS_COMMENT);
+
+	vc = &vocomments->data.vorbis_comment;
+	length  = FLAC__STREAM_METADATA_VORBIS_COMMENT_ENTRY_LENGTH_LEN / 8;
+	length += vc->vendor_string.length;
+	length += FLAC__STREAM_METADATA_VORBIS_COMMENT_NUM_COMMENTS_LEN / 8;
+	for (i = 0; i < vc->num_comments; i++) {
+		length += FLAC__STREAM_METADATA_VORBIS_COMMENT_ENTRY_LENGTH_LEN / 8;
+		length += vc->comments[i].length;
+	}
+	vocomments->length = length;
+}
+
+
+static int
+t_ftflac_grow_padding(struct t_ftflac_data *data)
+{
+	FLAC__Metadata_Iterator *it;
+	FLAC__StreamMetadata *padding;
+	size_t current, neo;
+	int ret = -1;
+
+	assert(data != NULL);
+	assert(data->libid == libid);
+
+	it = FLAC__metadata_iterator_new();
+	if (it == NULL)
+		return (-1);
+	FLAC__metadata_iterator_init(it, data->chain);
+	/* after FLAC__metadata_chain_sort_padding() there is at most one
+	   padding block, the last one. */
+	while (FLAC__metadata_iterator_next(it))
+		continue;
+	if (FLAC__metadata_iterator_get_block_type(it) == FLAC__METADATA_TYPE_PADDING) {
+		padding = FLAC__metadata_iterator_get_block(it);
+		current = padding->length;
+	} else {
+		padding = NULL;
+		current = 0;
+	}
+
+	neo = t_backend_padding(current);
+	/* the block length is stored on 24 bits */
+	if (neo >= (1U << FLAC__STREAM_METADATA_LENGTH_LEN))
+		neo = (1U << FLAC__STREAM_METADATA_LENGTH_LEN) - 1;
+
+	if (padding != NULL) {
+		padding->length = (uint32_t)neo;
+	} else if (neo > 0) {
+		padding = FLAC__metadata_object_new(FLAC__METADATA_TYPE_PADDING);
+		if (padding == NULL)
+			goto cleanup;
+		padding->length = (uint32_t)neo;
+		if (!FLAC__metadata_iterator_insert_block_after(it, padding)) {
+			FLAC__metadata_object_delete(padding);
+			goto cleanup;
+		}
+	}
+
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	FLAC__metadata_iterator_delete(it);
+	return (ret);
+}
+
+
+/*
+ * rewrite the file with the new metadata blocks.
+ *
+ * libFLAC would copy the audio frames itself through user space, so it is
+ * given a view of the file ending where the audio frames start: it only
+ * write the metadata into the new file, the audio frames being appended by
+ * t_rewrite_copy(). libFLAC refuse to write through callbacks a chain read
+ * by filename, so the view is read into a new chain which get a copy of our
+ * metadata blocks.
+ */
+static int
+t_ftflac_rewrite(struct t_ftflac_data *data)
+{
+	struct t_rewrite rw;
+	struct t_ftflac_io io;
+	off_t first, audio;
+	FLAC__Metadata_Chain *chain = NULL;
+	FLAC__IOCallbacks in_cb  = {
+		.read	= t_ftflac_io_read,
+		.seek	= t_ftflac_io_seek,
+		.tell	= t_ftflac_io_tell,
+		.eof	= t_ftflac_io_eof,
+	};
+	FLAC__IOCallbacks out_cb = {
+		.write	= t_ftflac_io_write,
+	};
+	int ret = -1;
+
+	assert(data != NULL);
+	assert(data->libid == libid);
+
+	if (t_rewrite_open(&rw, data->path) == -1)
+		return (-1);
+	if (t_ftflac_audio_offset(rw.fd_in, &first, &audio) == -1)
+		goto cleanup;
+	t_ftflac_align_padding(data, &rw, first, audio);
+
+	io.fd     = rw.fd_in;
+	io.offset = 0;
+	io.end    = audio;
+	if ((chain = FLAC__metadata_chain_new()) == NULL)
+		goto cleanup;
+	if (!FLAC__metadata_chain_read_with_callbacks(chain, &io, in_cb))
+		goto cleanup;
+	if (t_ftflac_copy_blocks(chain, data->chain) == -1)
+		goto cleanup;
+	if (!FLAC__metadata_chain_check_if_tempfile_needed(chain, /* padding */false)) {
+		/* the aligned padding fill exactly the original space */
+		if (FLAC__metadata_chain_write(data->chain, /* padding */false, /* preserve_file_stats */false))
+			ret = 0;
+		goto cleanup;
+	}
+	if (!FLAC__metadata_chain_write_with_callbacks_and_tempfile(chain,
+	    /* padding */false, &io, in_cb, &rw.fd_out, out_cb))
+		goto cleanup;
+	if (t_rewrite_copy(&rw, audio) == -1)
+		goto cleanup;
+	if (t_rewrite_commit(&rw) == -1)
+		goto cleanup;
+
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	if (chain != NULL)
+		FLAC__metadata_chain_delete(chain);
+	t_rewrite_abort(&rw);
+	return (ret);
+}
+
+
+/*
+ * replace the metadata blocks of dst following the STREAMINFO block (which
+ * is always the first one) by copies of the blocks of src.
+ */
+static int
+t_ftflac_copy_blocks(FLAC__Metadata_Chain *dst, FLAC__Metadata_Chain *src)
+{
+	FLAC__Metadata_Iterator *dit, *sit = NULL;
+	FLAC__StreamMetadata *block;
+	int ret = -1;
+
+	assert(dst != NULL);
+	assert(src != NULL);
+
+	if ((dit = FLAC__metadata_iterator_new()) == NULL)
+		return (-1);
+	if ((sit = FLAC__metadata_iterator_new()) == NULL)
+		goto cleanup;
+
+	/* deleting a block move the iterator back to the previous one */
+	FLAC__metadata_iterator_init(dit, dst);
+	while (FLAC__metadata_iterator_next(dit)) {
+		if (!FLAC__metadata_iterator_delete_block(dit, /* padding */false))
+			goto cleanup;
+	}
+
+	FLAC__metadata_iterator_init(sit, src);
+	while (FLAC__metadata_iterator_next(sit)) {
+		block = FLAC__metadata_object_clone(FLAC__metadata_iterator_get_block(sit));
+		if (block == NULL)
+			goto cleanup;
+		if (!FLAC__metadata_iterator_insert_block_after(dit, block)) {
+			FLAC__metadata_object_delete(block);
+			goto cleanup;
+		}
+	}
+
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	if (sit != NULL)
+		FLAC__metadata_iterator_delete(sit);
+	FLAC__metadata_iterator_delete(dit);
+	return (ret);
+}
+
+
+/*
+ * find where the metadata blocks start (after the "fLaC" marker) and where
+ * they end (the audio frames start). A leading ID3v2 tag is skipped the same
+ * way libFLAC does.
+ */
+static int
+t_ftflac_audio_offset(int fd, off_t *first, off_t *audio)
+{
+	unsigned char buf[10];
+	off_t offset;
+	uint32_t len;
+
+	assert(first != NULL);
+	assert(audio != NULL);
+
+	if (pread(fd, buf, sizeof(buf), 0) != sizeof(buf))
+		return (-1);
+	offset = 0;
+	if (memcmp(buf, "ID3", 3) == 0) {
+		/* the tag size is stored as a syncsafe integer */
+		len = (uint32_t)(buf[6] & 0x7f) << 21 | (uint32_t)(buf[7] & 0x7f) << 14 |
+		    (uint32_t)(buf[8] & 0x7f) << 7 | (uint32_t)(buf[9] & 0x7f);
+		offset = sizeof(buf) + len;
+		if (pread(fd, buf, 4, offset) != 4)
+			return (-1);
+	}
+	if (memcmp(buf, "fLaC", 4) != 0)
+		return (-1);
+	offset += 4;
+	*first = offset;
+
+	/* walk the metadata block headers up to the last one */
+	do {
+		if (pread(fd, buf, FLAC__STREAM_METADATA_HEADER_LENGTH, offset) !=
+		    FLAC__STREAM_METADATA_HEADER_LENGTH)
+			return (-1);
+		len = (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 8 | buf[3];
+		offset += FLAC__STREAM_METADATA_HEADER_LENGTH + len;
+	} while ((buf[0] & 0x80) == 0);
+	*audio = offset;
+
+	return (0);
+}
+
+
+/*
+ * grow the padding so that the metadata blocks end on the same offset in
+ * both the original and the new file modulo the block size, allowing
+ * t_rewrite_copy() to share the audio frames blocks.
+ */
+static void
+t_ftflac_align_padding(struct t_ftflac_data *data, const struct t_rewrite *rw,
+    off_t first, off_t audio)
+{
+	FLAC__Metadata_Iterator *it;
+	FLAC__StreamMetadata *block;
+	off_t end, d;
+
+	assert(data != NULL);
+	assert(data->libid == libid);
+	assert(rw != NULL);
+
+	it = FLAC__metadata_iterator_new();
+	if (it == NULL)
+		return;
+	FLAC__metadata_iterator_init(it, data->chain);
+	end = first;
+	do {
+		block = FLAC__metadata_iterator_get_block(it);
+		end  += FLAC__STREAM_METADATA_HEADER_LENGTH + block->length;
+	} while (FLAC__metadata_iterator_next(it));
+
+	/* after t_ftflac_grow_padding() the padding is the last block */
+	d = t_rewrite_align(rw, audio, end);
+	if (block->type == FLAC__METADATA_TYPE_PADDING &&
+	    block->length + d < (1U << FLAC__STREAM_METADATA_LENGTH_LEN))
+		block->length += (uint32_t)d;
+
+	FLAC__metadata_iterator_delete(it);
+}
+
+
+static size_t
+t_ftflac_io_read(void *ptr, size_t size, size_t nmemb, FLAC__IOHandle handle)
+{
+	struct t_ftflac_io *io = handle;
+	size_t len;
+	ssize_t r;
+
+	assert(io != NULL);
+
+	if (size == 0 || io->offset >= io->end)
+		return (0);
+	len = size * nmemb;
+	if (len > (size_t)(io->end - io->offset))
+		len = (size_t)(io->end - io->offset);
+	do {
+		r = pread(io->fd, ptr, len, io->offset);
+	} while (r == -1 && errno == EINTR);
+	if (r <= 0)
+		return (0);
+	io->offset += r;
+	return ((size_t)r / size);
+}
+
+
+static int
+t_ftflac_io_seek(FLAC__IOHandle handle, FLAC__int64 offset, int whence)
+{
+	struct t_ftflac_io *io = handle;
+	off_t base;
+
+	assert(io != NULL);
+
+	switch (whence) {
+	case SEEK_SET:
+		base = 0;
+		break;
+	case SEEK_CUR:
+		base = io->offset;
+		break;
+	case SEEK_END:
+		base = io->end;
+		break;
+	default:
+		return (-1);
+	}
+	if (base + offset < 0)
+		return (-1);
+	io->offset = base + offset;
+	return (0);
+}
+
+
+static FLAC__int64
+t_ftflac_io_tell(FLAC__IOHandle handle)
+{
+	struct t_ftflac_io *io = handle;
+
+	assert(io != NULL);
+
+	return (io->offset);
+}
+
+
+static int
+t_ftflac_io_eof(FLAC__IOHandle handle)
+{
+	struct t_ftflac_io *io = handle;
+
+	assert(io != NULL);
+
+	return (io->offset >= io->end);
+}
+
+
+static size_t
+t_ftflac_io_write(const void *ptr, size_t size, size_t nmemb,
+    FLAC__IOHandle handle)
+{
+	const char *p = ptr;
+	size_t len;
+	ssize_t w;
+	int fd;
+
+	assert(handle != NULL);
+
+	fd  = *(int *)handle;
+	len = size * nmemb;
+	while (len > 0) {
+		w = write(fd, p, len);
+		if (w == -1 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return (0);
+		p   += w;
+		len -= (size_t)w;
+	}
+	return (nmemb);
+}
@@ -3,8 +3,11 @@
  *
  * ID3v1 backend.
  */
-#include <stdio.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
 #include <limits.h>
+#include <stdio.h>
 
 #include "t_config.h"
 #include "t_backend.h"
@@ -185,9 +188,11 @@ struct id3v1_tag {
 
 struct t_ftid3v1_data {
 	const char	*libid; /* pointer to libid */
-	const char	*path;  /* this is needed for t_ftid3v1_write() */
+	const char	*path;  /* used for warning messages */
+	int		 fd;    /* read-only file descriptor */
 	int		 id3;   /* 1 if id3 tag is already present in the file, 0 otherwise */
-	FILE		*fp;    /* read-only file pointer */
+	off_t		 size;  /* size of the file */
+	struct id3v1_tag tag; /* the last 128 bytes of the file */
 };
 
 
@@ -220,13 +225,21 @@ t_ftid3v1_backend(void)
 }
 
 
+/*
+ * The whole backend does two pread(2) at init (the file magic and the ID3v1
+ * tag, which is cached) and one pwrite(2) at write. The file is opened
+ * read-only at init, since closing a descriptor opened for writing would be
+ * seen as a change by watchers (see t_watch.h), and for writing only by
+ * t_ftid3v1_write().
+ */
 static void *
 t_ftid3v1_init(const char *path)
 {
 	unsigned char magic[3];
 	char *p;
 	struct t_ftid3v1_data *data = NULL;
-	FILE *fp = NULL;
+	struct stat st;
+	int fd = -1;
 	size_t plen;
 
 	assert(path != NULL);
@@ -239,27 +252,17 @@ t_ftid3v1_init(const char *path)
 	data->path = p = (char *)(data + 1);
 	(void)memcpy(p, path, plen + 1);
 
-	if ((data->fp = fp = fopen(data->path, "r")) == NULL)
+	if ((fd = open(data->path, O_RDONLY)) == -1)
 		goto error_label;
-	/* go to the end of the file minus the ID3v1 metadata (128 bytes) */
-	if (fseek(fp, -(sizeof(struct id3v1_tag)), SEEK_END) != 0)
+	data->fd = fd;
+	if (fstat(fd, &st) == -1)
 		goto error_label;
-	/* read the start of the ID3v1 metadata, where the magic is supposed to
-	   be */
-	if (fread(&magic, sizeof(char), NELEM(magic), fp) != NELEM(magic))
+	data->size = st.st_size;
+	if (data->size < (off_t)sizeof(struct id3v1_tag))
 		goto error_label;
-	/* check if the magic bytes match a ID3v1 header */
-	data->id3 = (
-	    magic[0] == 'T' &&
-	    magic[1] == 'A' &&
-	    magic[2] == 'G' ?
-	    1 : 0
-	);
 
-	/* go the the very beginning of the file */
-	if (fseek(fp, 0L, SEEK_SET) != 0)
-		goto error_label;
-	if (fread(&magic, sizeof(char), NELEM(magic), fp) != NELEM(magic))
+	/* read the very beginning of the file */
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
 		goto error_label;
 	/* check that we don't handle a file with ID3v2 tags. */
 	if (magic[0] == 'I' &&
@@ -271,12 +274,25 @@ t_ftid3v1_init(const char *path)
 			goto error_label;
 	}
 
+	/* read the end of the file, where the ID3v1 metadata (128 bytes) is
+	   supposed to be */
+	if (pread(fd, &data->tag, sizeof(struct id3v1_tag),
+	    data->size - (off_t)sizeof(struct id3v1_tag)) != sizeof(struct id3v1_tag))
+		goto error_label;
+	/* check if the magic bytes match a ID3v1 header */
+	data->id3 = (
+	    data->tag.magic[0] == 'T' &&
+	    data->tag.magic[1] == 'A' &&
+	    data->tag.magic[2] == 'G' ?
+	    1 : 0
+	);
+
 	return (data);
 	/* NOTREACHED */
 error_label:
 	free(data);
-	if (fp != NULL)
-		(void)fclose(fp);
+	if (fd != -1)
+		(void)close(fd);
 	return (NULL);
 }
 
@@ -284,14 +300,12 @@ error_label:
 static struct t_taglist *
 t_ftid3v1_read(void *opaque)
 {
-	struct id3v1_tag id3tag;
 	struct t_taglist *tlist = NULL;
 	struct t_ftid3v1_data *data;
 
 	assert(opaque != NULL);
 	data = opaque;
 	assert(data->libid == libid);
-	assert(data->fp != NULL);
 
 	tlist = t_taglist_new();
 	if (tlist == NULL)
@@ -300,12 +314,7 @@ t_ftid3v1_read(void *opaque)
 	if (!data->id3)
 		return (tlist);
 
-	if (fseek(data->fp, -(sizeof(struct id3v1_tag)), SEEK_END) != 0)
-		goto error_label;
-	if (fread(&id3tag, sizeof(struct id3v1_tag), 1, data->fp) != 1)
-		goto error_label;
-
-	if (id3tag_to_taglist(&id3tag, tlist) != 0)
+	if (id3tag_to_taglist(&data->tag, tlist) != 0)
 		goto error_label;
 
 	return (tlist);
@@ -320,42 +329,39 @@ t_ftid3v1_write(void *opaque, const struct t_taglist *tlist)
 {
 	struct id3v1_tag id3tag;
 	struct t_ftid3v1_data *data;
-	FILE *fp = NULL;
+	off_t offset;
+	ssize_t n;
+	int fd;
 
 	assert(opaque != NULL);
 	assert(tlist != NULL);
 	data = opaque;
 	assert(data->libid == libid);
-	assert(data->fp != NULL);
 
 	if (taglist_to_id3tag(tlist, &id3tag) != 0)
 		return (-1);
 
-	(void)fclose(data->fp);
-	data->fp = NULL;
-
-	if (data->id3) {
-		if ((fp = fopen(data->path, "r+")) == NULL)
-			goto error_label;
-		if (fseek(fp, -(sizeof(struct id3v1_tag)), SEEK_END) != 0)
-			goto error_label;
-	} else {
-		if ((fp = fopen(data->path, "a")) == NULL)
-			goto error_label;
+	/* overwrite the existing tag or append a new one */
+	offset = data->size;
+	if (data->id3)
+		offset -= (off_t)sizeof(struct id3v1_tag);
+	if ((fd = open(data->path, O_WRONLY)) == -1) {
+		warn("%s", data->path);
+		return (-1);
+	}
+	n = pwrite(fd, &id3tag, sizeof(struct id3v1_tag), offset);
+	if (close(fd) == -1 || n != sizeof(struct id3v1_tag)) {
+		warn("%s", data->path);
+		return (-1);
 	}
-	if (fwrite(&id3tag, sizeof(struct id3v1_tag), 1, fp) != 1)
-		goto error_label;
-	if (fclose(fp) != 0)
-		goto error_label;
-	fp = NULL;
 
-	data->fp = fopen(data->path, "r");
+	/* keep the cache in sync with the file */
+	if (!data->id3) {
+		data->size += (off_t)sizeof(struct id3v1_tag);
+		data->id3 = 1;
+	}
+	data->tag = id3tag;
 	return (0);
-error_label:
-	if (fp != NULL)
-		(void)fclose(fp);
-	data->fp = fopen(data->path, "r");
-	return (-1);
 }
 
 
@@ -368,8 +374,7 @@ t_ftid3v1_clear(void *opaque)
 	data = opaque;
 	assert(data->libid == libid);
 
-	if (data->fp != NULL)
-		(void)fclose(data->fp);
+	(void)close(data->fd);
 	free(data);
 }
 
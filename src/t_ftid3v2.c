@@ -0,0 +1,1034 @@
+/*
+ * t_ftid3v2.c
+ *
+ * ID3v2.3 and ID3v2.4 backend for MP3 files.
+ *
+ * Only the tag region at the start of the file is ever read: its header at
+ * init and the tag itself (in one read) when needed. The tags are updated in
+ * place when the new frames fit into the current tag padding, otherwise the
+ * file is rewritten (see t_rewrite.h).
+ */
+#include <fcntl.h>
+#include <stdint.h>
+
+#include "t_config.h"
+#include "t_backend.h"
+#include "t_rewrite.h"
+
+
+static const char libid[] = "ID3v2";
+
+#define	ID3V2_HEADER_LEN	10
+/* tag header flags */
+#define	ID3V2_FLAG_UNSYNC	0x80
+#define	ID3V2_FLAG_EXTHEADER	0x40
+#define	ID3V2_FLAG_FOOTER	0x10 /* ID3v2.4 only */
+/* the tag size is a 28 bits integer */
+#define	ID3V2_MAXSIZE		((1UL << 28) - 1)
+
+/* text encodings */
+#define	ID3V2_LATIN1		0
+#define	ID3V2_UTF16		1 /* with BOM */
+#define	ID3V2_UTF16BE		2 /* ID3v2.4 only */
+#define	ID3V2_UTF8		3 /* ID3v2.4 only */
+
+/*
+ * frames to tag keys mapping. The keys are the ones used by the TagLib backend
+ * (which used to handle MP3 files). When several entries match a frame the
+ * first is used to read it, the others are only aliases used on write.
+ */
+static const struct id3v2_key {
+	const char	*key;
+	const char	*id;
+	int		 major; /* ID3v2 version, 0 for both */
+} id3v2_keys[] = {
+	{ "title",		"TIT2",	0 },
+	{ "artist",		"TPE1",	0 },
+	{ "year",		"TYER",	3 },
+	{ "year",		"TDRC",	4 },
+	{ "album",		"TALB",	0 },
+	{ "track",		"TRCK",	0 },
+	{ "genre",		"TCON",	0 },
+	{ "comment",		"COMM",	0 },
+	{ "albumartist",	"TPE2",	0 },
+	{ "composer",		"TCOM",	0 },
+	{ "discnumber",		"TPOS",	0 },
+	/* Vorbis Comment keys */
+	{ "date",		"TYER",	3 },
+	{ "date",		"TDRC",	4 },
+	{ "tracknumber",	"TRCK",	0 },
+};
+
+/*
+ * the other ID3v2.3 and ID3v2.4 text frames, their ID is used as tag key.
+ */
+static const char id3v2_text_frames[] =
+    "TBPM TCOP TDAT TDEN TDLY TDOR TDRL TDTG TENC TEXT TFLT TIME TIPL TIT1 "
+    "TIT3 TKEY TLAN TLEN TMCL TMED TMOO TOAL TOFN TOLY TOPE TORY TOWN TPE3 "
+    "TPE4 TPRO TPUB TRDA TRSN TRSO TSIZ TSOA TSOP TSOT TSRC TSSE TSST";
+
+struct t_ftid3v2_data {
+	const char	*libid;   /* pointer to libid */
+	const char	*path;
+	int		 fd;      /* read-write if allowed, read-only otherwise */
+	int		 major;   /* ID3v2 version, 3 or 4 */
+	int		 flags;   /* tag header flags */
+	off_t		 region;  /* size of the tag in the file (header and
+	                             footer included) */
+	unsigned char	*frames;  /* the tag frames, NULL until loaded */
+	size_t		 len;     /* length of frames, without padding */
+};
+
+/* a frame of the tag, see id3v2_frame_next() */
+struct id3v2_frame {
+	char			 id[5];
+	const unsigned char	*raw;     /* the whole frame, header included */
+	size_t			 rawlen;
+	const unsigned char	*content; /* frame content, after the data
+	                                     signaled by the frame flags */
+	size_t			 len;
+	int			 opaque;  /* 1 if compressed or encrypted */
+	int			 unsync;  /* 1 if content is unsynchronised */
+};
+
+
+struct t_backend	*t_ftid3v2_backend(void);
+
+static void 		*t_ftid3v2_init(const char *path);
+static struct t_taglist	*t_ftid3v2_read(void *opaque);
+static int		 t_ftid3v2_write(void *opaque, const struct t_taglist *tlist);
+static void		 t_ftid3v2_clear(void *opaque);
+
+static int	t_ftid3v2_load(struct t_ftid3v2_data *data);
+static int	t_ftid3v2_rewrite(struct t_ftid3v2_data *data,
+		    const char *frames, size_t len);
+
+static int		 id3v2_frame_next(const struct t_ftid3v2_data *data,
+			    size_t *offset, struct id3v2_frame *frame);
+static int		 id3v2_frame_to_taglist(const struct t_ftid3v2_data *data,
+			    const struct id3v2_frame *frame, struct t_taglist *tlist);
+static int		 id3v2_taglist_to_frames(const struct t_ftid3v2_data *data,
+			    const struct t_taglist *tlist, struct sbuf *sb);
+static const char	*id3v2_frame_key(int major, const char *id);
+static int		 id3v2_frame_id(int major, const char *key, char *id);
+
+static char	*id3v2_text_decode(const unsigned char *p, size_t len,
+		    int enc, size_t *outlen);
+static int	 id3v2_text_encode(struct sbuf *sb, const char *s, size_t len,
+		    int enc);
+static int	 id3v2_utf8_next(const char **s, const char *end, uint32_t *c);
+static void	 id3v2_utf8_put(struct sbuf *sb, uint32_t c);
+
+static uint32_t	id3v2_syncsafe_get(const unsigned char *p);
+static void	id3v2_syncsafe_set(unsigned char *p, uint32_t n);
+static uint32_t	id3v2_be32_get(const unsigned char *p);
+static void	id3v2_be32_set(unsigned char *p, uint32_t n);
+static size_t	id3v2_unsync(unsigned char *p, size_t len);
+
+
+struct t_backend *
+t_ftid3v2_backend(void)
+{
+	static struct t_backend b = {
+		.libid		= libid,
+		.desc		= "MP3 files with ID3v2.3 or ID3v2.4 tag",
+		.init		= t_ftid3v2_init,
+		.read		= t_ftid3v2_read,
+		.write		= t_ftid3v2_write,
+		.clear		= t_ftid3v2_clear,
+	};
+
+	return (&b);
+}
+
+
+/*
+ * handle files starting with an ID3v2.3 or ID3v2.4 tag. Files without one are
+ * left to the other backends, since they may carry an ID3v1 or APE tag.
+ */
+static void *
+t_ftid3v2_init(const char *path)
+{
+	unsigned char hdr[ID3V2_HEADER_LEN];
+	struct t_ftid3v2_data *data;
+	char *p;
+	size_t plen;
+
+	assert(path != NULL);
+
+	plen = strlen(path);
+	data = calloc(1, sizeof(struct t_ftid3v2_data) + plen + 1);
+	if (data == NULL)
+		return (NULL);
+	data->libid = libid;
+	data->path = p = (char *)(data + 1);
+	(void)memcpy(p, path, plen + 1);
+
+	/*
+	 * opened for reading only, t_ftid3v2_write() get its own descriptor.
+	 * Closing a descriptor opened for writing would be seen as a change by
+	 * watchers (see t_watch.h) even when nothing was written.
+	 */
+	if ((data->fd = open(path, O_RDONLY)) == -1)
+		goto error;
+	if (pread(data->fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+		goto error;
+
+	if (memcmp(hdr, "ID3", 3) == 0) {
+		if (hdr[3] != 3 && hdr[3] != 4)
+			goto error;
+		if ((hdr[6] | hdr[7] | hdr[8] | hdr[9]) & 0x80)
+			goto error;
+		data->major  = hdr[3];
+		data->flags  = hdr[5];
+		data->region = ID3V2_HEADER_LEN + (off_t)id3v2_syncsafe_get(hdr + 6);
+		if (data->major == 4 && (data->flags & ID3V2_FLAG_FOOTER))
+			data->region += ID3V2_HEADER_LEN;
+	} else
+		goto error;
+
+	return (data);
+error:
+	if (data->fd != -1)
+		(void)close(data->fd);
+	free(data);
+	return (NULL);
+}
+
+
+static struct t_taglist *
+t_ftid3v2_read(void *opaque)
+{
+	struct t_ftid3v2_data *data;
+	struct t_taglist *tlist;
+	struct id3v2_frame frame;
+	size_t offset;
+
+	assert(opaque != NULL);
+	data = opaque;
+	assert(data->libid == libid);
+
+	if (t_ftid3v2_load(data) == -1)
+		return (NULL);
+	if ((tlist = t_taglist_new()) == NULL)
+		return (NULL);
+
+	offset = 0;
+	while (id3v2_frame_next(data, &offset, &frame) == 1) {
+		if (id3v2_frame_to_taglist(data, &frame, tlist) == -1) {
+			t_taglist_delete(tlist);
+			return (NULL);
+		}
+	}
+
+	return (tlist);
+}
+
+
+static int
+t_ftid3v2_write(void *opaque, const struct t_taglist *tlist)
+{
+	struct t_ftid3v2_data *data;
+	struct sbuf *sb = NULL;
+	unsigned char *tag = NULL;
+	size_t len, room;
+	ssize_t w;
+	int fd, ret = -1;
+
+	assert(opaque != NULL);
+	assert(tlist != NULL);
+	data = opaque;
+	assert(data->libid == libid);
+
+	/* the frames not mapped to tags (pictures etc.) have to be kept */
+	if (t_ftid3v2_load(data) == -1)
+		return (-1);
+	if ((sb = sbuf_new_auto()) == NULL)
+		return (-1);
+	if (id3v2_taglist_to_frames(data, tlist, sb) == -1)
+		goto cleanup;
+	if (sbuf_finish(sb) == -1)
+		goto cleanup;
+	len = (size_t)sbuf_len(sb);
+
+	room = (size_t)data->region - ID3V2_HEADER_LEN;
+	if (len <= room) {
+		/*
+		 * the frames fit, overwrite the tag in place. The new tag has
+		 * no unsynchronisation, extended header nor footer, their
+		 * space is used as padding.
+		 */
+		if ((tag = calloc(1, (size_t)data->region)) == NULL)
+			goto cleanup;
+		(void)memcpy(tag, "ID3", 3);
+		tag[3] = (unsigned char)data->major;
+		id3v2_syncsafe_set(tag + 6, (uint32_t)room);
+		(void)memcpy(tag + ID3V2_HEADER_LEN, sbuf_data(sb), len);
+		if ((fd = open(data->path, O_WRONLY)) == -1) {
+			warn("%s", data->path);
+			goto cleanup;
+		}
+		w = pwrite(fd, tag, (size_t)data->region, 0);
+		if (close(fd) == -1 || w != data->region) {
+			warn("%s", data->path);
+			goto cleanup;
+		}
+		t_backend_count_write(1);
+	} else {
+		if (!t_backend_may_rewrite(data->path))
+			goto cleanup;
+		if (t_ftid3v2_rewrite(data, sbuf_data(sb), len) == -1)
+			goto cleanup;
+		t_backend_count_write(0);
+	}
+
+	/* update the cached frames */
+	free(data->frames);
+	if ((data->frames = malloc(len + 1)) == NULL)
+		goto cleanup;
+	(void)memcpy(data->frames, sbuf_data(sb), len);
+	data->len   = len;
+	data->flags = 0;
+
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	free(tag);
+	sbuf_delete(sb);
+	return (ret);
+}
+
+
+static void
+t_ftid3v2_clear(void *opaque)
+{
+	struct t_ftid3v2_data *data;
+
+	assert(opaque != NULL);
+	data = opaque;
+	assert(data->libid == libid);
+
+	if (data->fd != -1)
+		(void)close(data->fd);
+	free(data->frames);
+	free(data);
+}
+
+
+/*
+ * read the tag and keep its frames in data, unless already done.
+ */
+static int
+t_ftid3v2_load(struct t_ftid3v2_data *data)
+{
+	struct id3v2_frame frame;
+	unsigned char *buf, *p;
+	size_t len, skip, offset;
+
+	assert(data != NULL);
+
+	if (data->frames != NULL)
+		return (0);
+
+	len = (size_t)data->region;
+	if ((buf = malloc(len)) == NULL)
+		return (-1);
+	if (pread(data->fd, buf, len, 0) != (ssize_t)len) {
+		warnx("%s: truncated ID3v2 tag", data->path);
+		goto error;
+	}
+	p    = buf + ID3V2_HEADER_LEN;
+	len -= ID3V2_HEADER_LEN;
+	if (data->major == 4 && (data->flags & ID3V2_FLAG_FOOTER))
+		len -= ID3V2_HEADER_LEN;
+	/* in ID3v2.4 unsynchronisation is done (and flagged) by frame */
+	if (data->major == 3 && (data->flags & ID3V2_FLAG_UNSYNC))
+		len = id3v2_unsync(p, len);
+
+	/* the extended header is not used, skip it (it is dropped on write) */
+	if (data->flags & ID3V2_FLAG_EXTHEADER) {
+		if (len < 4)
+			goto invalid;
+		if (data->major == 3)
+			skip = 4 + (size_t)id3v2_be32_get(p);
+		else
+			skip = id3v2_syncsafe_get(p);
+		if (skip > len)
+			goto invalid;
+		p   += skip;
+		len -= skip;
+	}
+	(void)memmove(buf, p, len);
+	data->frames = buf;
+	data->len    = len;
+
+	/*
+	 * the frames are followed by the padding, find where it starts.
+	 * Anything following an invalid frame is considered padding too, as
+	 * other tag editors do.
+	 */
+	offset = 0;
+	while (id3v2_frame_next(data, &offset, &frame) == 1)
+		continue;
+	data->len = offset;
+
+	return (0);
+invalid:
+	warnx("%s: invalid ID3v2 extended header", data->path);
+error:
+	free(buf);
+	return (-1);
+}
+
+
+/*
+ * replace the current tag by a new one holding the given frames, followed by
+ * enough padding for the next writes to be done in place.
+ */
+static int
+t_ftid3v2_rewrite(struct t_ftid3v2_data *data, const char *frames, size_t len)
+{
+	struct t_rewrite rw;
+	unsigned char *tag = NULL;
+	size_t padding, size;
+	ssize_t w;
+	int fd, ret = -1;
+
+	assert(data != NULL);
+	assert(frames != NULL);
+
+	if (t_rewrite_open(&rw, data->path) == -1) {
+		warn("%s", data->path);
+		return (-1);
+	}
+
+	padding = t_backend_padding((size_t)data->region - ID3V2_HEADER_LEN -
+	    data->len);
+	/* keep the audio data at the same offset in a block than in the
+	   original file so that it can be shared */
+	padding += (size_t)t_rewrite_align(&rw, data->region,
+	    (off_t)(ID3V2_HEADER_LEN + len + padding));
+	if (len > ID3V2_MAXSIZE) {
+		warnx("%s: ID3v2 tag too large", data->path);
+		goto cleanup;
+	}
+	if (len + padding > ID3V2_MAXSIZE)
+		padding = ID3V2_MAXSIZE - len;
+	size = ID3V2_HEADER_LEN + len + padding;
+
+	if ((tag = calloc(1, size)) == NULL)
+		goto error;
+	(void)memcpy(tag, "ID3", 3);
+	tag[3] = (unsigned char)data->major;
+	id3v2_syncsafe_set(tag + 6, (uint32_t)(len + padding));
+	(void)memcpy(tag + ID3V2_HEADER_LEN, frames, len);
+	if ((w = write(rw.fd_out, tag, size)) == -1 || (size_t)w != size)
+		goto error;
+	if (t_rewrite_copy(&rw, data->region) == -1)
+		goto error;
+	if (t_rewrite_commit(&rw) == -1)
+		goto error;
+
+	/* the original file has been replaced */
+	if ((fd = open(data->path, O_RDONLY)) == -1)
+		goto error;
+	(void)close(data->fd);
+	data->fd     = fd;
+	data->region = (off_t)size;
+
+	ret = 0;
+	goto cleanup;
+error:
+	warn("%s", data->path);
+	/* FALLTHROUGH */
+cleanup:
+	free(tag);
+	t_rewrite_abort(&rw);
+	return (ret);
+}
+
+
+/*
+ * parse the frame at *offset and advance *offset to the next frame.
+ *
+ * @return
+ *   1 if a frame was parsed, 0 if there is no frame left (the padding has been
+ *   reached), -1 if the frame is invalid.
+ */
+static int
+id3v2_frame_next(const struct t_ftid3v2_data *data, size_t *offset,
+    struct id3v2_frame *frame)
+{
+	const unsigned char *p;
+	size_t left, size, skip;
+	unsigned flags;
+	int i;
+
+	assert(data != NULL);
+	assert(offset != NULL);
+	assert(frame != NULL);
+
+	left = data->len - *offset;
+	p    = data->frames + *offset;
+	if (left < ID3V2_HEADER_LEN || p[0] == '\0')
+		return (0);
+	for (i = 0; i < 4; i++) {
+		if (!isupper(p[i]) && !isdigit(p[i]))
+			return (-1);
+		frame->id[i] = (char)p[i];
+	}
+	frame->id[4] = '\0';
+	if (data->major == 3)
+		size = id3v2_be32_get(p + 4);
+	else
+		size = id3v2_syncsafe_get(p + 4);
+	if (size > left - ID3V2_HEADER_LEN)
+		return (-1);
+	frame->raw    = p;
+	frame->rawlen = ID3V2_HEADER_LEN + size;
+
+	/* some flags signal data preceding the frame content */
+	flags = (unsigned)p[8] << 8 | p[9];
+	skip  = 0;
+	if (data->major == 3) {
+		frame->opaque = (flags & 0x00C0) != 0;
+		frame->unsync = 0;
+		if (flags & 0x0020) /* grouping identity */
+			skip += 1;
+	} else {
+		frame->opaque = (flags & 0x000C) != 0;
+		frame->unsync = (flags & 0x0002) != 0;
+		if (flags & 0x0040) /* grouping identity */
+			skip += 1;
+		if (flags & 0x0001) /* data length indicator */
+			skip += 4;
+	}
+	if (skip > size)
+		return (-1);
+	frame->content = p + ID3V2_HEADER_LEN + skip;
+	frame->len     = size - skip;
+
+	*offset += frame->rawlen;
+	return (1);
+}
+
+
+/*
+ * add the tags of a frame to tlist. Only the text frames of id3v2_keys and
+ * id3v2_text_frames, the user defined text frames (TXXX) and the comments
+ * without description (COMM) are mapped to tags.
+ *
+ * @param tlist
+ *   The list to append to. When NULL, only check if the frame is mapped.
+ *
+ * @return
+ *   1 if the frame is mapped to tags, 0 if not, -1 on error.
+ */
+static int
+id3v2_frame_to_taglist(const struct t_ftid3v2_data *data,
+    const struct id3v2_frame *frame, struct t_taglist *tlist)
+{
+	unsigned char *copy = NULL;
+	const unsigned char *p;
+	const char *key, *val, *end;
+	char *text = NULL;
+	size_t len, tlen, skip;
+	int comm, ret = -1;
+
+	assert(data != NULL);
+	assert(frame != NULL);
+
+	comm = (strcmp(frame->id, "COMM") == 0);
+	if (frame->opaque || (frame->id[0] != 'T' && !comm))
+		return (0);
+	/* non-standard text frames (e.g. iTunes TCMP) are kept as is */
+	if (frame->id[0] == 'T' && strcmp(frame->id, "TXXX") != 0 &&
+	    id3v2_frame_key(data->major, frame->id) == NULL &&
+	    strstr(id3v2_text_frames, frame->id) == NULL)
+		return (0);
+
+	p   = frame->content;
+	len = frame->len;
+	if (frame->unsync) {
+		if ((copy = malloc(len + 1)) == NULL)
+			return (-1);
+		(void)memcpy(copy, p, len);
+		len = id3v2_unsync(copy, len);
+		p = copy;
+	}
+	/* the text encoding, followed by the language for comments */
+	skip = (comm ? 4 : 1);
+	if (len < skip) {
+		/* empty frame, dropped on write */
+		ret = 1;
+		goto cleanup;
+	}
+	text = id3v2_text_decode(p + skip, len - skip, p[0], &tlen);
+	if (text == NULL) {
+		warnx("%s: %s: invalid ID3v2 text frame", data->path, frame->id);
+		goto cleanup;
+	}
+	val = text;
+	end = text + tlen;
+
+	if (comm || strcmp(frame->id, "TXXX") == 0) {
+		/* the first value is the description */
+		if (comm && *text != '\0') {
+			ret = 0;
+			goto cleanup;
+		}
+		key = (comm ? "comment" : text);
+		val = text + strlen(text) + 1;
+		if (*key == '\0' || val > end) {
+			ret = 1;
+			goto cleanup;
+		}
+	} else if ((key = id3v2_frame_key(data->major, frame->id)) == NULL)
+		key = frame->id; /* from id3v2_text_frames */
+
+	/* the values are separated by NUL characters */
+	for (; tlist != NULL && val <= end; val += strlen(val) + 1) {
+		if (t_taglist_insert(tlist, key, val) == -1)
+			goto cleanup;
+	}
+
+	ret = 1;
+	/* FALLTHROUGH */
+cleanup:
+	free(text);
+	free(copy);
+	return (ret);
+}
+
+
+/*
+ * serialize tlist into frames, followed by the frames of the current tag that
+ * are not mapped to tags.
+ *
+ * All the values of a key are stored in a single frame, separated by a NUL
+ * character in ID3v2.4 and by a slash in ID3v2.3 (which has no support for
+ * multiple values).
+ */
+static int
+id3v2_taglist_to_frames(const struct t_ftid3v2_data *data,
+    const struct t_taglist *tlist, struct sbuf *sb)
+{
+	const struct t_tag *t, *u;
+	struct id3v2_frame frame;
+	struct sbuf *vals = NULL, *content = NULL;
+	unsigned char hdr[ID3V2_HEADER_LEN];
+	size_t offset, size;
+	char id[5];
+	int r, txxx, enc, ret = -1;
+
+	assert(data != NULL);
+	assert(tlist != NULL);
+	assert(sb != NULL);
+
+	if ((vals = sbuf_new_auto()) == NULL)
+		goto cleanup;
+	if ((content = sbuf_new_auto()) == NULL)
+		goto cleanup;
+
+	TAILQ_FOREACH(t, tlist->tags, entries) {
+		/* each key is handled at its first occurrence */
+		TAILQ_FOREACH(u, tlist->tags, entries) {
+			if (t_tag_keycmp(u->key, t->key) == 0)
+				break;
+		}
+		if (u != t)
+			continue;
+		txxx = (id3v2_frame_id(data->major, t->key, id) == -1);
+		if (txxx)
+			(void)strlcpy(id, "TXXX", sizeof(id));
+
+		/* join the values */
+		sbuf_clear(vals);
+		for (u = t; u != NULL; u = TAILQ_NEXT(u, entries)) {
+			if (t_tag_keycmp(u->key, t->key) != 0)
+				continue;
+			if (u != t)
+				(void)sbuf_putc(vals, data->major == 3 ? '/' : '\0');
+			(void)sbuf_bcat(vals, u->val, u->vlen);
+		}
+		if (sbuf_finish(vals) == -1)
+			goto cleanup;
+
+		/*
+		 * ID3v2.4 text is written in UTF-8. ID3v2.3 only has ISO-8859-1
+		 * and UTF-16, the former is used when possible.
+		 */
+		if (data->major == 4)
+			enc = ID3V2_UTF8;
+		else {
+			sbuf_clear(content);
+			r = id3v2_text_encode(content, sbuf_data(vals),
+			    (size_t)sbuf_len(vals), ID3V2_LATIN1);
+			if (r == 0 && txxx)
+				r = id3v2_text_encode(content, t->key, t->klen, ID3V2_LATIN1);
+			enc = (r == 0 ? ID3V2_LATIN1 : ID3V2_UTF16);
+		}
+
+		sbuf_clear(content);
+		(void)sbuf_putc(content, enc);
+		if (txxx) {
+			/* user defined text, the key is the description */
+			r = id3v2_text_encode(content, t->key, t->klen + 1, enc);
+		} else if (strcmp(id, "COMM") == 0) {
+			/* unknown language and empty description */
+			(void)sbuf_bcat(content, "XXX", 3);
+			r = id3v2_text_encode(content, "", 1, enc);
+		} else
+			r = 0;
+		if (r == 0) {
+			r = id3v2_text_encode(content, sbuf_data(vals),
+			    (size_t)sbuf_len(vals), enc);
+		}
+		if (r == -1) {
+			warnx("%s: %s: invalid UTF-8 value", data->path, t->key);
+			goto cleanup;
+		}
+		if (sbuf_finish(content) == -1)
+			goto cleanup;
+
+		size = (size_t)sbuf_len(content);
+		(void)memset(hdr, 0, sizeof(hdr));
+		(void)memcpy(hdr, id, 4);
+		if (data->major == 3)
+			id3v2_be32_set(hdr + 4, (uint32_t)size);
+		else
+			id3v2_syncsafe_set(hdr + 4, (uint32_t)size);
+		(void)sbuf_bcat(sb, hdr, sizeof(hdr));
+		(void)sbuf_bcat(sb, sbuf_data(content), size);
+	}
+
+	/* keep the other frames as is */
+	offset = 0;
+	while (id3v2_frame_next(data, &offset, &frame) == 1) {
+		if ((r = id3v2_frame_to_taglist(data, &frame, NULL)) == -1)
+			goto cleanup;
+		if (r == 0)
+			(void)sbuf_bcat(sb, frame.raw, frame.rawlen);
+	}
+	if (sbuf_error(sb) != 0)
+		goto cleanup;
+
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	if (content != NULL)
+		sbuf_delete(content);
+	if (vals != NULL)
+		sbuf_delete(vals);
+	return (ret);
+}
+
+
+/*
+ * @return
+ *   the tag key of a frame, NULL if the frame is not in id3v2_keys.
+ */
+static const char *
+id3v2_frame_key(int major, const char *id)
+{
+	const struct id3v2_key *k;
+	size_t i;
+
+	assert(id != NULL);
+
+	for (i = 0; i < NELEM(id3v2_keys); i++) {
+		k = &id3v2_keys[i];
+		if ((k->major == 0 || k->major == major) && strcmp(k->id, id) == 0)
+			return (k->key);
+	}
+	return (NULL);
+}
+
+
+/*
+ * find the frame for the given key. The text frames IDs of
+ * id3v2_text_frames can be used as keys too (e.g. tmoo).
+ *
+ * @param id
+ *   where the frame ID is stored, at least 5 bytes.
+ *
+ * @return
+ *   0 on success, -1 if the key has to be stored in a TXXX frame.
+ */
+static int
+id3v2_frame_id(int major, const char *key, char *id)
+{
+	const struct id3v2_key *k;
+	size_t i;
+
+	assert(key != NULL);
+	assert(id != NULL);
+
+	for (i = 0; i < NELEM(id3v2_keys); i++) {
+		k = &id3v2_keys[i];
+		if ((k->major == 0 || k->major == major) &&
+		    t_tag_keycmp(k->key, key) == 0) {
+			(void)strlcpy(id, k->id, 5);
+			return (0);
+		}
+	}
+
+	if (strlen(key) != 4)
+		return (-1);
+	for (i = 0; i < 4; i++)
+		id[i] = (char)toupper((unsigned char)key[i]);
+	id[4] = '\0';
+	if (strstr(id3v2_text_frames, id) == NULL)
+		return (-1);
+	return (0);
+}
+
+
+/*
+ * convert ID3v2 text to UTF-8. The NUL characters separating values are kept
+ * but the trailing ones are removed.
+ *
+ * @return
+ *   a NUL-terminated string that has to be free()'d after use, NULL on error.
+ *   outlen is set to its length.
+ */
+static char *
+id3v2_text_decode(const unsigned char *p, size_t len, int enc, size_t *outlen)
+{
+	struct sbuf *sb;
+	char *ret = NULL;
+	size_t i, n;
+	uint32_t c, c2;
+	int be, bom;
+
+	assert(p != NULL);
+	assert(outlen != NULL);
+
+	if ((sb = sbuf_new_auto()) == NULL)
+		return (NULL);
+
+	switch (enc) {
+	case ID3V2_LATIN1:
+		for (i = 0; i < len; i++)
+			id3v2_utf8_put(sb, p[i]);
+		break;
+	case ID3V2_UTF8:
+		(void)sbuf_bcat(sb, p, len);
+		break;
+	case ID3V2_UTF16:   /* FALLTHROUGH */
+	case ID3V2_UTF16BE:
+		be  = (enc == ID3V2_UTF16BE);
+		bom = (enc == ID3V2_UTF16);
+		for (i = 0; i + 1 < len; i += 2) {
+			c = (be ? (uint32_t)p[i] << 8 | p[i + 1] :
+			    (uint32_t)p[i + 1] << 8 | p[i]);
+			/* each value starts with a BOM */
+			if (bom && (c == 0xFEFF || c == 0xFFFE)) {
+				be  = (c == 0xFEFF ? be : !be);
+				bom = 0;
+				continue;
+			}
+			if (c == 0)
+				bom = (enc == ID3V2_UTF16);
+			if (c >= 0xD800 && c < 0xDC00 && i + 3 < len) {
+				/* surrogate pair */
+				c2 = (be ? (uint32_t)p[i + 2] << 8 | p[i + 3] :
+				    (uint32_t)p[i + 3] << 8 | p[i + 2]);
+				if (c2 >= 0xDC00 && c2 < 0xE000) {
+					c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+					i += 2;
+				}
+			}
+			id3v2_utf8_put(sb, c);
+		}
+		break;
+	default:
+		goto cleanup;
+	}
+	if (sbuf_finish(sb) == -1)
+		goto cleanup;
+
+	n = (size_t)sbuf_len(sb);
+	while (n > 0 && sbuf_data(sb)[n - 1] == '\0')
+		n--;
+	if ((ret = malloc(n + 1)) == NULL)
+		goto cleanup;
+	(void)memcpy(ret, sbuf_data(sb), n);
+	ret[n] = '\0';
+	*outlen = n;
+	/* FALLTHROUGH */
+cleanup:
+	sbuf_delete(sb);
+	return (ret);
+}
+
+
+/*
+ * append the first len bytes of the UTF-8 string s, converted to the given
+ * encoding. NUL characters are converted too, so the string terminator can be
+ * included in len.
+ *
+ * @return
+ *   0 on success, -1 if s is not valid UTF-8 or can't be represented in
+ *   ISO-8859-1.
+ */
+static int
+id3v2_text_encode(struct sbuf *sb, const char *s, size_t len, int enc)
+{
+	const char *end = s + len;
+	uint32_t c;
+
+	assert(sb != NULL);
+	assert(s != NULL);
+
+	if (enc == ID3V2_UTF8) {
+		(void)sbuf_bcat(sb, s, len);
+		return (0);
+	}
+	if (enc == ID3V2_UTF16)
+		(void)sbuf_bcat(sb, "\xFF\xFE", 2);
+	while (s < end) {
+		if (id3v2_utf8_next(&s, end, &c) == -1)
+			return (-1);
+		if (enc == ID3V2_LATIN1) {
+			if (c > 0xFF)
+				return (-1);
+			(void)sbuf_putc(sb, (int)c);
+		} else if (c < 0x10000) {
+			(void)sbuf_putc(sb, (int)(c & 0xFF));
+			(void)sbuf_putc(sb, (int)(c >> 8));
+		} else {
+			/* surrogate pair, little endian */
+			c -= 0x10000;
+			(void)sbuf_putc(sb, (int)(c >> 10 & 0xFF));
+			(void)sbuf_putc(sb, (int)(0xD8 | c >> 18));
+			(void)sbuf_putc(sb, (int)(c & 0xFF));
+			(void)sbuf_putc(sb, (int)(0xDC | (c >> 8 & 0x03)));
+		}
+	}
+	return (0);
+}
+
+
+/*
+ * decode the UTF-8 character at *s and advance *s past it.
+ *
+ * @return
+ *   0 on success, -1 if *s is not a valid UTF-8 sequence.
+ */
+static int
+id3v2_utf8_next(const char **s, const char *end, uint32_t *c)
+{
+	const unsigned char *p;
+	size_t i, n;
+
+	assert(s != NULL);
+	assert(c != NULL);
+
+	p = (const unsigned char *)*s;
+	if (p[0] < 0x80) {
+		*c = p[0];
+		n  = 0;
+	} else if ((p[0] & 0xE0) == 0xC0) {
+		*c = p[0] & 0x1F;
+		n  = 1;
+	} else if ((p[0] & 0xF0) == 0xE0) {
+		*c = p[0] & 0x0F;
+		n  = 2;
+	} else if ((p[0] & 0xF8) == 0xF0) {
+		*c = p[0] & 0x07;
+		n  = 3;
+	} else
+		return (-1);
+	if ((size_t)(end - *s) <= n)
+		return (-1);
+	for (i = 1; i <= n; i++) {
+		if ((p[i] & 0xC0) != 0x80)
+			return (-1);
+		*c = *c << 6 | (p[i] & 0x3F);
+	}
+	if (*c > 0x10FFFF || (*c >= 0xD800 && *c < 0xE000))
+		return (-1);
+	*s += n + 1;
+	return (0);
+}
+
+
+static void
+id3v2_utf8_put(struct sbuf *sb, uint32_t c)
+{
+	assert(sb != NULL);
+
+	if (c < 0x80) {
+		(void)sbuf_putc(sb, (int)c);
+	} else if (c < 0x800) {
+		(void)sbuf_putc(sb, (int)(0xC0 | c >> 6));
+		(void)sbuf_putc(sb, (int)(0x80 | (c & 0x3F)));
+	} else if (c < 0x10000) {
+		(void)sbuf_putc(sb, (int)(0xE0 | c >> 12));
+		(void)sbuf_putc(sb, (int)(0x80 | (c >> 6 & 0x3F)));
+		(void)sbuf_putc(sb, (int)(0x80 | (c & 0x3F)));
+	} else {
+		(void)sbuf_putc(sb, (int)(0xF0 | c >> 18));
+		(void)sbuf_putc(sb, (int)(0x80 | (c >> 12 & 0x3F)));
+		(void)sbuf_putc(sb, (int)(0x80 | (c >> 6 & 0x3F)));
+		(void)sbuf_putc(sb, (int)(0x80 | (c & 0x3F)));
+	}
+}
+
+
+static uint32_t
+id3v2_syncsafe_get(const unsigned char *p)
+{
+	return ((uint32_t)(p[0] & 0x7F) << 21 | (uint32_t)(p[1] & 0x7F) << 14 |
+	    (uint32_t)(p[2] & 0x7F) << 7 | (uint32_t)(p[3] & 0x7F));
+}
+
+
+static void
+id3v2_syncsafe_set(unsigned char *p, uint32_t n)
+{
+	p[0] = (unsigned char)(n >> 21 & 0x7F);
+	p[1] = (unsigned char)(n >> 14 & 0x7F);
+	p[2] = (unsigned char)(n >> 7 & 0x7F);
+	p[3] = (unsigned char)(n & 0x7F);
+}
+
+
+static uint32_t
+id3v2_be32_get(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | (uint32_t)p[3]);
+}
+
+
+static void
+id3v2_be32_set(unsigned char *p, uint32_t n)
+{
+	p[0] = (unsigned char)(n >> 24);
+	p[1] = (unsigned char)(n >> 16);
+	p[2] = (unsigned char)(n >> 8);
+	p[3] = (unsigned char)n;
+}
+
+
+/*
+ * undo the unsynchronisation scheme (0xFF 0x00 was written for 0xFF), in
+ * place.
+ *
+ * @return
+ *   the new length.
+ */
+static size_t
+id3v2_unsync(unsigned char *p, size_t len)
+{
+	size_t i, j;
+
+	for (i = j = 0; i < len; i++) {
+		p[j++] = p[i];
+		if (p[i] == 0xFF && i + 1 < len && p[i + 1] == 0x00)
+			i++;
+	}
+	return (j);
+}
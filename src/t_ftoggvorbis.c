@@ -1,28 +1,44 @@
 /*
  * t_ftoggvorbis.c
  *
- * Ogg/Vorbis backend, using libogg, libvorbis and libvorbisfile
+ * Ogg/Vorbis backend, using libogg and libvorbis
  */
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 
 /* Ogg headers */
 #include "ogg/ogg.h"
 /* Vorbis headers */
-#define	OV_EXCLUDE_STATIC_CALLBACKS	1
-#include "vorbis/vorbisfile.h"
-#undef	OV_EXCLUDE_STATIC_CALLBACKS
 #include "vorbis/codec.h"
 
 #include "t_config.h"
 #include "t_backend.h"
+#include "t_rewrite.h"
 
 
 static const char libid[] = "libvorbis";
 
+/*
+ * how many bytes may be skipped at the start of a file before finding the
+ * first Ogg page (same limit as libvorbisfile).
+ */
+#define	T_OGG_MAXSKIP	65536
+
 
 struct t_ftoggvorbis_data {
 	const char		*libid; /* pointer to libid */
 	const char		*path; /* this is needed for t_ftoggvorbis_write() */
-	struct OggVorbis_File	 vf;
+	struct vorbis_comment	 vc; /* comments of the first logical stream */
+	long			 vc_padding; /* padding bytes of the comment packet */
+};
+
+/* a page holding (a part of) the comment packet, see t_ftoggvorbis_write_inplace() */
+struct t_oggpage {
+	off_t		 offset; /* offset of the page in the file */
+	ogg_page	 og;     /* header and body point into data */
+	long		 vc_len; /* comment bytes at the start of the body */
+	unsigned char	*data;
 };
 
 
@@ -33,9 +49,22 @@ static struct t_taglist	*t_ftoggvorbis_read(void *opaque);
 static int		 t_ftoggvorbis_write(void *opaque, const struct t_taglist *tlist);
 static void		 t_ftoggvorbis_clear(void *opaque);
 
+/* helpers for t_ftoggvorbis_init() */
+static int		 t_ftoggvorbis_read_headers(const char *path,
+			    struct vorbis_comment *vc, long *vc_padding);
+static long		 vorbis_comment_length(const struct vorbis_comment *vc);
+
 /* helpers for t_ftoggvorbis_write() */
-static int		 fwrite_drain_func(void *fp, const char *data, int len);
+static int		 t_ftoggvorbis_write_inplace(struct t_ftoggvorbis_data *data,
+			    const ogg_packet *vc_packet, long *vc_bytes);
+static long		 t_ogg_align_padding(const struct t_rewrite *rw, off_t in,
+			    off_t out, long vc_len, long setup_len);
+static off_t		 t_ogg_headers_size(long vc_len, long setup_len,
+			    long *npages);
+static int		 write_drain_func(void *fdp, const char *data, int len);
 static int		 sbuf_write_ogg_page(struct sbuf *sb, ogg_page *p);
+static int		 ogg_page_set_pageno(ogg_page *og, long pageno);
+static void		 t_ogg_page_checksum_set(ogg_page *og);
 
 
 struct t_backend *
@@ -69,10 +98,10 @@ t_ftoggvorbis_init(const char *path)
 	data->libid = libid;
 	data->path = p = (char *)(data + 1);
 	(void)memcpy(p, path, plen + 1);
-	bzero(&data->vf, sizeof(struct OggVorbis_File));
+	vorbis_comment_init(&data->vc);
 
-	if (ov_fopen(data->path, &data->vf) != 0) {
-		/* XXX: check OV_EFAULT or OV_EREAD? */
+	if (t_ftoggvorbis_read_headers(data->path, &data->vc, &data->vc_padding) == -1) {
+		vorbis_comment_clear(&data->vc);
 		free(data);
 		return (NULL);
 	}
@@ -81,6 +110,119 @@ t_ftoggvorbis_init(const char *path)
 }
 
 
+/*
+ * read the identification and comment header packets of the first logical
+ * stream.
+ *
+ * Only the first pages of the file are read. ov_fopen() would also seek
+ * through the whole file to find every logical stream boundaries and their
+ * length, which we don't need.
+ */
+static int
+t_ftoggvorbis_read_headers(const char *path, struct vorbis_comment *vc,
+    long *vc_padding)
+{
+	ogg_sync_state   oy; /* sync and verify incoming physical bitstream */
+	ogg_stream_state os; /* weld the pages into a logical stream of packets */
+	ogg_page         og;
+	ogg_packet       op;
+	vorbis_info      vi; /* needed by vorbis_synthesis_headerin() */
+	int fd, nstream = 0, npacket = 0, serialno = 0, success = 0;
+	long n, skipped = 0;
+
+	assert(path != NULL);
+	assert(vc != NULL);
+	assert(vc_padding != NULL);
+
+	(void)ogg_sync_init(&oy); /* always return 0 */
+	vorbis_info_init(&vi);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		goto cleanup;
+
+	while (npacket < 2) {
+		n = ogg_sync_pageseek(&oy, &og);
+		if (n < 0) {
+			/* bytes were skipped, give up early on files that are
+			   not Ogg at all. */
+			skipped -= n;
+			if (nstream == 0 && skipped > T_OGG_MAXSKIP)
+				goto cleanup;
+			continue;
+		} else if (n == 0) {
+			/* more data needed */
+			char *buf;
+			ssize_t r;
+			if ((buf = ogg_sync_buffer(&oy, BUFSIZ)) == NULL)
+				goto cleanup;
+			if ((r = read(fd, buf, BUFSIZ)) <= 0)
+				goto cleanup;
+			/* casting r is fine: it is at most BUFSIZ */
+			if (ogg_sync_wrote(&oy, (long)r) == -1)
+				goto cleanup;
+			continue;
+		}
+		/* here a page was sync'ed. */
+		if (nstream == 0) {
+			if (!ogg_page_bos(&og))
+				goto cleanup;
+			serialno = ogg_page_serialno(&og);
+			if (ogg_stream_init(&os, serialno) == -1)
+				goto cleanup;
+			nstream = 1;
+		} else if (ogg_page_serialno(&og) != serialno) {
+			/* a page from another multiplexed stream */
+			continue;
+		}
+		if (ogg_stream_pagein(&os, &og) == -1)
+			goto cleanup;
+		while (npacket < 2 && ogg_stream_packetout(&os, &op) == 1) {
+			/* vorbis_synthesis_headerin() checks that the stream
+			   is Vorbis and parses the comments. */
+			if (vorbis_synthesis_headerin(&vi, vc, &op) != 0)
+				goto cleanup;
+			if (++npacket == 2) {
+				/* trailing bytes after the comments are
+				   padding. */
+				*vc_padding = op.bytes - vorbis_comment_length(vc);
+				if (*vc_padding < 0)
+					*vc_padding = 0;
+			}
+		}
+	}
+
+	success = 1;
+	/* FALLTHROUGH */
+cleanup:
+	if (nstream > 0)
+		ogg_stream_clear(&os);
+	vorbis_info_clear(&vi);
+	ogg_sync_clear(&oy);
+	if (fd != -1)
+		(void)close(fd);
+	return (success ? 0 : -1);
+}
+
+
+/*
+ * compute the length of the comment header packet of vc, without padding.
+ */
+static long
+vorbis_comment_length(const struct vorbis_comment *vc)
+{
+	long len;
+	int i;
+
+	assert(vc != NULL);
+
+	/* packet type, "vorbis", vendor length, vendor, comment count */
+	len = 1 + 6 + 4 + (vc->vendor == NULL ? 0 : (long)strlen(vc->vendor)) + 4;
+	for (i = 0; i < vc->comments; i++)
+		len += 4 + vc->comment_lengths[i];
+	/* framing bit */
+	return (len + 1);
+}
+
+
 static struct t_taglist *
 t_ftoggvorbis_read(void *opaque)
 {
@@ -93,9 +235,7 @@ t_ftoggvorbis_read(void *opaque)
 	data = opaque;
 	assert(data->libid == libid);
 
-	vc = ov_comment(&data->vf, -1);
-	if (vc == NULL)
-		return (NULL);
+	vc = &data->vc;
 
 	tlist = t_taglist_new();
 	if (tlist == NULL)
@@ -126,38 +266,38 @@ t_ftoggvorbis_read(void *opaque)
 static int
 t_ftoggvorbis_write(void *opaque, const struct t_taglist *tlist)
 {
-	FILE             *fp_in  = NULL;  /* input file pointer */
-	FILE             *fp_out = NULL; /* output file pointer */
+	struct t_rewrite  rw;     /* the file rewrite, see t_rewrite.h */
+	int               eof = 0; /* 1 once rw.fd_in has been read entirely */
+	off_t             in_off = 0; /* input offset of the next synced page */
+	off_t             out_off; /* output offset of the header pages */
+	off_t             tail = -1; /* input offset of the unchanged pages */
+	char             *obuf = NULL; /* output buffer used by sb */
 	ogg_sync_state    oy_in;  /* sync and verify incoming physical bitstream */
-	ogg_stream_state  os_in;  /* take physical pages, weld into a logical
-	                             stream of packets */
-	ogg_stream_state  os_out; /* take physical pages, weld into a logical
-	                             stream of packets */
-	ogg_page          og_in;  /* one Ogg bitstream page. Vorbis packets are inside */
-	ogg_page          og_out; /* one Ogg bitstream page. Vorbis packets are inside */
-	ogg_packet        op_in;  /* one raw packet of data for decode */
+	ogg_stream_state  os_in;  /* take the header pages, weld them into a
+	                             logical stream of packets */
+	ogg_stream_state  os_out; /* paginate the new header packets */
+	ogg_page          og_in;  /* one Ogg bitstream page */
+	ogg_page          og_out; /* one rebuilt header page */
+	ogg_packet        op_in;  /* one header packet */
 	ogg_packet        my_vc_packet; /* our custom packet containing vc_out */
-	vorbis_info       vi_in;  /* struct that stores all the static vorbis
-	                             bitstream settings */
-	vorbis_comment    vc_in;  /* struct that stores all the bitstream user
-	                             comment */
+	ogg_packet        vc_packet; /* my_vc_packet followed by padding */
+	unsigned char    *padded = NULL; /* vc_packet data */
+	size_t            padding; /* padding bytes reserved in vc_packet */
+	long              vc_bytes = 0; /* length of the comment packet in the file */
 	vorbis_comment    vc_out; /* struct that stores all the bitstream user
 	                             comment */
-	unsigned long     nstream_in; /* stream counter */
-	unsigned long     npage_in;   /* page counter */
-	unsigned long     npacket_in; /* packet counter */
-	long              bs;     /* blocksize of the current packet */
-	long              lastbs; /* blocksize of the last packet */
-	ogg_int64_t       granulepos; /* granulepos of the current page */
+	int               serialno; /* serial number of the Vorbis stream */
+	int               nstream = 0; /* 1 once os_in and os_out are initialized */
+	int               npacket_in; /* header packet counter */
+	int               in_link;  /* 1 while reading the first logical stream */
+	long              pageshift; /* page sequence number shift */
+	long              n;
 	struct sbuf *sb = NULL;
-	char *tempfile  = NULL;
 	struct t_ftoggvorbis_data *data;
 	const struct t_tag *t;
 	enum {
-		BUILDING_VC_PACKET, SETUP, B_O_S, START_READING,
-		STREAMS_INITIALIZED, READING_HEADERS, READING_DATA,
-		READING_DATA_NEED_FLUSH, READING_DATA_NEED_PAGEOUT, E_O_S,
-		WRITE_FINISH, RENAMING, DONE_SUCCESS,
+		BUILDING_VC_PACKET, WRITING_IN_PLACE, SETUP, READING_HEADERS,
+		COPYING_PAGES, WRITE_FINISH, RENAMING, DONE_SUCCESS,
 	} state;
 
 	assert(opaque != NULL);
@@ -167,11 +307,24 @@ t_ftoggvorbis_write(void *opaque, const struct t_taglist *tlist)
 	/*
 	 * In order to modify the file's tag, we have to rewrite the entire
 	 * file. The Ogg container is divided into "pages" and "packets" and the
-	 * algorithm is to replace the SECOND ogg packet (which contains vorbis
-	 * comments) and copy ALL THE OTHERS. See "Metadata workflow":
+	 * Vorbis comments are stored in the SECOND packet of the stream. See
+	 * "Metadata workflow":
 	 * https://xiph.org/vorbis/doc/libvorbis/overview.html
+	 *
+	 * The Vorbis specification require the three header packets to be
+	 * alone on their pages, the first audio packet starting on a fresh
+	 * page. Thus only the header pages are rebuilt (with our comment
+	 * packet) while all the other pages are copied verbatim. When the
+	 * count of header pages is unchanged, the following pages are copied
+	 * at once by t_rewrite_copy() (sharing their blocks with the original
+	 * file when possible). Otherwise, the following pages of the stream
+	 * need their sequence number (and so their CRC) to be updated.
+	 *
+	 * Before that, we try to avoid the rewrite altogether by updating the
+	 * comment packet in place (see t_ftoggvorbis_write_inplace()).
 	 */
 
+	(void)ogg_sync_init(&oy_in); /* always return 0 */
 	state = BUILDING_VC_PACKET;
 	vorbis_comment_init(&vc_out);
 	TAILQ_FOREACH(t, tlist->tags, entries)
@@ -181,218 +334,223 @@ t_ftoggvorbis_write(void *opaque, const struct t_taglist *tlist)
 		goto cleanup_label;
 	vorbis_comment_clear(&vc_out);
 
-	state = SETUP;
-	/* open files & stuff */
-	(void)ogg_sync_init(&oy_in); /* always return 0 */
-	if ((fp_in = fopen(data->path, "r")) == NULL)
+	state = WRITING_IN_PLACE;
+	switch (t_ftoggvorbis_write_inplace(data, &my_vc_packet, &vc_bytes)) {
+	case 0:
+		data->vc_padding = vc_bytes - my_vc_packet.bytes;
+		t_backend_count_write(1);
+		state = DONE_SUCCESS;
 		goto cleanup_label;
-	if ((sb = sbuf_new(NULL, NULL, BUFSIZ + 1, SBUF_FIXEDLEN)) == NULL)
+	case 1: /* doesn't fit, we have to rewrite the file. */
+		break;
+	default:
 		goto cleanup_label;
-	/* open the write file pointer */
-	if (asprintf(&tempfile, "%s/.__%s_XXXXXX", t_dirname(data->path), getprogname()) < 0)
+	}
+	if (!t_backend_may_rewrite(data->path))
+		goto cleanup_label;
+	/* since the file is rewritten, reserve some padding in the comment
+	   packet for the next updates to be done in place. */
+	padding = t_backend_padding((size_t)data->vc_padding);
+	if (padding > (size_t)(LONG_MAX / 2 - my_vc_packet.bytes))
+		goto cleanup_label;
+
+	state = SETUP;
+	/*
+	 * open files & stuff. The header pages are read and written
+	 * sequentially through large buffers (see T_REWRITE_BUFSIZE).
+	 */
+	if (t_rewrite_open(&rw, data->path) == -1)
 		goto cleanup_label;
-	if (mkstemps(tempfile, 0) == -1)
+	if (posix_memalign((void **)&obuf, (size_t)sysconf(_SC_PAGESIZE),
+	    T_REWRITE_BUFSIZE) != 0) {
+		obuf = NULL;
 		goto cleanup_label;
-	if ((fp_out = fopen(tempfile, "w")) == NULL)
+	}
+	if ((sb = sbuf_new(NULL, obuf, T_REWRITE_BUFSIZE, SBUF_FIXEDLEN)) == NULL)
 		goto cleanup_label;
-	sbuf_set_drain(sb, fwrite_drain_func, fp_out);
-	lastbs = granulepos = 0;
-
-	nstream_in = 0;
-bos_label: /* beginning of a stream */
-	state = B_O_S; /* never read, but that's fine */
-	nstream_in += 1;
-	npage_in = npacket_in = 0;
-	vorbis_info_init(&vi_in);
-	vorbis_comment_init(&vc_in);
-
-	state = START_READING;
+	sbuf_set_drain(sb, write_drain_func, &rw.fd_out);
+
+	serialno   = 0;
+	nstream    = 0;
+	npacket_in = 0;
+	in_link    = 1;
+	pageshift  = 0;
+	state = READING_HEADERS;
 	/* main loop: read the input file into buf in order to sync pages out */
-	while (state != E_O_S) {
-		switch (ogg_sync_pageout(&oy_in, &og_in)) {
-		case 0:  /* more data needed or an internal error occurred. */
-		case -1: /* stream has not yet captured sync (bytes were skipped). */
-			if (feof(fp_in)) {
-				if (state < READING_DATA)
-					goto cleanup_label;
-				/* There is no more data to read and we could
-				   not get a page so we're done here. */
-				state = E_O_S;
-			} else {
-				/* read more data and try again to get a page. */
-				char *buf;
-				/* get a buffer */
-				if ((buf = ogg_sync_buffer(&oy_in, BUFSIZ)) == NULL)
-					goto cleanup_label;
-				/* read a part of the file */
-				/* casting fread return value to int is fine: it
-				   is at most BUFSIZ */
-				int s = (int)fread(buf, 1, BUFSIZ, fp_in);
-				/* tell ogg how much was read */
-				if (ogg_sync_wrote(&oy_in, s) == -1)
+	for (;;) {
+		n = ogg_sync_pageseek(&oy_in, &og_in);
+		if (n < 0) {
+			/* stream has not yet captured sync (bytes were
+			   skipped). */
+			in_off += -n;
+			continue;
+		} else if (n == 0) {
+			/* more data needed or an internal error occurred. */
+			char *buf;
+			ssize_t r;
+			if (eof)
+				break;
+			/* get a buffer */
+			if ((buf = ogg_sync_buffer(&oy_in, T_REWRITE_BUFSIZE)) == NULL)
+				goto cleanup_label;
+			/* read a part of the file */
+			if ((r = read(rw.fd_in, buf, T_REWRITE_BUFSIZE)) == -1) {
+				if (errno == EINTR)
+					continue;
+				goto cleanup_label;
+			}
+			eof = (r == 0);
+			/* tell ogg how much was read. casting r is fine: it is
+			   at most T_REWRITE_BUFSIZE */
+			if (ogg_sync_wrote(&oy_in, (long)r) == -1)
+				goto cleanup_label;
+			continue;
+		}
+		/* here a page was sync'ed. */
+		in_off += n;
+
+		if (state == COPYING_PAGES) {
+			if (in_link && ogg_page_serialno(&og_in) == serialno) {
+				/* renumber the page */
+				if (ogg_page_set_pageno(&og_in,
+				    ogg_page_pageno(&og_in) + pageshift) == -1)
 					goto cleanup_label;
+				/* og_in was the last page of the stream, the
+				   next pages belong to another link */
+				if (ogg_page_eos(&og_in))
+					in_link = 0;
 			}
+			if (sbuf_write_ogg_page(sb, &og_in) == -1)
+				goto cleanup_label;
 			continue;
 		}
-		/* here ogg_sync_pageout() returned 1 and a page was sync'ed. */
-		if (++npage_in == 1) {
+
+		/* state == READING_HEADERS */
+		if (nstream == 0) {
 			/* init both input and output streams with the serialno
 			   of the first page */
-			if (ogg_stream_init(&os_in, ogg_page_serialno(&og_in)) == -1)
+			serialno = ogg_page_serialno(&og_in);
+			if (ogg_stream_init(&os_in, serialno) == -1)
 				goto cleanup_label;
-			if (ogg_stream_init(&os_out, ogg_page_serialno(&og_in)) == -1) {
+			if (ogg_stream_init(&os_out, serialno) == -1) {
 				ogg_stream_clear(&os_in);
 				goto cleanup_label;
 			}
-			state = STREAMS_INITIALIZED;
+			nstream = 1;
+		} else if (ogg_page_serialno(&og_in) != serialno) {
+			/* a page from another multiplexed stream */
+			if (sbuf_write_ogg_page(sb, &og_in) == -1)
+				goto cleanup_label;
+			continue;
 		}
 
-		/* put the page in input stream, and then loop through each its
-		   packet(s) */
+		/* put the page in input stream, and then loop through each of
+		   its packet(s) */
 		if (ogg_stream_pagein(&os_in, &og_in) == -1)
 			goto cleanup_label;
-		while (ogg_stream_packetout(&os_in, &op_in) == 1) {
-			ogg_packet *target;
-			/*
-			 * This is where we really do what we mean to do: the
-			 * second packet is the commentheader packet, we replace
-			 * it with my_vc_packet if we're on the first stream.
-			 */
-			if (++npacket_in == 2 && nstream_in == 1)
-				target = &my_vc_packet;
-			else
-				target = &op_in;
-
-			if (npacket_in <= 3) {
-				/*
-				 * The first three packets are header packets.
-				 * We use them to get the vorbis_info which
-				 * will be used later. vc_in will not be unused.
-				 */
-				if (vorbis_synthesis_headerin(&vi_in, &vc_in, &op_in) != 0)
+		while (npacket_in < 3 && ogg_stream_packetout(&os_in, &op_in) == 1) {
+			switch (++npacket_in) {
+			case 1:
+				if (vorbis_synthesis_idheader(&op_in) != 1)
 					goto cleanup_label;
-				/* force a flush after the third ogg_packet */
-				state = (npacket_in == 3 ? READING_DATA_NEED_FLUSH : READING_HEADERS);
-			} else {
+				break;
+			case 2:
+				/* the comment packet is replaced by vc_packet
+				   once the setup packet is known, see below. */
+				continue;
+			case 3:
 				/*
-				 * granulepos computation.
-				 *
-				 * The granulepos is stored into the *pages* and
-				 * is used by the codec to seek through the
-				 * bitstream.  Its value is codec dependent (in
-				 * the Vorbis case it is the number of samples
-				 * elapsed).
-				 *
-				 * The vorbis_packet_blocksize() actually
-				 * compute the number of sample that would be
-				 * stored by the packet (without decoding it).
-				 * This is the same formula as in vcedit example
-				 * from vorbis-tools.
-				 *
-				 * We use here the vorbis_info previously filled
-				 * when reading header packets.
-				 *
-				 * XXX: check if this is not a vorbis stream ?
+				 * This is where we really do what we mean to
+				 * do: the second packet is the commentheader
+				 * packet, we replace it with vc_packet. Its
+				 * padding is slightly grown so that the header
+				 * pages end on the same block offset in both
+				 * files, allowing t_rewrite_copy() to share
+				 * the audio pages blocks.
 				 */
-				bs = vorbis_packet_blocksize(&vi_in, &op_in);
-				if (bs < 0)
+				if (os_in.lacing_returned != os_in.lacing_fill)
+					break; /* reported below */
+				if ((out_off = lseek(rw.fd_out, 0, SEEK_CUR)) == -1)
 					goto cleanup_label;
-				granulepos += (lastbs == 0 ? 0 : (bs + lastbs) / 4);
-				lastbs = bs;
-
-				/* write page(s) if needed */
-				if (state == READING_DATA_NEED_FLUSH) {
-					while (ogg_stream_flush(&os_out, &og_out))
-						(void)sbuf_write_ogg_page(sb, &og_out);
-				} else if (state == READING_DATA_NEED_PAGEOUT) {
-					while (ogg_stream_pageout(&os_out, &og_out))
-						(void)sbuf_write_ogg_page(sb, &og_out);
-				}
-
-				/*
-				 * Decide wether we need to write a page based
-				 * on our granulepos computation. The -1 case is
-				 * very common because only the last packet of a
-				 * page has its granulepos set by the ogg layer
-				 * (which only store a granulepos per page), so
-				 * all the other have a value of -1 (we need to
-				 * set the granulepos for each packet though).
-				 *
-				 * The other cases logic are borrowed from
-				 * vcedit and I fail to see how granulepos could
-				 * mismatch because we don't alter the data
-				 * packet.
-				 */
-				state = READING_DATA;
-				if (op_in.granulepos == -1) {
-					op_in.granulepos = granulepos;
-				} else if (granulepos <= op_in.granulepos) {
-					state = READING_DATA_NEED_PAGEOUT;
-				} else /* if granulepos > op_in.granulepos */ {
-					state = READING_DATA_NEED_FLUSH;
-					granulepos = op_in.granulepos;
-				}
+				out_off += sbuf_len(sb);
+				padding += (size_t)t_ogg_align_padding(&rw, in_off,
+				    out_off, my_vc_packet.bytes + (long)padding,
+				    op_in.bytes);
+				padded = calloc(1, (size_t)my_vc_packet.bytes + padding);
+				if (padded == NULL)
+					goto cleanup_label;
+				(void)memcpy(padded, my_vc_packet.packet,
+				    (size_t)my_vc_packet.bytes);
+				vc_packet = my_vc_packet;
+				vc_packet.packet = padded;
+				vc_packet.bytes += (long)padding;
+				vc_packet.granulepos = 0;
+				if (ogg_stream_packetin(&os_out, &vc_packet) == -1)
+					goto cleanup_label;
+				break;
 			}
-			/* insert the target packet into the output stream */
-			if (ogg_stream_packetin(&os_out, target) == -1)
+			op_in.granulepos = 0;
+			if (ogg_stream_packetin(&os_out, &op_in) == -1)
 				goto cleanup_label;
+			/* the identification header is alone on the first
+			   page, the two others share the following page(s) */
+			if (npacket_in == 1 || npacket_in == 3) {
+				while (ogg_stream_flush(&os_out, &og_out)) {
+					if (sbuf_write_ogg_page(sb, &og_out) == -1)
+						goto cleanup_label;
+				}
+			}
 		}
-		if (ogg_page_eos(&og_in)) {
-			/* og_in was the last page of the stream */
-			state = E_O_S;
+		if (npacket_in == 3) {
+			/* the first audio packet must begin on a fresh page */
+			if (os_in.lacing_returned != os_in.lacing_fill) {
+				warnx("%s: the Vorbis setup header does not end "
+				    "its page", data->path);
+				goto cleanup_label;
+			}
+			/* os_out.pageno is the count of pages written */
+			pageshift = os_out.pageno - (ogg_page_pageno(&og_in) + 1);
+			if (ogg_page_eos(&og_in))
+				in_link = 0;
+			state = COPYING_PAGES;
+			if (pageshift == 0) {
+				/* all the following pages are unchanged */
+				tail = in_off;
+				break;
+			}
+			t_rewrite_reserve(&rw, rw.size - vc_bytes + vc_packet.bytes);
 		}
 	}
-
-	/* forces remaining packets into a last page */
-	os_out.e_o_s = 1;
-	while (ogg_stream_flush(&os_out, &og_out))
-		(void)sbuf_write_ogg_page(sb, &og_out);
+	if (state != COPYING_PAGES)
+		goto cleanup_label;
 	/* ogg_page and ogg_packet structs always point to storage in libvorbis.
 	   They're never freed or manipulated directly */
 
-	/* check if we need to read another stream */
-	if (!feof(fp_in)) {
-		ogg_stream_clear(&os_in);
-		ogg_stream_clear(&os_out);
-		vorbis_comment_clear(&vc_in);
-		vorbis_info_clear(&vi_in);
-		goto bos_label;
-	} else {
-		(void)fclose(fp_in);
-		fp_in = NULL;
-	}
-
 	state = WRITE_FINISH;
 	if (sbuf_finish(sb) == -1)
 		goto cleanup_label;
-	if (fclose(fp_out) != 0)
+	if (tail != -1 && t_rewrite_copy(&rw, tail) == -1)
 		goto cleanup_label;
-	fp_out = NULL;
 
 	state = RENAMING;
-	if (rename(tempfile, data->path) == -1)
+	if (t_rewrite_commit(&rw) == -1)
 		goto cleanup_label;
+	data->vc_padding = (long)padding;
+	t_backend_count_write(0);
 
 	state = DONE_SUCCESS;
 cleanup_label:
-	if (state >= STREAMS_INITIALIZED) {
+	if (state >= READING_HEADERS && nstream > 0) {
 		ogg_stream_clear(&os_in);
 		ogg_stream_clear(&os_out);
 	}
-	if (state >= START_READING) {
-		vorbis_comment_clear(&vc_in);
-		vorbis_info_clear(&vi_in);
-	}
 	ogg_sync_clear(&oy_in);
-	if (fp_out != NULL)
-		(void)fclose(fp_out);
-	if (tempfile != NULL && eaccess(tempfile, R_OK) != -1)
-		(void)unlink(tempfile);
-	free(tempfile);
+	if (state >= SETUP)
+		t_rewrite_abort(&rw);
 	if (sb != NULL)
 		sbuf_delete(sb);
-	if (fp_in != NULL)
-		(void)fclose(fp_in);
+	free(obuf);
+	free(padded);
 	ogg_packet_clear(&my_vc_packet);
 	vorbis_comment_clear(&vc_out);
 
@@ -403,6 +561,137 @@ cleanup_label:
 }
 
 
+/*
+ * try to update the comment packet in place.
+ *
+ * vc_packet is padded to the exact length of the comment packet in the file,
+ * so that the pages layout (lacing values) stay the same: only the comment
+ * bytes and the CRC of the pages holding them have to be written.
+ *
+ * @return
+ *   0 on success, 1 if vc_packet does not fit and the file has to be
+ *   rewritten, -1 on error. vc_bytes is set to the length of the comment
+ *   packet in the file unless -1 is returned.
+ */
+static int
+t_ftoggvorbis_write_inplace(struct t_ftoggvorbis_data *data,
+    const ogg_packet *vc_packet, long *vc_bytes)
+{
+	ogg_sync_state    oy;
+	ogg_page          og;
+	struct t_oggpage *pages = NULL, *pg;
+	const unsigned char *src;
+	size_t npage = 0, i;
+	off_t offset = 0, pageoff;
+	long n, len, left, vc_len = 0;
+	int fd, serialno = 0, nstreampage = 0, done = 0, ret = -1;
+
+	assert(data != NULL);
+	assert(vc_packet != NULL);
+	assert(vc_bytes != NULL);
+
+	(void)ogg_sync_init(&oy); /* always return 0 */
+	if ((fd = open(data->path, O_RDWR)) == -1)
+		goto cleanup;
+
+	/* collect the pages holding the comment packet */
+	while (!done) {
+		n = ogg_sync_pageseek(&oy, &og);
+		if (n < 0) {
+			/* bytes were skipped */
+			offset += -n;
+			continue;
+		} else if (n == 0) {
+			/* more data needed */
+			char *buf;
+			ssize_t r;
+			if ((buf = ogg_sync_buffer(&oy, BUFSIZ)) == NULL)
+				goto cleanup;
+			if ((r = read(fd, buf, BUFSIZ)) <= 0)
+				goto cleanup;
+			/* casting r is fine: it is at most BUFSIZ */
+			if (ogg_sync_wrote(&oy, (long)r) == -1)
+				goto cleanup;
+			continue;
+		}
+		/* here a page was sync'ed. */
+		pageoff = offset;
+		offset += n;
+		if (nstreampage == 0)
+			serialno = ogg_page_serialno(&og);
+		else if (ogg_page_serialno(&og) != serialno)
+			continue; /* a page from another multiplexed stream */
+		/* the first page only holds the identification header, the
+		   comment packet start on the second page. */
+		if (++nstreampage == 1)
+			continue;
+		if (nstreampage == 2 && ogg_page_continued(&og))
+			goto cleanup;
+
+		pg = realloc(pages, (npage + 1) * sizeof(struct t_oggpage));
+		if (pg == NULL)
+			goto cleanup;
+		pages = pg;
+		pg = &pages[npage];
+		pg->data = malloc((size_t)(og.header_len + og.body_len));
+		if (pg->data == NULL)
+			goto cleanup;
+		npage++;
+		(void)memcpy(pg->data, og.header, (size_t)og.header_len);
+		(void)memcpy(pg->data + og.header_len, og.body, (size_t)og.body_len);
+		pg->offset         = pageoff;
+		pg->og.header      = pg->data;
+		pg->og.header_len  = og.header_len;
+		pg->og.body        = pg->data + og.header_len;
+		pg->og.body_len    = og.body_len;
+		/* walk the lacing values up to the end of the comment packet */
+		pg->vc_len = 0;
+		for (i = 0; i < og.header[26] && !done; i++) {
+			unsigned char lacing = og.header[27 + i];
+			pg->vc_len += lacing;
+			/* a lacing value lesser than 255 ends the packet */
+			done = (lacing < 255);
+		}
+		vc_len += pg->vc_len;
+	}
+	*vc_bytes = vc_len;
+	if (vc_packet->bytes > vc_len) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	/* patch the pages with the new comment packet followed by zeros */
+	src  = vc_packet->packet;
+	left = vc_packet->bytes;
+	for (i = 0; i < npage; i++) {
+		pg  = &pages[i];
+		len = (left < pg->vc_len ? left : pg->vc_len);
+		(void)memcpy(pg->og.body, src, (size_t)len);
+		bzero(pg->og.body + len, (size_t)(pg->vc_len - len));
+		src  += len;
+		left -= len;
+		t_ogg_page_checksum_set(&pg->og);
+	}
+	for (i = 0; i < npage; i++) {
+		pg  = &pages[i];
+		len = pg->og.header_len + pg->og.body_len;
+		if (pwrite(fd, pg->data, (size_t)len, pg->offset) != len)
+			goto cleanup;
+	}
+
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	for (i = 0; i < npage; i++)
+		free(pages[i].data);
+	free(pages);
+	ogg_sync_clear(&oy);
+	if (fd != -1)
+		(void)close(fd);
+	return (ret);
+}
+
+
 static void
 t_ftoggvorbis_clear(void *opaque)
 {
@@ -412,19 +701,70 @@ t_ftoggvorbis_clear(void *opaque)
 	data = opaque;
 	assert(data->libid == libid);
 
-	ov_clear(&data->vf);
+	vorbis_comment_clear(&data->vc);
 	free(data);
 }
 
 
+/*
+ * compute the extra padding to add to a comment packet of vc_len bytes so
+ * that the header pages, starting at offset out, end at the same offset than
+ * the original header pages (in) modulo the block size. Adding padding must
+ * not change the count of header pages.
+ */
+static long
+t_ogg_align_padding(const struct t_rewrite *rw, off_t in, off_t out,
+    long vc_len, long setup_len)
+{
+	off_t size;
+	long extra, npages, npages0;
+
+	assert(rw != NULL);
+
+	(void)t_ogg_headers_size(vc_len, setup_len, &npages0);
+	/* each padding byte grow the pages by one or two bytes (lacing), so
+	   every offset is reached within two blocks. */
+	for (extra = 0; extra < 2 * rw->blksize; extra++) {
+		size = t_ogg_headers_size(vc_len + extra, setup_len, &npages);
+		if (npages != npages0)
+			break;
+		if (t_rewrite_align(rw, in, out + size) == 0)
+			return (extra);
+	}
+	return (0);
+}
+
+
+/*
+ * compute the size of the pages holding the comment and setup packets, as
+ * paginated by ogg_stream_flush() (at most 255 lacing values per page).
+ */
+static off_t
+t_ogg_headers_size(long vc_len, long setup_len, long *npages)
+{
+	long nsegs;
+
+	assert(npages != NULL);
+
+	nsegs = (vc_len / 255 + 1) + (setup_len / 255 + 1);
+	*npages = (nsegs + 254) / 255;
+	return ((off_t)vc_len + setup_len + nsegs + 27 * *npages);
+}
+
+
 static int
-fwrite_drain_func(void *fp, const char *data, int len)
+write_drain_func(void *fdp, const char *data, int len)
 {
-	if (fp == NULL || len < 0)
+	ssize_t s;
+
+	if (fdp == NULL || len < 0)
 		return (-1);
-	/* casting fwrite return value to int is fine: it is at most len */
-	int s = (int)fwrite(data, 1, (size_t)len, fp);
-	return (s == 0 ? -1 : s);
+	do {
+		s = write(*(int *)fdp, data, (size_t)len);
+	} while (s == -1 && errno == EINTR);
+	/* casting s to int is fine: it is at most len. A short write is
+	   handled by sbuf_drain() */
+	return (s <= 0 ? -1 : (int)s);
 }
 
 
@@ -442,3 +782,105 @@ sbuf_write_ogg_page(struct sbuf *sb, ogg_page *og)
 		return (-1);
 	return (0);
 }
+
+
+/*
+ * set the page sequence number of og and update its checksum.
+ */
+static int
+ogg_page_set_pageno(ogg_page *og, long pageno)
+{
+	assert(og != NULL);
+
+	if (pageno < 0 || pageno > 0xffffffffL || og->header_len < 27)
+		return (-1);
+	/* the page sequence number is stored in little endian at offset 18 */
+	og->header[18] = (unsigned char)(pageno & 0xff);
+	og->header[19] = (unsigned char)((pageno >> 8) & 0xff);
+	og->header[20] = (unsigned char)((pageno >> 16) & 0xff);
+	og->header[21] = (unsigned char)((pageno >> 24) & 0xff);
+	t_ogg_page_checksum_set(og);
+	return (0);
+}
+
+
+/*
+ * Ogg CRC32 (polynomial 0x04c11db7, no reflection, zero as initial value and
+ * no final xor). The checksum is computed eight bytes at a time using eight
+ * lookup tables ("slicing-by-8"), which is much faster than the usual byte
+ * by byte loop.
+ */
+static uint32_t	t_ogg_crc_table[8][256];
+
+static void
+t_ogg_crc_init(void)
+{
+	static int initialized = 0;
+	uint32_t crc;
+	int i, j;
+
+	if (initialized)
+		return;
+
+	for (i = 0; i < 256; i++) {
+		crc = (uint32_t)i << 24;
+		for (j = 0; j < 8; j++)
+			crc = (crc << 1) ^ ((crc & 0x80000000U) ? 0x04c11db7U : 0);
+		t_ogg_crc_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			crc = t_ogg_crc_table[j - 1][i];
+			t_ogg_crc_table[j][i] = (crc << 8) ^ t_ogg_crc_table[0][crc >> 24];
+		}
+	}
+
+	initialized = 1;
+}
+
+
+static uint32_t
+t_ogg_crc_update(uint32_t crc, const unsigned char *p, size_t len)
+{
+	const uint32_t (*t)[256] = t_ogg_crc_table;
+
+	while (len >= 8) {
+		crc ^= (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		    (uint32_t)p[2] << 8 | (uint32_t)p[3];
+		crc = t[7][crc >> 24] ^ t[6][(crc >> 16) & 0xff] ^
+		    t[5][(crc >> 8) & 0xff] ^ t[4][crc & 0xff] ^
+		    t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+		p   += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = (crc << 8) ^ t[0][(crc >> 24) ^ *p++];
+
+	return (crc);
+}
+
+
+/*
+ * compute and set the checksum of og, see ogg_page_checksum_set(3).
+ */
+static void
+t_ogg_page_checksum_set(ogg_page *og)
+{
+	uint32_t crc;
+
+	assert(og != NULL);
+	assert(og->header_len >= 27);
+	assert(og->body_len >= 0);
+
+	t_ogg_crc_init();
+
+	/* the checksum is computed with its own field set to zero */
+	bzero(og->header + 22, 4);
+	crc = t_ogg_crc_update(0, og->header, (size_t)og->header_len);
+	crc = t_ogg_crc_update(crc, og->body, (size_t)og->body_len);
+	/* stored in little endian */
+	og->header[22] = (unsigned char)(crc & 0xff);
+	og->header[23] = (unsigned char)((crc >> 8) & 0xff);
+	og->header[24] = (unsigned char)((crc >> 16) & 0xff);
+	og->header[25] = (unsigned char)((crc >> 24) & 0xff);
+}
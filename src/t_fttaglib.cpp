@@ -0,0 +1,201 @@
+/*
+ * t_fttaglib.cpp
+ *
+ * a taglib tagutil backend, using TagLib.
+ *
+ * TagLib's C API only exposes seven fields and read the audio properties of
+ * each file (which can mean scanning the MPEG frames or the MP4 sample
+ * tables). This backend use the C++ API instead: the file is opened without
+ * audio properties and all the tags are read (and written) at once through a
+ * PropertyMap.
+ */
+/* TagLib headers */
+#include <fileref.h>
+#include <tfile.h>
+#include <tpropertymap.h>
+#include <tstring.h>
+#include <tstringlist.h>
+
+extern "C" {
+#include "t_config.h"
+#include "t_backend.h"
+}
+
+
+static const char libid[] = "TagLib";
+
+/*
+ * tag keys to TagLib property mapping. Other keys are used as property name.
+ * The keys are the ones of the TagLib C API (used by previous versions of
+ * this backend).
+ */
+static const struct t_fttaglib_key {
+	const char	*key;
+	const char	*property;
+} t_fttaglib_keys[] = {
+	{ "year",	"DATE"		},
+	{ "track",	"TRACKNUMBER"	},
+};
+
+struct t_fttaglib_data {
+	const char	*libid;
+	TagLib::FileRef	*file;
+};
+
+extern "C" struct t_backend	*t_fttaglib_backend(void);
+
+static void 		*t_fttaglib_init(const char *path);
+static struct t_taglist	*t_fttaglib_read(void *opaque);
+static int		 t_fttaglib_write(void *opaque, const struct t_taglist *tlist);
+static void		 t_fttaglib_clear(void *opaque);
+
+
+struct t_backend *
+t_fttaglib_backend(void)
+{
+	static struct t_backend b;
+
+	/* no designated initializers in C++ */
+	b.libid = libid;
+	b.desc  = "various file formats, using TagLib properties";
+	b.init  = t_fttaglib_init;
+	b.read  = t_fttaglib_read;
+	b.write = t_fttaglib_write;
+	b.clear = t_fttaglib_clear;
+
+	return (&b);
+}
+
+/*
+ * NOTE: no C++ exception should ever reach the C code, so every backend
+ * member function catch them all.
+ */
+
+static void *
+t_fttaglib_init(const char *path)
+{
+	struct t_fttaglib_data *data;
+
+	assert(path != NULL);
+
+	data = static_cast<struct t_fttaglib_data *>(calloc(1, sizeof(struct t_fttaglib_data)));
+	if (data == NULL)
+		return (NULL);
+	data->libid = libid;
+
+	try {
+		/* we never use the audio properties, don't read them */
+		data->file = new TagLib::FileRef(path, false,
+		    TagLib::AudioProperties::Fast);
+		if (data->file->isNull())
+			goto error_label;
+	} catch (...) {
+		goto error_label;
+	}
+
+	return (data);
+error_label:
+	delete data->file;
+	free(data);
+	return (NULL);
+}
+
+static struct t_taglist *
+t_fttaglib_read(void *opaque)
+{
+	struct t_fttaglib_data *data;
+	struct t_taglist *tlist = NULL;
+	const char *key;
+	size_t i;
+
+	assert(opaque != NULL);
+	data = static_cast<struct t_fttaglib_data *>(opaque);
+	assert(data->libid == libid);
+
+	if ((tlist = t_taglist_new()) == NULL)
+		return (NULL);
+
+	try {
+		const TagLib::PropertyMap props = data->file->file()->properties();
+		TagLib::PropertyMap::ConstIterator p;
+		TagLib::StringList::ConstIterator v;
+
+		for (p = props.begin(); p != props.end(); ++p) {
+			const TagLib::String property = p->first;
+			key = property.toCString(true);
+			for (i = 0; i < NELEM(t_fttaglib_keys); i++) {
+				if (t_tag_keycmp(t_fttaglib_keys[i].property, key) == 0) {
+					key = t_fttaglib_keys[i].key;
+					break;
+				}
+			}
+			for (v = p->second.begin(); v != p->second.end(); ++v) {
+				if (t_taglist_insert(tlist, key, v->toCString(true)) == -1)
+					goto error_label;
+			}
+		}
+	} catch (...) {
+		goto error_label;
+	}
+
+	return (tlist);
+error_label:
+	t_taglist_delete(tlist);
+	return (NULL);
+}
+
+static int
+t_fttaglib_write(void *opaque, const struct t_taglist *tlist)
+{
+	struct t_fttaglib_data *data;
+	struct t_tag *t;
+	const char *property;
+	size_t i;
+
+	assert(opaque != NULL);
+	data = static_cast<struct t_fttaglib_data *>(opaque);
+	assert(data->libid == libid);
+
+	try {
+		TagLib::PropertyMap props, rejected;
+		TagLib::PropertyMap::ConstIterator p;
+
+		TAILQ_FOREACH(t, tlist->tags, entries) {
+			property = t->key;
+			for (i = 0; i < NELEM(t_fttaglib_keys); i++) {
+				if (t_tag_keycmp(t_fttaglib_keys[i].key, t->key) == 0) {
+					property = t_fttaglib_keys[i].property;
+					break;
+				}
+			}
+			props[TagLib::String(property, TagLib::String::UTF8)].append(
+			    TagLib::String(t->val, TagLib::String::UTF8));
+		}
+
+		/* the properties not in props are removed */
+		rejected = data->file->file()->setProperties(props);
+		for (p = rejected.begin(); p != rejected.end(); ++p) {
+			warnx("unsupported tag for TagLib backend: %s",
+			    p->first.toCString(true));
+		}
+		if (!data->file->save())
+			return (-1);
+	} catch (...) {
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+t_fttaglib_clear(void *opaque)
+{
+	struct t_fttaglib_data *data;
+
+	assert(opaque != NULL);
+	data = static_cast<struct t_fttaglib_data *>(opaque);
+	assert(data->libid == libid);
+
+	delete data->file;
+	free(data);
+}
@@ -0,0 +1,924 @@
+/*
+ * t_index.c
+ *
+ * inverted index of the tags of a directory tree.
+ *
+ * The index file is a header followed by:
+ *  - the files table, sorted by path. The position of a file in this table is
+ *    its id,
+ *  - the values table, grouped by key and sorted in each group,
+ *  - the keys table, sorted by key,
+ *  - the postings area: for each value, the ids of the files having it, as a
+ *    sorted sequence of LEB128 encoded deltas,
+ *  - the strings area, the NUL terminated keys, values and paths.
+ * Integers are stored in native byte order.
+ *
+ * Queries are evaluated on bitmaps of file ids, so that each posting list is
+ * decoded at most once by comparison.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "t_config.h"
+#include "t_toolkit.h"
+#include "t_tag.h"
+#include "t_taglist.h"
+#include "t_tune.h"
+#include "t_filter.h"
+#include "t_index.h"
+
+
+#define	T_INDEX_MAGIC	"tagindx"
+#define	T_INDEX_VERSION	1
+
+/* t_index_file flags */
+#define	T_INDEX_UNSUPPORTED	0x1 /* no backend could read the file */
+
+struct t_index_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	nfiles;
+	uint32_t	nvalues;
+	uint32_t	nkeys;
+	uint64_t	postings;	/* offset of the postings area */
+	uint64_t	strings;	/* offset of the strings area */
+};
+
+struct t_index_file {
+	uint64_t	ino;
+	int64_t		size;
+	int64_t		mtime_sec;
+	int64_t		mtime_nsec;
+	uint32_t	path;	/* offset in the strings area */
+	uint32_t	flags;
+};
+
+struct t_index_value {
+	uint64_t	postings;	/* offset in the postings area */
+	uint32_t	val;		/* offset in the strings area */
+	uint32_t	count;		/* number of files */
+};
+
+struct t_index_key {
+	uint32_t	name;		/* offset in the strings area */
+	uint32_t	first;		/* position of its first value */
+	uint32_t	nvalues;
+};
+
+/* an index file, mmap(2)'ed */
+struct t_index {
+	char				*map;
+	size_t				 mapsize;
+	const struct t_index_header	*h;
+	const struct t_index_file	*files;
+	const struct t_index_value	*values;
+	const struct t_index_key	*keys;
+	const unsigned char		*postings;
+	size_t				 postingssize;
+	const char			*strings;
+	size_t				 stringssize;
+};
+
+/* a file found by t_index_build() */
+struct t_index_entry {
+	char			*path;	/* relative to the indexed directory */
+	struct stat		 sb;
+	uint32_t		 flags;
+	struct t_taglist	*tlist;	/* NULL when taken from the old index */
+};
+
+/* a (key, value, file id) triple, built by t_index_build() */
+struct t_index_posting {
+	const char	*key;
+	const char	*val;
+	uint32_t	 id;
+};
+
+/* growable array of postings */
+struct t_index_postings {
+	struct t_index_posting	*p;
+	size_t			 count;
+	size_t			 capacity;
+};
+
+
+static int	t_index_open(struct t_index *idx, const char *path);
+static void	t_index_close(struct t_index *idx);
+static const char	*t_index_string(const struct t_index *idx, uint32_t off);
+static int	t_index_next(const struct t_index *idx,
+		    const unsigned char **pp, uint64_t *id);
+static int	t_index_decode(const struct t_index *idx,
+		    const struct t_index_value *v, uint64_t *bitmap);
+static uint64_t	*t_index_eval(const struct t_index *idx,
+		    const struct t_filter *f);
+
+static int	t_index_walk(const char *root, struct t_index_entry **entries_p,
+		    size_t *count_p);
+static int	t_index_add(struct t_index_postings *ps, const char *key,
+		    const char *val, uint32_t id);
+static int	t_index_write(const char *path, const struct t_index_entry *entries,
+		    size_t count, struct t_index_postings *ps);
+static uint32_t	t_index_strcat(struct sbuf *sb, const char *s);
+
+static int	t_index_entry_cmp(const void *a, const void *b);
+static int	t_index_posting_cmp(const void *a, const void *b);
+
+
+int
+t_index_command(int argc, char *argv[])
+{
+
+	assert(argv != NULL);
+
+	if (argc == 2 && strcmp(argv[0], "build") == 0)
+		return (t_index_build(argv[1]));
+	if ((argc == 2 || argc == 3) && strcmp(argv[0], "query") == 0)
+		return (t_index_query(argc == 3 ? argv[2] : ".", argv[1]));
+
+	warnx("usage: %s index build DIR | index query EXPR [DIR]",
+	    getprogname());
+	errno = EINVAL;
+	return (-1);
+}
+
+
+int
+t_index_build(const char *dir)
+{
+	struct t_index old;
+	struct t_index_entry *entries = NULL, *e;
+	struct t_index_postings ps;
+	struct t_taglist *tlist;
+	struct t_tune *tune;
+	const struct t_index_file *f;
+	const struct t_index_key *k;
+	const struct t_index_value *v;
+	const struct t_tag *t;
+	uint32_t *renum = NULL;
+	char *path = NULL, *fpath;
+	size_t count = 0, i, j;
+	int ret = -1;
+
+	assert(dir != NULL);
+
+	bzero(&old, sizeof(old));
+	bzero(&ps, sizeof(ps));
+
+	if (asprintf(&path, "%s/%s", dir, T_INDEX_FILE) < 0) {
+		path = NULL;
+		goto cleanup;
+	}
+	if (t_index_open(&old, path) == -1) {
+		if (errno != ENOENT)
+			warn("%s: ignoring the previous index", path);
+		t_index_close(&old);
+	}
+
+	if (t_index_walk(dir, &entries, &count) == -1)
+		goto cleanup;
+	if (count > UINT32_MAX) {
+		errno = EFBIG;
+		warn("%s", dir);
+		goto cleanup;
+	}
+
+	/* map the previous index file ids to the new ones */
+	if (old.map != NULL) {
+		renum = malloc((old.h->nfiles + 1) * sizeof(uint32_t));
+		if (renum == NULL)
+			goto cleanup;
+		for (i = 0; i < old.h->nfiles; i++)
+			renum[i] = UINT32_MAX;
+	}
+
+	for (i = 0; i < count; i++) {
+		e = &entries[i];
+		if (old.map != NULL) {
+			/* both are sorted by path */
+			size_t lo = 0, hi = old.h->nfiles, mid = 0;
+			int cmp = 1;
+			f = NULL;
+			while (lo < hi) {
+				mid = lo + (hi - lo) / 2;
+				f   = &old.files[mid];
+				cmp = strcmp(e->path, t_index_string(&old, f->path));
+				if (cmp == 0)
+					break;
+				else if (cmp < 0)
+					hi = mid;
+				else
+					lo = mid + 1;
+			}
+			if (cmp == 0 &&
+			    f->ino        == (uint64_t)e->sb.st_ino &&
+			    f->size       == (int64_t)e->sb.st_size &&
+			    f->mtime_sec  == (int64_t)e->sb.st_mtim.tv_sec &&
+			    f->mtime_nsec == (int64_t)e->sb.st_mtim.tv_nsec) {
+				/* unchanged */
+				renum[mid] = (uint32_t)i;
+				e->flags   = f->flags;
+				continue;
+			}
+		}
+
+		if (asprintf(&fpath, "%s/%s", dir, e->path) < 0)
+			goto cleanup;
+		tune = t_tune_new(fpath);
+		if (tune == NULL) {
+			if (errno == ENOMEM) {
+				free(fpath);
+				goto cleanup;
+			}
+			e->flags = T_INDEX_UNSUPPORTED;
+		} else {
+			e->tlist = t_tune_tags(tune);
+			if (e->tlist == NULL) {
+				warnx("%s: could not read the tags", fpath);
+				e->flags = T_INDEX_UNSUPPORTED;
+			}
+			t_tune_delete(tune);
+		}
+		free(fpath);
+	}
+
+	/* collect the postings, from the files read ... */
+	for (i = 0; i < count; i++) {
+		if ((tlist = entries[i].tlist) == NULL)
+			continue;
+		TAILQ_FOREACH(t, tlist->tags, entries) {
+			if (t_index_add(&ps, t->key, t->val, (uint32_t)i) == -1)
+				goto cleanup;
+		}
+	}
+	/* ... and from the previous index for the unchanged ones */
+	for (i = 0; old.map != NULL && i < old.h->nkeys; i++) {
+		k = &old.keys[i];
+		if (k->first > old.h->nvalues ||
+		    k->nvalues > old.h->nvalues - k->first)
+			continue;
+		for (j = k->first; j < k->first + k->nvalues; j++) {
+			const unsigned char *p;
+			uint64_t id = 0;
+			uint32_t n;
+			v = &old.values[j];
+			if (v->postings > old.postingssize)
+				continue;
+			p = old.postings + v->postings;
+			for (n = 0; n < v->count; n++) {
+				if (t_index_next(&old, &p, &id) == -1)
+					break;
+				if (renum[id] == UINT32_MAX)
+					continue;
+				if (t_index_add(&ps, t_index_string(&old, k->name),
+				    t_index_string(&old, v->val), renum[id]) == -1)
+					goto cleanup;
+			}
+		}
+	}
+
+	ret = t_index_write(path, entries, count, &ps);
+	/* FALLTHROUGH */
+cleanup:
+	if (ret == -1 && errno == ENOMEM)
+		warn("malloc");
+	for (i = 0; i < count; i++) {
+		free(entries[i].path);
+		t_taglist_delete(entries[i].tlist);
+	}
+	free(entries);
+	free(ps.p);
+	free(renum);
+	free(path);
+	t_index_close(&old);
+	return (ret);
+}
+
+
+int
+t_index_query(const char *dir, const char *expr)
+{
+	struct t_index idx;
+	struct t_filter *f = NULL;
+	uint64_t *bitmap = NULL;
+	char *path = NULL;
+	const char *sep;
+	uint32_t id;
+	int ret = -1;
+
+	assert(dir != NULL);
+	assert(expr != NULL);
+
+	bzero(&idx, sizeof(idx));
+
+	/* t_filter_parse() warn about what is wrong */
+	if ((f = t_filter_parse(expr)) == NULL)
+		goto cleanup;
+	if (asprintf(&path, "%s/%s", dir, T_INDEX_FILE) < 0) {
+		path = NULL;
+		goto cleanup;
+	}
+	if (t_index_open(&idx, path) == -1) {
+		warn("%s", path);
+		goto cleanup;
+	}
+	if ((bitmap = t_index_eval(&idx, f)) == NULL)
+		goto cleanup;
+
+	sep = (dir[0] != '\0' && dir[strlen(dir) - 1] == '/' ? "" : "/");
+	for (id = 0; id < idx.h->nfiles; id++) {
+		if (!(bitmap[id / 64] & (UINT64_C(1) << (id % 64))))
+			continue;
+		if (idx.files[id].flags & T_INDEX_UNSUPPORTED)
+			continue;
+		(void)printf("%s%s%s\n", dir, sep, t_index_string(&idx, idx.files[id].path));
+	}
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	free(bitmap);
+	free(path);
+	t_filter_delete(f);
+	t_index_close(&idx);
+	return (ret);
+}
+
+
+/*
+ * map and check the index file at path.
+ *
+ * @return
+ *   -1 on error (errno is set to EINVAL if the file is not a valid index), 0 on
+ *   success.
+ */
+static int
+t_index_open(struct t_index *idx, const char *path)
+{
+	const struct t_index_header *h;
+	struct stat st;
+	uint64_t tables;
+	int fd;
+
+	assert(idx != NULL);
+	assert(path != NULL);
+
+	bzero(idx, sizeof(struct t_index));
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (-1);
+	if (fstat(fd, &st) == -1) {
+		(void)close(fd);
+		return (-1);
+	}
+	if ((size_t)st.st_size < sizeof(struct t_index_header)) {
+		(void)close(fd);
+		errno = EINVAL;
+		return (-1);
+	}
+	idx->mapsize = (size_t)st.st_size;
+	idx->map = mmap(NULL, idx->mapsize, PROT_READ, MAP_SHARED, fd, 0);
+	(void)close(fd);
+	if (idx->map == MAP_FAILED) {
+		idx->map = NULL;
+		return (-1);
+	}
+
+	h = (const struct t_index_header *)(void *)idx->map;
+	tables = sizeof(struct t_index_header) +
+	    (uint64_t)h->nfiles  * sizeof(struct t_index_file) +
+	    (uint64_t)h->nvalues * sizeof(struct t_index_value) +
+	    (uint64_t)h->nkeys   * sizeof(struct t_index_key);
+	if (memcmp(h->magic, T_INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != T_INDEX_VERSION || tables > h->postings ||
+	    h->postings > h->strings || h->strings > idx->mapsize ||
+	    (h->strings < idx->mapsize && idx->map[idx->mapsize - 1] != '\0')) {
+		(void)munmap(idx->map, idx->mapsize);
+		idx->map = NULL;
+		errno = EINVAL;
+		return (-1);
+	}
+
+	idx->h       = h;
+	idx->files   = (const struct t_index_file *)(const void *)(h + 1);
+	idx->values  = (const struct t_index_value *)(const void *)
+	    (idx->files + h->nfiles);
+	idx->keys    = (const struct t_index_key *)(const void *)
+	    (idx->values + h->nvalues);
+	idx->postings     = (const unsigned char *)idx->map + h->postings;
+	idx->postingssize = (size_t)(h->strings - h->postings);
+	idx->strings      = idx->map + h->strings;
+	idx->stringssize  = idx->mapsize - (size_t)h->strings;
+	return (0);
+}
+
+
+static void
+t_index_close(struct t_index *idx)
+{
+
+	assert(idx != NULL);
+
+	if (idx->map != NULL)
+		(void)munmap(idx->map, idx->mapsize);
+	bzero(idx, sizeof(struct t_index));
+}
+
+
+/*
+ * @return
+ *   the string at the given offset, or the empty string if it is out of the
+ *   strings area.
+ */
+static const char *
+t_index_string(const struct t_index *idx, uint32_t off)
+{
+
+	assert(idx != NULL);
+
+	return (off < idx->stringssize ? idx->strings + off : "");
+}
+
+
+/*
+ * decode the next file id of a posting list.
+ *
+ * @param pp
+ *   The position in the postings area, updated past the decoded id.
+ *
+ * @param id
+ *   The previous file id (0 for the first one), updated to the decoded one.
+ *
+ * @return
+ *   -1 if the posting list is corrupted, 0 otherwise.
+ */
+static int
+t_index_next(const struct t_index *idx, const unsigned char **pp, uint64_t *id)
+{
+	const unsigned char *p, *end;
+	uint64_t delta = 0;
+	unsigned shift = 0;
+
+	assert(idx != NULL);
+	assert(pp != NULL);
+	assert(id != NULL);
+
+	p   = *pp;
+	end = idx->postings + idx->postingssize;
+	do {
+		if (p == end || shift > 63)
+			return (-1);
+		delta |= (uint64_t)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	if (delta >= idx->h->nfiles - *id)
+		return (-1);
+
+	*pp  = p;
+	*id += delta;
+	return (0);
+}
+
+
+/*
+ * set the bit of each file id in the posting list of v.
+ *
+ * @return
+ *   -1 if the posting list is corrupted, 0 otherwise.
+ */
+static int
+t_index_decode(const struct t_index *idx, const struct t_index_value *v,
+    uint64_t *bitmap)
+{
+	const unsigned char *p;
+	uint64_t id = 0;
+	uint32_t n;
+
+	assert(idx != NULL);
+	assert(v != NULL);
+	assert(bitmap != NULL);
+
+	if (v->postings > idx->postingssize)
+		return (-1);
+	p = idx->postings + v->postings;
+	for (n = 0; n < v->count; n++) {
+		if (t_index_next(idx, &p, &id) == -1)
+			return (-1);
+		bitmap[id / 64] |= UINT64_C(1) << (id % 64);
+	}
+
+	return (0);
+}
+
+
+/*
+ * evaluate a filter on the index.
+ *
+ * @return
+ *   a bitmap of the matching file ids to be passed to free(3) after use, NULL
+ *   on error.
+ */
+static uint64_t *
+t_index_eval(const struct t_index *idx, const struct t_filter *f)
+{
+	const struct t_index_key *k = NULL;
+	const struct t_index_value *v;
+	uint64_t *bitmap, *rhs;
+	size_t i, nwords, lo, hi, mid;
+	int cmp;
+
+	assert(idx != NULL);
+	assert(f != NULL);
+
+	nwords = (idx->h->nfiles + 63) / 64;
+
+	switch (f->op) {
+	case T_FILTER_OR: /* FALLTHROUGH */
+	case T_FILTER_AND:
+		if ((bitmap = t_index_eval(idx, f->lhs)) == NULL)
+			return (NULL);
+		if ((rhs = t_index_eval(idx, f->rhs)) == NULL) {
+			free(bitmap);
+			return (NULL);
+		}
+		for (i = 0; i < nwords; i++) {
+			if (f->op == T_FILTER_OR)
+				bitmap[i] |= rhs[i];
+			else
+				bitmap[i] &= rhs[i];
+		}
+		free(rhs);
+		return (bitmap);
+	case T_FILTER_NOT:
+		if ((bitmap = t_index_eval(idx, f->lhs)) == NULL)
+			return (NULL);
+		for (i = 0; i < nwords; i++)
+			bitmap[i] = ~bitmap[i];
+		/* the bits after the last file id are never checked */
+		return (bitmap);
+	default:
+		/* a comparison, see below */
+		break;
+	}
+
+	/* at least one word, so that calloc(3) never return NULL on success */
+	if ((bitmap = calloc(nwords + 1, sizeof(uint64_t))) == NULL)
+		return (NULL);
+
+	/* find the key */
+	lo = 0;
+	hi = idx->h->nkeys;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = t_tag_keycmp(f->key, t_index_string(idx, idx->keys[mid].name));
+		if (cmp == 0) {
+			k = &idx->keys[mid];
+			break;
+		} else if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	if (k != NULL && k->first <= idx->h->nvalues &&
+	    k->nvalues <= idx->h->nvalues - k->first) {
+		for (i = k->first; i < k->first + k->nvalues; i++) {
+			v = &idx->values[i];
+			if (t_filter_value_match(f, t_index_string(idx, v->val)))
+				(void)t_index_decode(idx, v, bitmap);
+		}
+	}
+
+	/* a != comparison is true for the files without any equal value */
+	if (f->op == T_FILTER_NE) {
+		for (i = 0; i < nwords; i++)
+			bitmap[i] = ~bitmap[i];
+	}
+
+	return (bitmap);
+}
+
+
+/*
+ * find the files under root. The returned entries are sorted by path.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+static int
+t_index_walk(const char *root, struct t_index_entry **entries_p,
+    size_t *count_p)
+{
+	struct t_index_entry *entries = NULL, *e;
+	size_t count = 0, capacity = 0, rootlen;
+	char *paths[] = { NULL, NULL };
+	FTS *fts;
+	FTSENT *ent;
+	int ret = -1;
+
+	assert(root != NULL);
+	assert(entries_p != NULL);
+	assert(count_p != NULL);
+
+	if ((paths[0] = strdup(root)) == NULL)
+		return (-1);
+	fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+	if (fts == NULL) {
+		warn("%s", root);
+		free(paths[0]);
+		return (-1);
+	}
+	rootlen = strlen(root);
+
+	for (;;) {
+		errno = 0;
+		if ((ent = fts_read(fts)) == NULL)
+			break;
+		/* skip the hidden files and directories, like the index */
+		if (ent->fts_level > 0 && ent->fts_name[0] == '.') {
+			if (ent->fts_info == FTS_D)
+				(void)fts_set(fts, ent, FTS_SKIP);
+			continue;
+		}
+		switch (ent->fts_info) {
+		case FTS_F:
+			break;
+		case FTS_DNR: /* FALLTHROUGH */
+		case FTS_ERR: /* FALLTHROUGH */
+		case FTS_NS:
+			warnx("%s: %s", ent->fts_path, strerror(ent->fts_errno));
+			continue;
+		default:
+			continue;
+		}
+
+		if (count == capacity) {
+			size_t n = capacity ? capacity * 2 : 1024;
+			e = realloc(entries, n * sizeof(struct t_index_entry));
+			if (e == NULL)
+				goto cleanup;
+			entries  = e;
+			capacity = n;
+		}
+		e = &entries[count];
+		bzero(e, sizeof(struct t_index_entry));
+		/* the path relative to root */
+		e->path = strdup(ent->fts_path + rootlen +
+		    (ent->fts_path[rootlen] == '/'));
+		if (e->path == NULL)
+			goto cleanup;
+		e->sb = *ent->fts_statp;
+		count++;
+	}
+	if (errno != 0) {
+		warn("%s", root);
+		goto cleanup;
+	}
+
+	qsort(entries, count, sizeof(struct t_index_entry), t_index_entry_cmp);
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	(void)fts_close(fts);
+	free(paths[0]);
+	if (ret == -1) {
+		while (count > 0)
+			free(entries[--count].path);
+		free(entries);
+		entries = NULL;
+	}
+	*entries_p = entries;
+	*count_p   = count;
+	return (ret);
+}
+
+
+static int
+t_index_add(struct t_index_postings *ps, const char *key, const char *val,
+    uint32_t id)
+{
+	struct t_index_posting *p;
+
+	assert(ps != NULL);
+	assert(key != NULL);
+	assert(val != NULL);
+
+	if (ps->count == ps->capacity) {
+		size_t n = ps->capacity ? ps->capacity * 2 : 1024;
+		if (n > SIZE_MAX / sizeof(struct t_index_posting)) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		p = realloc(ps->p, n * sizeof(struct t_index_posting));
+		if (p == NULL)
+			return (-1);
+		ps->p        = p;
+		ps->capacity = n;
+	}
+	p = &ps->p[ps->count++];
+	p->key = key;
+	p->val = val;
+	p->id  = id;
+
+	return (0);
+}
+
+
+/*
+ * write the index file at path (replacing the previous one).
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+static int
+t_index_write(const char *path, const struct t_index_entry *entries,
+    size_t count, struct t_index_postings *ps)
+{
+	struct t_index_header h;
+	struct t_index_file *files = NULL;
+	struct t_index_value *values = NULL;
+	struct t_index_key *keys = NULL;
+	struct sbuf *strings = NULL, *postings = NULL;
+	const struct t_index_posting *p, *prev = NULL;
+	unsigned char leb[10];
+	uint32_t nvalues = 0, nkeys = 0, delta;
+	char *tempfile = NULL;
+	FILE *fp = NULL;
+	size_t i, n;
+	int fd, ret = -1;
+
+	assert(path != NULL);
+	assert(ps != NULL);
+
+	strings  = sbuf_new_auto();
+	postings = sbuf_new_auto();
+	files    = calloc(count + 1, sizeof(struct t_index_file));
+	/* worst case, one key and one value by posting */
+	values   = calloc(ps->count + 1, sizeof(struct t_index_value));
+	keys     = calloc(ps->count + 1, sizeof(struct t_index_key));
+	if (strings == NULL || postings == NULL || files == NULL ||
+	    values == NULL || keys == NULL)
+		goto cleanup;
+
+	for (i = 0; i < count; i++) {
+		files[i].ino        = (uint64_t)entries[i].sb.st_ino;
+		files[i].size       = (int64_t)entries[i].sb.st_size;
+		files[i].mtime_sec  = (int64_t)entries[i].sb.st_mtim.tv_sec;
+		files[i].mtime_nsec = (int64_t)entries[i].sb.st_mtim.tv_nsec;
+		files[i].path       = t_index_strcat(strings, entries[i].path);
+		files[i].flags      = entries[i].flags;
+	}
+
+	qsort(ps->p, ps->count, sizeof(struct t_index_posting),
+	    t_index_posting_cmp);
+	for (i = 0; i < ps->count; i++) {
+		p = &ps->p[i];
+		if (prev == NULL || t_tag_keycmp(prev->key, p->key) != 0) {
+			keys[nkeys].name    = t_index_strcat(strings, p->key);
+			keys[nkeys].first   = nvalues;
+			keys[nkeys].nvalues = 0;
+			nkeys++;
+			prev = NULL;
+		}
+		if (prev == NULL || strcmp(prev->val, p->val) != 0) {
+			values[nvalues].val      = t_index_strcat(strings, p->val);
+			values[nvalues].postings = (uint64_t)sbuf_len(postings);
+			values[nvalues].count    = 0;
+			keys[nkeys - 1].nvalues++;
+			nvalues++;
+			delta = p->id;
+		} else if (prev->id == p->id) {
+			/* the same tag twice in a file */
+			continue;
+		} else
+			delta = p->id - prev->id;
+		/* LEB128 */
+		n = 0;
+		do {
+			leb[n] = delta & 0x7f;
+			delta >>= 7;
+			if (delta != 0)
+				leb[n] |= 0x80;
+			n++;
+		} while (delta != 0);
+		(void)sbuf_bcat(postings, leb, n);
+		values[nvalues - 1].count++;
+		prev = p;
+	}
+	if (sbuf_finish(strings) == -1 || sbuf_finish(postings) == -1)
+		goto cleanup;
+	if ((uint64_t)sbuf_len(strings) > UINT32_MAX) {
+		/* the offsets of the strings would overflow */
+		errno = EFBIG;
+		goto cleanup;
+	}
+
+	bzero(&h, sizeof(h));
+	(void)memcpy(h.magic, T_INDEX_MAGIC, sizeof(h.magic));
+	h.version  = T_INDEX_VERSION;
+	h.nfiles   = (uint32_t)count;
+	h.nvalues  = nvalues;
+	h.nkeys    = nkeys;
+	h.postings = sizeof(h) +
+	    count   * sizeof(struct t_index_file) +
+	    nvalues * sizeof(struct t_index_value) +
+	    nkeys   * sizeof(struct t_index_key);
+	h.strings  = h.postings + (uint64_t)sbuf_len(postings);
+
+	/* write the new index next to the old one and replace it */
+	if (asprintf(&tempfile, "%s.XXXXXX", path) < 0) {
+		tempfile = NULL;
+		goto cleanup;
+	}
+	if ((fd = mkstemp(tempfile)) == -1)
+		goto cleanup;
+	/* the index may be shared, readable like any other created file */
+	if (t_fchmod_umask(fd) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		(void)close(fd);
+		goto cleanup;
+	}
+	if (fwrite(&h, sizeof(h), 1, fp) != 1 ||
+	    fwrite(files, sizeof(struct t_index_file), count, fp) != count ||
+	    fwrite(values, sizeof(struct t_index_value), nvalues, fp) != nvalues ||
+	    fwrite(keys, sizeof(struct t_index_key), nkeys, fp) != nkeys ||
+	    fwrite(sbuf_data(postings), 1, (size_t)sbuf_len(postings), fp) !=
+	    (size_t)sbuf_len(postings) ||
+	    fwrite(sbuf_data(strings), 1, (size_t)sbuf_len(strings), fp) !=
+	    (size_t)sbuf_len(strings))
+		goto cleanup;
+	fd = fclose(fp);
+	fp = NULL;
+	if (fd != 0 || rename(tempfile, path) == -1)
+		goto cleanup;
+	free(tempfile);
+	tempfile = NULL;
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	if (ret == -1)
+		warn("%s", path);
+	if (fp != NULL)
+		(void)fclose(fp);
+	if (tempfile != NULL) {
+		(void)unlink(tempfile);
+		free(tempfile);
+	}
+	if (strings != NULL)
+		sbuf_delete(strings);
+	if (postings != NULL)
+		sbuf_delete(postings);
+	free(keys);
+	free(values);
+	free(files);
+	return (ret);
+}
+
+
+/*
+ * append s (and its terminating NUL) to the strings area.
+ *
+ * @return
+ *   the offset of s in the strings area.
+ */
+static uint32_t
+t_index_strcat(struct sbuf *sb, const char *s)
+{
+	uint32_t off;
+
+	assert(sb != NULL);
+	assert(s != NULL);
+
+	off = (uint32_t)sbuf_len(sb);
+	(void)sbuf_bcat(sb, s, strlen(s) + 1);
+	return (off);
+}
+
+
+static int
+t_index_entry_cmp(const void *a, const void *b)
+{
+	const struct t_index_entry *x = a, *y = b;
+
+	return (strcmp(x->path, y->path));
+}
+
+
+static int
+t_index_posting_cmp(const void *a, const void *b)
+{
+	const struct t_index_posting *x = a, *y = b;
+	int cmp;
+
+	if ((cmp = t_tag_keycmp(x->key, y->key)) != 0)
+		return (cmp);
+	if ((cmp = strcmp(x->val, y->val)) != 0)
+		return (cmp);
+	return (x->id < y->id ? -1 : (x->id > y->id));
+}
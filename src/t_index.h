@@ -0,0 +1,49 @@
+#ifndef T_INDEX_H
+#define T_INDEX_H
+/*
+ * t_index.h
+ *
+ * inverted index of the tags of a directory tree.
+ *
+ * The index is stored in the T_INDEX_FILE file at the root of the directory.
+ * It map each tag key to its values, and each value to the (sorted, delta
+ * compressed) list of the files having it. Queries use the t_filter
+ * expressions of the where action and only read the index, never the music
+ * files.
+ */
+#include "t_config.h"
+
+
+#define	T_INDEX_FILE	".tagutil.index"
+
+/*
+ * build (or update) the index of dir.
+ *
+ * Each file under dir (except the hidden ones) is identified by its path
+ * relative to dir. When the index already exists, the tags of the files with
+ * the same inode, size and mtime as the indexed ones are taken from the index,
+ * the others are read again.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_index_build(const char *dir);
+
+/*
+ * display the path of each indexed file of dir matching expr, see
+ * t_filter_parse().
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_index_query(const char *dir, const char *expr);
+
+/*
+ * run the index command: `build DIR' or `query EXPR [DIR]'.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_index_command(int argc, char *argv[]);
+
+#endif /* ndef T_INDEX_H */
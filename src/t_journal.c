@@ -0,0 +1,291 @@
+/*
+ * t_journal.c
+ *
+ * journal of the processed files.
+ *
+ * The ok lines of the journal are loaded in an array sorted by device, inode,
+ * size and modification time, so that t_journal_done() is a stat(2) and a
+ * bsearch(3). Records are written with a single write(2) to a file opened
+ * with O_APPEND, so that a crash may only truncate the last line (which is
+ * ignored when loading).
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "t_config.h"
+#include "t_toolkit.h"
+#include "t_journal.h"
+
+
+struct t_journal_entry {
+	uintmax_t	dev;
+	uintmax_t	ino;
+	intmax_t	size;
+	intmax_t	mtime_sec;
+	long		mtime_nsec;
+};
+
+static struct {
+	char	*path;
+	int	 fd;
+	struct t_journal_entry	*entries;
+	size_t	 count;
+	int	 cut;    /* the last line was cut by a crash */
+	int	 dirty;  /* records not synced yet */
+	time_t	 synced; /* time of the last sync */
+} t_journal = { .fd = -1 };
+
+
+static int	t_journal_load(FILE *fp);
+static void	t_journal_key(struct t_journal_entry *e, const struct stat *sb);
+static int	t_journal_cmp(const void *va, const void *vb);
+
+
+int
+t_journal_open(const char *path)
+{
+	FILE *fp;
+
+	assert(path != NULL);
+	assert(t_journal.path == NULL);
+
+	if ((t_journal.path = strdup(path)) == NULL)
+		return (-1);
+
+	if ((fp = fopen(path, "r")) != NULL) {
+		int status = t_journal_load(fp);
+		(void)fclose(fp);
+		if (status == -1)
+			goto error;
+	} else if (errno != ENOENT) {
+		goto error;
+	}
+
+	t_journal.fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (t_journal.fd == -1)
+		goto error;
+	/* end the cut line, so that the next record stay on its own */
+	if (t_journal.cut && write(t_journal.fd, "\n", 1) != 1)
+		goto error;
+	t_journal.synced = time(NULL);
+
+	return (0);
+error:
+	if (t_journal.fd != -1)
+		(void)close(t_journal.fd);
+	t_journal.fd = -1;
+	free(t_journal.entries);
+	t_journal.entries = NULL;
+	t_journal.count   = 0;
+	free(t_journal.path);
+	t_journal.path = NULL;
+	return (-1);
+}
+
+
+int
+t_journal_done(const char *path)
+{
+	struct t_journal_entry key;
+	struct stat sb;
+
+	assert(path != NULL);
+
+	if (t_journal.count == 0 || stat(path, &sb) == -1)
+		return (0);
+	t_journal_key(&key, &sb);
+
+	return (bsearch(&key, t_journal.entries, t_journal.count,
+	    sizeof(struct t_journal_entry), t_journal_cmp) != NULL);
+}
+
+
+int
+t_journal_record(const char *path, const struct stat *sb, int success)
+{
+	struct t_journal_entry e;
+	struct sbuf *line;
+	const char *c;
+	time_t now;
+	ssize_t n;
+	int ret = -1;
+
+	assert(path != NULL);
+
+	if (t_journal.fd == -1)
+		return (0);
+
+	memset(&e, 0, sizeof(e));
+	if (sb != NULL)
+		t_journal_key(&e, sb);
+
+	if ((line = sbuf_new_auto()) == NULL)
+		return (-1);
+	(void)sbuf_printf(line, "%s %ju %ju %jd %jd.%09ld ",
+	    (success ? "ok" : "error"), e.dev, e.ino, e.size, e.mtime_sec,
+	    e.mtime_nsec);
+	for (c = path; *c != '\0'; c++) {
+		if (*c == '\\' || *c == '\n')
+			(void)sbuf_putc(line, '\\');
+		(void)sbuf_putc(line, (*c == '\n' ? 'n' : *c));
+	}
+	(void)sbuf_putc(line, '\n');
+	if (sbuf_finish(line) == -1)
+		goto cleanup;
+
+	n = write(t_journal.fd, sbuf_data(line), sbuf_len(line));
+	if (n == -1 || n != sbuf_len(line)) {
+		warn("%s: write", t_journal.path);
+		goto cleanup;
+	}
+	t_journal.dirty = 1;
+
+	now = time(NULL);
+	if (now - t_journal.synced >= T_JOURNAL_SYNC) {
+		if (fsync(t_journal.fd) == -1) {
+			warn("%s: fsync", t_journal.path);
+			goto cleanup;
+		}
+		t_journal.dirty  = 0;
+		t_journal.synced = now;
+	}
+
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	sbuf_delete(line);
+	return (ret);
+}
+
+
+int
+t_journal_close(void)
+{
+	int success = 1;
+
+	if (t_journal.fd != -1) {
+		if (t_journal.dirty && fsync(t_journal.fd) == -1) {
+			warn("%s: fsync", t_journal.path);
+			success = 0;
+		}
+		if (close(t_journal.fd) == -1) {
+			warn("%s: close", t_journal.path);
+			success = 0;
+		}
+	}
+	t_journal.fd = -1;
+	free(t_journal.entries);
+	t_journal.entries = NULL;
+	t_journal.count   = 0;
+	free(t_journal.path);
+	t_journal.path = NULL;
+
+	return (success ? 0 : -1);
+}
+
+
+/*
+ * load the ok lines of the journal.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+static int
+t_journal_load(FILE *fp)
+{
+	struct t_journal_entry e, *entries;
+	char *line = NULL, result[6];
+	size_t linecap = 0, capacity = 0, lineno = 0;
+	ssize_t len;
+	int success = 0;
+
+	assert(fp != NULL);
+
+	while ((len = getline(&line, &linecap, fp)) != -1) {
+		lineno++;
+		/* the last line may have been cut by a crash */
+		if (line[len - 1] != '\n') {
+			t_journal.cut = 1;
+			break;
+		}
+		if (sscanf(line, "%5s %ju %ju %jd %jd.%ld ", result, &e.dev,
+		    &e.ino, &e.size, &e.mtime_sec, &e.mtime_nsec) != 6) {
+			warnx("%s:%zu: invalid journal line, ignored",
+			    t_journal.path, lineno);
+			continue;
+		}
+		if (strcmp(result, "ok") != 0)
+			continue;
+		if (t_journal.count == capacity) {
+			capacity = (capacity == 0 ? 1024 : 2 * capacity);
+			entries = realloc(t_journal.entries,
+			    capacity * sizeof(*entries));
+			if (entries == NULL)
+				goto cleanup;
+			t_journal.entries = entries;
+		}
+		t_journal.entries[t_journal.count++] = e;
+	}
+	if (ferror(fp)) {
+		warn("%s", t_journal.path);
+		goto cleanup;
+	}
+
+	qsort(t_journal.entries, t_journal.count,
+	    sizeof(struct t_journal_entry), t_journal_cmp);
+	success = 1;
+
+	/* FALLTHROUGH */
+cleanup:
+	free(line);
+	return (success ? 0 : -1);
+}
+
+
+static void
+t_journal_key(struct t_journal_entry *e, const struct stat *sb)
+{
+
+	assert(e != NULL);
+	assert(sb != NULL);
+
+	e->dev        = (uintmax_t)sb->st_dev;
+	e->ino        = (uintmax_t)sb->st_ino;
+	e->size       = (intmax_t)sb->st_size;
+	e->mtime_sec  = (intmax_t)sb->st_mtim.tv_sec;
+	e->mtime_nsec = (long)sb->st_mtim.tv_nsec;
+}
+
+
+static int
+t_journal_cmp(const void *va, const void *vb)
+{
+	const struct t_journal_entry *a, *b;
+
+	assert(va != NULL);
+	assert(vb != NULL);
+
+	a = va;
+	b = vb;
+	if (a->dev != b->dev)
+		return (a->dev < b->dev ? -1 : 1);
+	if (a->ino != b->ino)
+		return (a->ino < b->ino ? -1 : 1);
+	if (a->size != b->size)
+		return (a->size < b->size ? -1 : 1);
+	if (a->mtime_sec != b->mtime_sec)
+		return (a->mtime_sec < b->mtime_sec ? -1 : 1);
+	if (a->mtime_nsec != b->mtime_nsec)
+		return (a->mtime_nsec < b->mtime_nsec ? -1 : 1);
+	return (0);
+}
@@ -0,0 +1,67 @@
+#ifndef T_JOURNAL_H
+#define T_JOURNAL_H
+/*
+ * t_journal.h
+ *
+ * journal of the processed files (see the -J option), to resume an
+ * interrupted run.
+ *
+ * A line is appended to the journal file for each file processed:
+ *
+ *   RESULT DEV INO SIZE MTIME PATH
+ *
+ * where RESULT is either `ok' or `error', MTIME is seconds.nanoseconds and
+ * PATH is the file argument (with `\' and newlines escaped by a `\'). DEV,
+ * INO, SIZE and MTIME are taken once the actions were applied. A file is
+ * skipped when the journal has an ok line with its current device, inode,
+ * size and modification time, so renamed files are recognized and modified
+ * files are processed again.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "t_config.h"
+
+
+/* maximum delay (in seconds) before the journal is synced to the disk */
+#define	T_JOURNAL_SYNC	1
+
+/*
+ * load the journal file at path and open it for appending, creating it if
+ * needed.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_journal_open(const char *path);
+
+/*
+ * tell if the file at path was already processed successfully and didn't
+ * change since. Always 0 when no journal is open.
+ *
+ * @return
+ *   1 if the file can be skipped, 0 otherwise.
+ */
+int	t_journal_done(const char *path);
+
+/*
+ * append the result of the actions for the file at path to the journal. sb
+ * is the file stat(2) after the actions, or NULL when it failed.
+ *
+ * The journal is synced to the disk at most T_JOURNAL_SYNC seconds after a
+ * record. Nothing is done when no journal is open.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_journal_record(const char *path, const struct stat *sb, int success);
+
+/*
+ * sync and close the journal, if open.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_journal_close(void);
+
+#endif /* ndef T_JOURNAL_H */
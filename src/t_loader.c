@@ -21,6 +21,8 @@ t_load(struct t_tune *tune, const char *fmtfile)
 	assert(tune != NULL);
 	assert(fmtfile != NULL);
 
+	if (t_format_load(Fflag) == -1)
+		return (-1);
 	if (strlen(fmtfile) == 0 || strcmp(fmtfile, "-") == 0)
 		fp = stdin;
 	else {
@@ -0,0 +1,56 @@
+/*
+ * t_plugin.c
+ *
+ * shared objects loading for tagutil.
+ */
+#include <dlfcn.h>
+
+#include "t_config.h"
+#include "t_toolkit.h"
+#include "t_plugin.h"
+
+
+/* set by CMake */
+#if !defined(T_PLUGIN_DIR)
+#	define	T_PLUGIN_DIR	"/usr/local/lib/tagutil"
+#endif
+#if !defined(T_PLUGIN_SUFFIX)
+#	define	T_PLUGIN_SUFFIX	".so"
+#endif
+
+
+void *
+t_plugin_load(const char *module, const char *symbol)
+{
+	const char *dir;
+	char *path = NULL;
+	void *handle, *ret = NULL;
+	void *(*ctor)(void);
+
+	assert(module != NULL);
+	assert(symbol != NULL);
+
+	dir = getenv("TAGUTIL_PLUGINS");
+	if (dir == NULL || *dir == '\0')
+		dir = T_PLUGIN_DIR;
+	if (asprintf(&path, "%s/%s%s", dir, module, T_PLUGIN_SUFFIX) < 0)
+		return (NULL);
+
+	/* the plugin use tagutil's symbols, but must not expose its own */
+	if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+		warnx("%s", dlerror());
+		goto cleanup;
+	}
+	/* POSIX way to convert an object pointer to a function pointer */
+	*(void **)&ctor = dlsym(handle, symbol);
+	if (ctor == NULL) {
+		warnx("%s: %s", path, dlerror());
+		(void)dlclose(handle);
+		goto cleanup;
+	}
+	ret = ctor();
+	/* FALLTHROUGH */
+cleanup:
+	free(path);
+	return (ret);
+}
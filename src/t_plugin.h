@@ -0,0 +1,35 @@
+#ifndef T_PLUGIN_H
+#define T_PLUGIN_H
+/*
+ * t_plugin.h
+ *
+ * shared objects loading, for the backends and formats built as plugins (see
+ * the WITH_PLUGINS CMake variable).
+ *
+ * A plugin is only loaded when a file (or the -F option) need it, so that
+ * tagutil doesn't pay the dynamic linking of all the libraries it can use
+ * at startup.
+ */
+#include "t_config.h"
+
+
+/*
+ * load a plugin and call its constructor (e.g. t_ftflac_backend()).
+ *
+ * The plugin is searched in the directory given by the TAGUTIL_PLUGINS
+ * environment variable if set, in the directory configured at build time
+ * otherwise. Loaded plugins are never unloaded.
+ *
+ * @param module
+ *   The plugin name, without directory nor suffix.
+ *
+ * @param symbol
+ *   The constructor name.
+ *
+ * @return
+ *   The value returned by the constructor, NULL on error (a warning is
+ *   displayed).
+ */
+void	*t_plugin_load(const char *module, const char *symbol);
+
+#endif /* ndef T_PLUGIN_H */
@@ -12,9 +12,12 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "t_config.h"
 #include "t_toolkit.h"
@@ -24,35 +27,196 @@
 /*
  * t_rename_pattern definition
  *
- * a t_rename_pattern is a list of parsed tokens. Token are either a tag
- * reference or a string litteral.
- * */
-struct t_rename_token {
-	int		is_tag; /* 0 means string litteral, != 0 means a tag */
-	const char	*value;
-	TAILQ_ENTRY(t_rename_token)	entries;
+ * a t_rename_pattern is a pattern compiled to a small program. Each op either
+ * copy a string litteral or expand a tag. Strings are stored in a pool
+ * following the ops, a tag op has both the key as written (used when the tag
+ * is missing) and the key folded to lower case (to match the tag keys
+ * without t_tag_keycmp()).
+ */
+struct t_rename_op {
+	enum {
+		T_RENAME_OP_STRING,
+		T_RENAME_OP_TAG,
+	} code;
+	size_t	len; /* length of the string or the key */
+	size_t	str; /* pool offset of the string or the key as written */
+	size_t	key; /* pool offset of the folded key (tags only) */
+};
+struct t_rename_pattern {
+	size_t	count;
+	const char	*pool;
+	struct t_rename_op	ops[];
+	/* followed by the string pool */
 };
-TAILQ_HEAD(t_rename_pattern, t_rename_token);
 
 
 /*
- * helper for t_rename() - eval the given pattern in the context of given
- * t_tune.
+ * t_rename_plan definition
+ *
+ * a t_rename_plan is an array of planned renames. Once checked, an entry
+ * whose destination is the file of another entry is "blocked" by it until it
+ * has been renamed. Since destinations are unique, each entry block at most
+ * one other entry (its "dependent") and the entries form chains and cycles.
+ * The entries after the committed ones are candidates, see
+ * t_rename_plan_commit().
+ */
+#define	T_RENAME_NONE	SIZE_MAX
+struct t_rename_entry {
+	char	*opath; /* old path */
+	char	*npath; /* new path */
+	dev_t	 dev;
+	ino_t	 ino;
+	size_t	 blocker;   /* entry of the file at npath, or T_RENAME_NONE */
+	size_t	 dependent; /* entry renamed to opath, or T_RENAME_NONE */
+	enum {
+		T_RENAME_PLANNED,
+		T_RENAME_DROPPED, /* not renamed (error or duplicate) */
+		T_RENAME_STACKED, /* waiting for its blocker to be renamed */
+		T_RENAME_DONE,
+	} state;
+};
+
+/*
+ * directory cache of a plan, an open addressing hash table keyed by path.
+ * Missing directories are cached too, so that each one is looked up at most
+ * once per run. The open directories are in LRU order, the least recently
+ * used being closed first.
+ */
+struct t_rename_dir {
+	char	*path;
+	int	 fd; /* -1 when closed */
+	enum {
+		T_RENAME_DIR_UNKNOWN,
+		T_RENAME_DIR_MISSING,
+		T_RENAME_DIR_EXISTS,
+	} state;
+	TAILQ_ENTRY(t_rename_dir)	entries;
+};
+TAILQ_HEAD(t_rename_dirQ, t_rename_dir);
+
+struct t_rename_plan {
+	struct t_rename_pattern	*pattern;
+	struct sbuf	*sb; /* new path buffer, reused for each file */
+	struct t_rename_entry	*entries;
+	size_t	count;
+	size_t	committed;
+	size_t	capacity;
+	struct t_rename_dir	**dirs;
+	size_t	dircount;
+	size_t	dircapacity; /* always a power of two */
+	struct t_rename_dirQ	open[1]; /* most recently used first */
+	size_t	opencount;
+};
+
+
+/*
+ * helper for t_rename_plan_add() - eval the given pattern in the context of
+ * given t_tune, appending the result to sb.
  *
  * @return
- *  the resulting string or NULL on error. Returned value has to be free()d by
- *  the caller.
+ *  -1 on error, 0 on success.
  */
-static char	*t_rename_eval(struct t_tune *tune,
-		    const struct t_rename_pattern *pattern);
+static int	t_rename_eval(struct t_tune *tune,
+		    const struct t_rename_pattern *pattern, struct sbuf *sb);
 
 /*
- * helper for t_rename() - rename path to new_path.
+ * helper for t_rename_plan_run() - drop the entries that can not be renamed,
+ * and every entry waiting for them.
+ *
+ * @return
+ *   -1 if an entry was dropped because of an error, 0 otherwise.
+ */
+static int	t_rename_plan_check(struct t_rename_plan *plan);
+
+/*
+ * helper for t_rename_plan_run() - ask the user to confirm the plan.
+ *
+ * @return
+ *   1 if the plan is confirmed, 0 otherwise.
+ */
+static int	t_rename_plan_confirm(const struct t_rename_plan *plan);
+
+/*
+ * helper for t_rename_plan_run() - rename the file of the given entry, which
+ * is at src, to the new path.
+ *
+ * @return
+ *   return -1 on error, 0 on success.
+ */
+static int	t_rename_move(struct t_rename_plan *plan,
+		    const struct t_rename_entry *e, const char *src);
+
+/*
+ * get a file descriptor for the directory at path from the plan directory
+ * cache, creating the directory first if create is set (see the pflag). The
+ * file descriptor belongs to the cache.
+ *
+ * @return
+ *   the directory file descriptor, or -1 on error and set errno (ENOENT when
+ *   the directory does not exist and create is not set).
+ */
+static int	t_rename_dirfd(struct t_rename_plan *plan, const char *path,
+		    int create);
+
+/*
+ * helper for t_rename_dirfd() - find the directory at path in the plan
+ * directory cache, adding it when needed.
+ *
+ * @return
+ *   the cached directory, or NULL on error.
+ */
+static struct t_rename_dir	*t_rename_dir_find(struct t_rename_plan *plan,
+		    const char *path);
+
+/*
+ * helper for t_rename_dirfd() - create the directory d and its missing parents
+ * (like mkdir -p). The parents are looked up through the cache, so that each
+ * one is only created (or found existing) once per run.
+ *
+ * @return
+ *   -1 on error and set errno, 0 on success.
+ */
+static int	t_rename_mkdir(struct t_rename_plan *plan,
+		    struct t_rename_dir *d);
+
+/* close and forget every directory of the plan directory cache */
+static void	t_rename_dirs_clear(struct t_rename_plan *plan);
+
+/*
+ * split path in its directory, copied into dir, and its base name.
+ *
+ * @return
+ *   the base name (pointing into path), or NULL on error.
+ */
+static const char	*t_rename_split(const char *path, char *dir,
+		    size_t dirsize);
+
+/*
+ * helper for t_rename_plan_run() - move the file at path to a new temporary
+ * name in the same directory.
+ *
+ * @return
+ *   the temporary name or NULL on error. Returned value has to be free()d by
+ *   the caller.
+ */
+static char	*t_rename_tmp(const char *path);
+
+/*
+ * renameat(2) from to to, failing with EEXIST when to exists.
  *
  * @return
  *   return -1 on error and set and errno, 0 on success.
  */
-static int	t_rename_safe(const char *oldpath, const char *newpath);
+static int	t_rename_noreplace(int fromfd, const char *from, int tofd,
+		    const char *to);
+
+/*
+ * bsearch(3) and qsort(3) routines for plan entries pointers. The sort
+ * routines keep the plan order of equal entries.
+ */
+static int	t_rename_entry_filecmp(const void *va, const void *vb);
+static int	t_rename_entry_filesort(const void *va, const void *vb);
+static int	t_rename_entry_npathsort(const void *va, const void *vb);
 
 /*
  * print the given question, and read user's input. input should match
@@ -65,124 +229,281 @@ static int	t_rename_safe(const char *oldpath, const char *newpath);
  */
 static int	t_yesno(const char *question);
 
-/* helper for t_rename_parse() */
-static struct t_rename_token	*t_rename_token_new(int is_tag, const char *value);
+/*
+ * helper for t_rename_parse() - append an op to ops, its string to pool.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+static int	t_rename_emit(struct sbuf *ops, struct sbuf *pool, int code,
+		    struct sbuf *str);
+
+
+struct t_rename_plan *
+t_rename_plan_new(const char *pattern)
+{
+	struct t_rename_plan *plan;
 
-/* helper for t_rename_safe(), taken from mkdir(3) */
-static int	build(char *path, mode_t omode);
+	assert(pattern != NULL);
+
+	plan = calloc(1, sizeof(struct t_rename_plan));
+	if (plan == NULL)
+		return (NULL);
+	TAILQ_INIT(plan->open);
+	if ((plan->sb = sbuf_new_auto()) == NULL) {
+		free(plan);
+		return (NULL);
+	}
+	plan->pattern = t_rename_parse(pattern);
+	if (plan->pattern == NULL) {
+		if (errno != ENOMEM)
+			errno = EINVAL;
+		sbuf_delete(plan->sb);
+		free(plan);
+		return (NULL);
+	}
+
+	return (plan);
+}
 
 
 int
-t_rename(struct t_tune *tune, const struct t_rename_pattern *pattern)
+t_rename_plan_add(struct t_rename_plan *plan, struct t_tune *tune)
 {
-	int ret = 0;
+	int ret = -1;
 	const char *ext;
-	char *npath = NULL, *rname = NULL, *q = NULL;
+	char *npath = NULL;
 	const char *opath;
 	const char *dirn;
+	struct t_rename_entry *e;
+	struct stat st;
 
-	/* XXX: these are undocumented hacky interfaces for the rename feature. */
-	int	t__tune_reload__(struct t_tune *tune, const char *path);
-
-	assert(pattern != NULL);
+	assert(plan != NULL);
 	assert(tune != NULL);
+	assert(plan->count == plan->committed);
 
-	/* ensure a clean file state */
-	if (t_tune_save(tune) == -1)
-		goto error_label;
-
-	ext = strrchr(t_tune_path(tune), '.');
+	opath = t_tune_path(tune);
+	ext = strrchr(opath, '.');
 	if (ext == NULL) {
-		warnx("%s: can not find file extension", t_tune_path(tune));
-		goto error_label;
-	}
-	ext++; /* skip dot */
-	rname = t_rename_eval(tune, pattern);
-	if (rname == NULL)
-		goto error_label;
-
-	/* rname is now OK. store into result the full new path.  */
-	dirn = t_dirname(t_tune_path(tune));
-	if (dirn == NULL) {
-		warn("dirname");
-		goto error_label;
+		warnx("%s: can not find file extension", opath);
+		goto cleanup;
 	}
 
-	opath = t_tune_path(tune);
+	sbuf_clear(plan->sb);
 	/* we dont want foo.flac to be renamed then same name just with a
 	   different path like ./foo.flac */
-	if (strcmp(opath, t_basename(opath)) == 0) {
-		if (asprintf(&npath, "%s.%s", rname, ext) < 0)
-			goto error_label;
-	} else {
-		if (asprintf(&npath, "%s/%s.%s", dirn, rname, ext) < 0)
-			goto error_label;
+	if (strcmp(opath, t_basename(opath)) != 0) {
+		dirn = t_dirname(opath);
+		if (dirn == NULL) {
+			warn("dirname");
+			goto cleanup;
+		}
+		(void)sbuf_cat(plan->sb, dirn);
+		(void)sbuf_putc(plan->sb, '/');
 	}
+	if (t_rename_eval(tune, plan->pattern, plan->sb) == -1)
+		goto cleanup;
+	(void)sbuf_cat(plan->sb, ext);
+	if (sbuf_finish(plan->sb) == -1)
+		goto cleanup;
 
-	/* ask user for confirmation and rename if user want to */
-	if (asprintf(&q, "rename `%s' to `%s'", opath, npath) < 0)
-		goto error_label;
-	if (strcmp(opath, npath) != 0 && t_yesno(q)) {
-		ret = t_rename_safe(opath, npath);
-		if (ret == 0) {
-			if (t__tune_reload__(tune, npath) == -1)
-				goto error_label;
-		}
+	if (strcmp(opath, sbuf_data(plan->sb)) == 0) {
+		ret = 0;
+		goto cleanup;
+	}
+	if (stat(opath, &st) == -1) {
+		warn("%s", opath);
+		goto cleanup;
 	}
+	if ((npath = strdup(sbuf_data(plan->sb))) == NULL)
+		goto cleanup;
 
-	free(q);
+	if (plan->count == plan->capacity) {
+		size_t capacity = (plan->capacity == 0 ? 64 : 2 * plan->capacity);
+		e = realloc(plan->entries, capacity * sizeof(*e));
+		if (e == NULL)
+			goto cleanup;
+		plan->entries  = e;
+		plan->capacity = capacity;
+	}
+	e = &plan->entries[plan->count];
+	if ((e->opath = strdup(opath)) == NULL)
+		goto cleanup;
+	e->npath     = npath;
+	npath        = NULL;
+	e->dev       = st.st_dev;
+	e->ino       = st.st_ino;
+	e->blocker   = T_RENAME_NONE;
+	e->dependent = T_RENAME_NONE;
+	e->state     = T_RENAME_PLANNED;
+	plan->count++;
+
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
 	free(npath);
-	free(rname);
 	return (ret);
-	/* NOTREACHED */
+}
 
-error_label:
-	free(q);
-	free(npath);
-	free(rname);
-	return (-1);
+
+int
+t_rename_plan_commit(struct t_rename_plan *plan, int keep)
+{
+	int kept;
+
+	assert(plan != NULL);
+	assert(plan->count - plan->committed <= 1);
+
+	kept = (keep && plan->count > plan->committed);
+	while (plan->count > plan->committed && !keep) {
+		plan->count--;
+		free(plan->entries[plan->count].opath);
+		free(plan->entries[plan->count].npath);
+	}
+	plan->committed = plan->count;
+
+	return (kept);
+}
+
+
+int
+t_rename_plan_run(struct t_rename_plan *plan, t_rename_report *report,
+    void *arg)
+{
+	int success = 1;
+	size_t i, k, sp, *stack = NULL;
+	struct t_rename_entry *e;
+	char *tmp;
+
+	assert(plan != NULL);
+	assert(plan->count == plan->committed);
+
+	if (plan->count == 0)
+		return (0);
+
+	if (t_rename_plan_check(plan) == -1)
+		success = 0;
+	if (!t_rename_plan_confirm(plan))
+		goto cleanup;
+
+	stack = calloc(plan->count, sizeof(*stack));
+	if (stack == NULL) {
+		warn("malloc");
+		success = 0;
+		goto cleanup;
+	}
+	for (i = 0; i < plan->count; i++) {
+		if (plan->entries[i].state != T_RENAME_PLANNED)
+			continue;
+		/* follow the chain of blockers, they have to be renamed first */
+		sp = 0;
+		k  = i;
+		while (k != T_RENAME_NONE &&
+		    plan->entries[k].state == T_RENAME_PLANNED) {
+			plan->entries[k].state = T_RENAME_STACKED;
+			stack[sp++] = k;
+			k = plan->entries[k].blocker;
+		}
+		/*
+		 * when the chain loops back, k is waiting for the top of the
+		 * stack which is waiting for k. Moving k out of the way first
+		 * break the cycle, k is then renamed last.
+		 */
+		tmp = NULL;
+		if (k != T_RENAME_NONE &&
+		    plan->entries[k].state == T_RENAME_STACKED) {
+			if ((tmp = t_rename_tmp(plan->entries[k].opath)) == NULL)
+				success = 0;
+		} else
+			k = T_RENAME_NONE;
+		while (sp > 0) {
+			e = &plan->entries[stack[--sp]];
+			e->state = T_RENAME_DONE;
+			if (stack[sp] == k && tmp != NULL) {
+				if (t_rename_move(plan, e, tmp) == -1) {
+					e->state = T_RENAME_DROPPED;
+					success = 0;
+					if (t_rename_noreplace(AT_FDCWD, tmp,
+					    AT_FDCWD, e->opath) == -1)
+						warn("%s: left as `%s'", e->opath, tmp);
+				}
+			} else if (t_rename_move(plan, e, e->opath) == -1) {
+				e->state = T_RENAME_DROPPED;
+				success = 0;
+			}
+		}
+		free(tmp);
+	}
+
+	/* FALLTHROUGH */
+cleanup:
+	free(stack);
+	for (i = 0; i < plan->count; i++) {
+		e = &plan->entries[i];
+		if (report != NULL)
+			report(e->opath, e->npath, e->state == T_RENAME_DONE, arg);
+		free(e->opath);
+		free(e->npath);
+	}
+	plan->count = plan->committed = 0;
+	/* the directories may change until the next run (see watch) */
+	t_rename_dirs_clear(plan);
+	return (success ? 0 : -1);
+}
+
+
+void
+t_rename_plan_delete(struct t_rename_plan *plan)
+{
+	size_t i;
+
+	if (plan == NULL)
+		return;
+
+	for (i = 0; i < plan->count; i++) {
+		free(plan->entries[i].opath);
+		free(plan->entries[i].npath);
+	}
+	free(plan->entries);
+	t_rename_dirs_clear(plan);
+	free(plan->dirs);
+	t_rename_pattern_delete(plan->pattern);
+	sbuf_delete(plan->sb);
+	free(plan);
 }
 
 
-#define	T_TAG		1
-#define	T_STRING	0
 struct t_rename_pattern *
 t_rename_parse(const char *source)
 {
 	const char sep = '%';
 	const char *c = source;
 	struct t_rename_pattern *pattern = NULL;
-	struct t_rename_token *token;
-	struct sbuf *sb = NULL;
+	struct sbuf *sb = NULL, *ops = NULL, *pool = NULL;
+	size_t opslen;
 	enum {
 		PARSING_STRING,
 		PARSING_SIMPLE_TAG,
 		PARSING_BRACE_TAG
 	} state;
 
-	sb = sbuf_new_auto();
-	if (sb == NULL)
-		goto error_label;
-
-	pattern = malloc(sizeof(struct t_rename_pattern));
-	if (pattern == NULL)
+	sb   = sbuf_new_auto();
+	ops  = sbuf_new_auto();
+	pool = sbuf_new_auto();
+	if (sb == NULL || ops == NULL || pool == NULL)
 		goto error_label;
-	TAILQ_INIT(pattern);
 
 	state = PARSING_STRING;
 	while (*c != '\0') {
 		/* if we parse a litteral string, check if this is the start of
 		   a tag */
 		if (state == PARSING_STRING && *c == sep) {
-			/* avoid to add a empty token. This can happen when
+			/* avoid to add a empty op. This can happen when
 			   when parsing two consecutive tags like `%tag%tag' */
 			if (sbuf_len(sb) > 0) {
-				if (sbuf_finish(sb) == -1)
+				if (t_rename_emit(ops, pool, T_RENAME_OP_STRING,
+				    sb) == -1)
 					goto error_label;
-				token = t_rename_token_new(T_STRING, sbuf_data(sb));
-				if (token == NULL)
-					goto error_label;
-				TAILQ_INSERT_TAIL(pattern, token, entries);
 			}
 			sbuf_clear(sb);
 			c += 1;
@@ -197,13 +518,9 @@ t_rename_parse(const char *source)
 		           (state == PARSING_BRACE_TAG  && *c == '}')) {
 			if (sbuf_len(sb) == 0)
 				warnx("empty tag in rename pattern");
-			if (sbuf_finish(sb) == -1)
-				goto error_label;
-			token = t_rename_token_new(T_TAG, sbuf_data(sb));
-			if (token == NULL)
+			if (t_rename_emit(ops, pool, T_RENAME_OP_TAG, sb) == -1)
 				goto error_label;
 			sbuf_clear(sb);
-			TAILQ_INSERT_TAIL(pattern, token, entries);
 			if (state == PARSING_BRACE_TAG) {
 				/* eat the closing `}' */
 				c += 1;
@@ -236,118 +553,121 @@ t_rename_parse(const char *source)
 	}
 	/* finish the last tag unless it is the empty string */
 	if (state != PARSING_STRING || sbuf_len(sb) > 0) {
-		if (sbuf_finish(sb) == -1)
-			goto error_label;
-		token = t_rename_token_new(
-			    (state == PARSING_STRING ? T_STRING : T_TAG),
-			    sbuf_data(sb));
-		if (token == NULL)
+		if (t_rename_emit(ops, pool,
+		    (state == PARSING_STRING ? T_RENAME_OP_STRING :
+		    T_RENAME_OP_TAG), sb) == -1)
 			goto error_label;
-		TAILQ_INSERT_TAIL(pattern, token, entries);
 	}
+	if (sbuf_finish(ops) == -1 || sbuf_finish(pool) == -1)
+		goto error_label;
 
+	/* pack the ops and the pool in one block */
+	opslen  = (size_t)sbuf_len(ops);
+	pattern = malloc(sizeof(struct t_rename_pattern) + opslen +
+	    (size_t)sbuf_len(pool));
+	if (pattern == NULL)
+		goto error_label;
+	pattern->count = opslen / sizeof(struct t_rename_op);
+	memcpy(pattern->ops, sbuf_data(ops), opslen);
+	pattern->pool = (char *)pattern->ops + opslen;
+	memcpy((char *)pattern->ops + opslen, sbuf_data(pool),
+	    (size_t)sbuf_len(pool));
+
+	sbuf_delete(pool);
+	sbuf_delete(ops);
 	sbuf_delete(sb);
 	return (pattern);
 	/* NOTREACHED */
 error_label:
+	sbuf_delete(pool);
+	sbuf_delete(ops);
 	sbuf_delete(sb);
 	t_rename_pattern_delete(pattern);
 	return (NULL);
 }
-#undef	T_TAG
-#undef	T_STRING
 
 
-char *
-t_rename_eval(struct t_tune *tune, const struct t_rename_pattern *pattern)
+static int
+t_rename_eval(struct t_tune *tune, const struct t_rename_pattern *pattern,
+    struct sbuf *sb)
 {
-	struct t_rename_token *token;
-	struct sbuf *sb = NULL;
-	struct t_taglist *tlist = NULL, *l = NULL;
-	char *s = NULL, *ret;
+	const struct t_rename_op *op, *end;
+	const struct t_taglist *tlist;
+	const struct t_tag *t;
+	const char *str, *key, *v;
+	size_t i, n, len, start;
+	int slashed;
 
 	assert(tune != NULL);
 	assert(pattern != NULL);
+	assert(sb != NULL);
 
-	sb = sbuf_new_auto();
-	if (sb == NULL)
-		goto error;
-
-	tlist = t_tune_tags(tune);
+	tlist = t_tune_taglist(tune);
 	if (tlist == NULL)
-		goto error;
-
-	TAILQ_FOREACH(token, pattern, entries) {
-		if (token->is_tag) {
-			l = t_taglist_find_all(tlist, token->value);
-			if (l == NULL)
-				goto error;
-			if (l->count > 0) {
-				/* tag exist */
-				if ((s = t_taglist_join(l, " + ")) == NULL)
-					goto error;
-				if (l->count > 1) {
-					warnx("%s: has many `%s' tags, joined with `+'",
-					    t_tune_path(tune), token->value);
-				}
+		return (-1);
+
+	start = (size_t)sbuf_len(sb);
+	end = pattern->ops + pattern->count;
+	for (op = pattern->ops; op < end; op++) {
+		str = pattern->pool + op->str;
+		if (op->code == T_RENAME_OP_STRING) {
+			(void)sbuf_bcat(sb, str, op->len);
+			continue;
+		}
+		key = pattern->pool + op->key;
+		n = 0;
+		slashed = 0;
+		TAILQ_FOREACH(t, tlist->tags, entries) {
+			if (t->klen != op->len)
+				continue;
+			for (i = 0; i < op->len; i++) {
+				if (tolower((unsigned char)t->key[i]) != key[i])
+					break;
 			}
-			t_taglist_delete(l);
-			l = NULL;
-			if (s != NULL) {
-				char *slash = strchr(s, '/');
-				/* check for slash in tag value */
-				if (slash != NULL) {
-					warnx("%s: tag `%s' has / in value, replacing by `-'",
-					    t_tune_path(tune), token->value);
-					do {
-						*slash = '-';
-						slash = strchr(slash, '/');
-					} while (slash != NULL);
-				}
+			if (i != op->len)
+				continue;
+			/* join the values with ` + ' and replace the slashes
+			   by `-' in a single copy */
+			if (n++ > 0)
+				(void)sbuf_cat(sb, " + ");
+			for (v = t->val; v[len = strcspn(v, "/")] != '\0';
+			    v += len + 1) {
+				(void)sbuf_bcat(sb, v, len);
+				(void)sbuf_putc(sb, '-');
+				slashed = 1;
 			}
+			(void)sbuf_bcat(sb, v, len);
+		}
+		if (n == 0) {
+			/* the tag does not exist, use its key */
+			(void)sbuf_bcat(sb, str, op->len);
+		} else if (n > 1) {
+			warnx("%s: has many `%s' tags, joined with `+'",
+			    t_tune_path(tune), str);
+		}
+		if (slashed) {
+			warnx("%s: tag `%s' has / in value, replacing by `-'",
+			    t_tune_path(tune), str);
 		}
-		if (s != NULL) {
-			(void)sbuf_cat(sb, s);
-			free(s);
-			s = NULL;
-		} else
-			(void)sbuf_cat(sb, token->value);
 	}
 
-	ret = NULL;
-	if (sbuf_len(sb) > MAXPATHLEN)
+	if (sbuf_len(sb) < 0) {
+		/* sbuf overflow */
+		errno = ENOMEM;
+		return (-1);
+	} else if ((size_t)sbuf_len(sb) - start > MAXPATHLEN) {
 		warnx("t_rename_eval result is too long (>MAXPATHLEN)");
-	else {
-		if (sbuf_finish(sb) != -1)
-			ret = strdup(sbuf_data(sb));
+		return (-1);
 	}
 
-	sbuf_delete(sb);
-	t_taglist_delete(tlist);
-	return (ret);
-error:
-	free(s);
-	t_taglist_delete(l);
-	sbuf_delete(sb);
-	t_taglist_delete(tlist);
-	return (NULL);
+	return (0);
 }
 
 
 void
 t_rename_pattern_delete(struct t_rename_pattern *pattern)
 {
-	struct t_rename_token *t1, *t2;
 
-	if (pattern == NULL)
-		return;
-
-	t1 = TAILQ_FIRST(pattern);
-	while (t1 != NULL) {
-		t2 = TAILQ_NEXT(t1, entries);
-		free(t1);
-		t1 = t2;
-	}
 	free(pattern);
 }
 
@@ -403,64 +723,209 @@ t_yesno(const char *question)
 
 
 static int
-t_rename_safe(const char *opath, const char *npath)
+t_rename_plan_check(struct t_rename_plan *plan)
 {
 	extern int pflag;
-	int failed = 0;
+	int success = 1;
+	size_t i, j, n;
+	struct t_rename_entry *e, **found, **byfile = NULL, **bynpath = NULL;
+	struct t_rename_entry key, *k = &key;
 	struct stat st;
-	const char *s;
-	char odir[MAXPATHLEN], ndir[MAXPATHLEN];
+	char ndir[MAXPATHLEN];
+	const char *nbase;
+	int fd;
 
-	assert(opath != NULL);
-	assert(npath != NULL);
+	assert(plan != NULL);
 
-	if ((s = t_dirname(opath)) == NULL) {
-		warn("dirname");
-		return (-1);
+	byfile  = calloc(plan->count, sizeof(*byfile));
+	bynpath = calloc(plan->count, sizeof(*bynpath));
+	if (byfile == NULL || bynpath == NULL) {
+		warn("malloc");
+		for (i = 0; i < plan->count; i++)
+			plan->entries[i].state = T_RENAME_DROPPED;
+		success = 0;
+		goto cleanup;
 	}
-	if (strlcpy(odir, s, sizeof(odir)) >= sizeof(odir)) {
-		warnx("path exceeding MAXPATHLEN");
-		return (-1);
+
+	/* the same file may be given twice, only the first one is renamed */
+	for (i = 0; i < plan->count; i++)
+		byfile[i] = &plan->entries[i];
+	qsort(byfile, plan->count, sizeof(*byfile), t_rename_entry_filesort);
+	for (i = 1, n = 1; i < plan->count; i++) {
+		if (t_rename_entry_filecmp(&byfile[i], &byfile[n - 1]) == 0) {
+			warnx("%s: same file as `%s', ignored",
+			    byfile[i]->opath, byfile[n - 1]->opath);
+			byfile[i]->state = T_RENAME_DROPPED;
+		} else
+			byfile[n++] = byfile[i];
 	}
-	if ((s = t_dirname(npath)) == NULL) {
-		warn("dirname");
-		return (-1);
+
+	/* two files can not be renamed to the same path */
+	for (i = 0; i < n; i++)
+		bynpath[i] = byfile[i];
+	qsort(bynpath, n, sizeof(*bynpath), t_rename_entry_npathsort);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && strcmp(bynpath[i]->npath,
+		    bynpath[j]->npath) == 0; j++) {
+			warnx("`%s' and `%s' would both be renamed to `%s'",
+			    bynpath[i]->opath, bynpath[j]->opath,
+			    bynpath[j]->npath);
+			bynpath[j]->state = T_RENAME_DROPPED;
+			bynpath[i]->state = T_RENAME_DROPPED;
+			success = 0;
+		}
 	}
-	if (strlcpy(ndir, s, sizeof(odir)) >= sizeof(odir)) {
-		warnx("path exceeding MAXPATHLEN");
-		return (-1);
+
+	/*
+	 * check the destinations. An existing destination is only fine when its
+	 * file is renamed too.
+	 */
+	for (i = 0; i < plan->count; i++) {
+		e = &plan->entries[i];
+		if (e->state != T_RENAME_PLANNED)
+			continue;
+		if ((nbase = t_rename_split(e->npath, ndir, sizeof(ndir))) == NULL)
+			goto drop;
+		if ((fd = t_rename_dirfd(plan, ndir, 0)) == -1) {
+			/* with -p, it will be created by t_rename_move() */
+			if (errno == ENOENT && pflag)
+				continue;
+			else if (errno == ENOENT)
+				warn("`%s' (forgot -p ?)", ndir);
+			else
+				warn("%s", ndir);
+			goto drop;
+		}
+		if (fstatat(fd, nbase, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			if (errno == ENOENT)
+				continue;
+			warn("%s", e->npath);
+			goto drop;
+		}
+		key.dev = st.st_dev;
+		key.ino = st.st_ino;
+		found   = bsearch(&k, byfile, n, sizeof(*byfile),
+		    t_rename_entry_filecmp);
+		if (found == NULL) {
+			errno = EEXIST;
+			warn("%s", e->npath);
+			goto drop;
+		}
+		if ((*found)->dependent != T_RENAME_NONE) {
+			/* the same file through two different paths */
+			warnx("`%s' and `%s' would both be renamed to `%s'",
+			    plan->entries[(*found)->dependent].opath, e->opath,
+			    e->npath);
+			plan->entries[(*found)->dependent].state =
+			    T_RENAME_DROPPED;
+			goto drop;
+		}
+		e->blocker = (size_t)(*found - plan->entries);
+		(*found)->dependent = i;
+		continue;
+drop:
+		e->state = T_RENAME_DROPPED;
+		success = 0;
 	}
 
-	if (strcmp(odir, ndir) != 0) {
-		/* srcdir != destdir, we need to check if destdir is OK */
-		if (pflag) { /* we are asked to create the directory */
-			char *d = strdup(ndir);
-			if (d == NULL)
-				return (-1);
-			(void)build(d, S_IRWXU | S_IRWXG | S_IRWXO);
-			free(d);
+	/* the entries waiting for a dropped entry can not be renamed either */
+	for (i = 0; i < plan->count; i++) {
+		if (plan->entries[i].state != T_RENAME_DROPPED)
+			continue;
+		for (j = plan->entries[i].dependent; j != T_RENAME_NONE &&
+		    plan->entries[j].state != T_RENAME_DROPPED;
+		    j = plan->entries[j].dependent) {
+			errno = EEXIST;
+			warn("%s", plan->entries[j].npath);
+			plan->entries[j].state = T_RENAME_DROPPED;
+			success = 0;
 		}
-		if (stat(ndir, &st) != 0) {
-			failed = 1;
-			if (errno == ENOENT && !pflag)
-				warn("`%s' (forgot -p ?)", ndir);
-		} else if (!S_ISDIR(st.st_mode)) {
-			failed = 1;
-			errno  = ENOTDIR;
-			warn("%s", ndir);
+	}
+
+	/* FALLTHROUGH */
+cleanup:
+	free(bynpath);
+	free(byfile);
+	return (success ? 0 : -1);
+}
+
+
+static int
+t_rename_plan_confirm(const struct t_rename_plan *plan)
+{
+	int ret = 0;
+	size_t i, n = 0;
+	const struct t_rename_entry *e, *last = NULL;
+	char *q = NULL;
+
+	assert(plan != NULL);
+
+	for (i = 0; i < plan->count; i++) {
+		if (plan->entries[i].state == T_RENAME_PLANNED) {
+			last = &plan->entries[i];
+			n++;
 		}
 	}
-	if (failed)
+
+	if (n == 0)
+		return (0);
+	else if (n == 1) {
+		if (asprintf(&q, "rename `%s' to `%s'", last->opath,
+		    last->npath) < 0)
+			goto cleanup;
+	} else {
+		for (i = 0; i < plan->count; i++) {
+			e = &plan->entries[i];
+			if (e->state == T_RENAME_PLANNED) {
+				(void)printf("rename `%s' to `%s'\n", e->opath,
+				    e->npath);
+			}
+		}
+		if (asprintf(&q, "rename these %zu files", n) < 0)
+			goto cleanup;
+	}
+	ret = t_yesno(q);
+
+	/* FALLTHROUGH */
+cleanup:
+	free(q);
+	return (ret);
+}
+
+
+static int
+t_rename_move(struct t_rename_plan *plan, const struct t_rename_entry *e,
+    const char *src)
+{
+	extern int pflag;
+	const char *obase, *nbase;
+	char odir[MAXPATHLEN], ndir[MAXPATHLEN];
+	int ofd, nfd;
+
+	assert(plan != NULL);
+	assert(e != NULL);
+	assert(src != NULL);
+
+	if ((obase = t_rename_split(src, odir, sizeof(odir))) == NULL)
+		return (-1);
+	if ((nbase = t_rename_split(e->npath, ndir, sizeof(ndir))) == NULL)
 		return (-1);
 
-	if (stat(npath, &st) == 0) {
-		errno = EEXIST;
-		warn("%s", npath);
+	/* the cache keep at least two directories open */
+	if ((ofd = t_rename_dirfd(plan, odir, 0)) == -1) {
+		warn("%s", odir);
+		return (-1);
+	}
+	if ((nfd = t_rename_dirfd(plan, ndir, pflag)) == -1) {
+		if (errno == ENOENT && !pflag)
+			warn("`%s' (forgot -p ?)", ndir);
+		else
+			warn("%s", ndir);
 		return (-1);
 	}
 
-	if (rename(opath, npath) == -1) {
-		warn("rename");
+	if (t_rename_noreplace(ofd, obase, nfd, nbase) == -1) {
+		warn("rename `%s' to `%s'", e->opath, e->npath);
 		return (-1);
 	}
 
@@ -468,126 +933,316 @@ t_rename_safe(const char *opath, const char *npath)
 }
 
 
-/* alloc and initialize a new t_rename_token */
-static struct t_rename_token *
-t_rename_token_new(int is_tag, const char *value)
+static int
+t_rename_dirfd(struct t_rename_plan *plan, const char *path, int create)
 {
-	struct t_rename_token *token;
-	char *p;
-	size_t len;
-
-	len = strlen(value);
-	token = malloc(sizeof(struct t_rename_token) + len + 1);
-	if (token != NULL) {
-		token->is_tag = is_tag;
-		token->value = p = (char *)(token + 1);
-		memcpy(p, value, len + 1);
-	}
-	return (token);
+	struct t_rename_dir *d, *victim;
+
+	assert(plan != NULL);
+	assert(path != NULL);
+
+	if ((d = t_rename_dir_find(plan, path)) == NULL)
+		return (-1);
+
+	if (d->fd != -1) {
+		/* hit, move it at the head of the LRU */
+		TAILQ_REMOVE(plan->open, d, entries);
+		TAILQ_INSERT_HEAD(plan->open, d, entries);
+		return (d->fd);
+	}
+	if (d->state == T_RENAME_DIR_MISSING && !create) {
+		errno = ENOENT;
+		return (-1);
+	}
+	if (d->state != T_RENAME_DIR_EXISTS && create) {
+		if (t_rename_mkdir(plan, d) == -1)
+			return (-1);
+	}
+
+	if (plan->opencount == T_RENAME_DIRFDS) {
+		victim = TAILQ_LAST(plan->open, t_rename_dirQ);
+		TAILQ_REMOVE(plan->open, victim, entries);
+		(void)close(victim->fd);
+		victim->fd = -1;
+		plan->opencount--;
+	}
+	d->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (d->fd == -1) {
+		if (errno == ENOENT)
+			d->state = T_RENAME_DIR_MISSING;
+		return (-1);
+	}
+	d->state = T_RENAME_DIR_EXISTS;
+	TAILQ_INSERT_HEAD(plan->open, d, entries);
+	plan->opencount++;
+
+	return (d->fd);
 }
 
 
-/*-
- * Copyright (c) 1983, 1992, 1993
- *	The Regents of the University of California.  All rights reserved.
- *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- * 1. Redistributions of source code must retain the above copyright
- *    notice, this list of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce the above copyright
- *    notice, this list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the distribution.
- * 4. Neither the name of the University nor the names of its contributors
- *    may be used to endorse or promote products derived from this software
- *    without specific prior written permission.
- *
- * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
- * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
- * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
- * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
- * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
- * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
- * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
- * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
- * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
- * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
- * SUCH DAMAGE.
- *
- * $FreeBSD: src/bin/mkdir/mkdir.c,v 1.33 2006/10/10 20:18:20 ru Exp $
- */
+static struct t_rename_dir *
+t_rename_dir_find(struct t_rename_plan *plan, const char *path)
+{
+	struct t_rename_dir *d, **slots;
+	size_t i, h, mask, capacity;
+
+	assert(plan != NULL);
+	assert(path != NULL);
+
+	/* grow the table when half full */
+	if (2 * (plan->dircount + 1) > plan->dircapacity) {
+		capacity = (plan->dircapacity == 0 ? 64 : 2 * plan->dircapacity);
+		slots = calloc(capacity, sizeof(*slots));
+		if (slots == NULL)
+			return (NULL);
+		for (i = 0; i < plan->dircapacity; i++) {
+			if ((d = plan->dirs[i]) == NULL)
+				continue;
+			mask = capacity - 1;
+			h = (size_t)t_strhash(d->path) & mask;
+			while (slots[h] != NULL)
+				h = (h + 1) & mask;
+			slots[h] = d;
+		}
+		free(plan->dirs);
+		plan->dirs        = slots;
+		plan->dircapacity = capacity;
+	}
+
+	mask = plan->dircapacity - 1;
+	for (i = (size_t)t_strhash(path) & mask; plan->dirs[i] != NULL;
+	    i = (i + 1) & mask) {
+		if (strcmp(plan->dirs[i]->path, path) == 0)
+			return (plan->dirs[i]);
+	}
+	if ((d = calloc(1, sizeof(struct t_rename_dir))) == NULL)
+		return (NULL);
+	if ((d->path = strdup(path)) == NULL) {
+		free(d);
+		return (NULL);
+	}
+	d->fd    = -1;
+	d->state = T_RENAME_DIR_UNKNOWN;
+	plan->dirs[i] = d;
+	plan->dircount++;
+
+	return (d);
+}
+
 
-/*
- * Returns 1 if a directory has been created,
- * 2 if it already existed, and 0 on failure.
- */
 static int
-build(char *path, mode_t omode)
+t_rename_mkdir(struct t_rename_plan *plan, struct t_rename_dir *d)
+{
+	struct t_rename_dir *parent;
+	char pdir[MAXPATHLEN];
+
+	assert(plan != NULL);
+	assert(d != NULL);
+
+	if (t_rename_split(d->path, pdir, sizeof(pdir)) == NULL)
+		return (-1);
+	/* "." and "/" are their own parent, and always exist */
+	if (strcmp(pdir, d->path) != 0) {
+		if ((parent = t_rename_dir_find(plan, pdir)) == NULL)
+			return (-1);
+		if (parent->state != T_RENAME_DIR_EXISTS &&
+		    t_rename_mkdir(plan, parent) == -1)
+			return (-1);
+	}
+
+	if (mkdir(d->path, S_IRWXU | S_IRWXG | S_IRWXO) == -1) {
+		if (errno != EEXIST)
+			return (-1);
+		/* open(2) will tell if it is not a directory */
+	}
+	d->state = T_RENAME_DIR_EXISTS;
+
+	return (0);
+}
+
+
+static void
+t_rename_dirs_clear(struct t_rename_plan *plan)
 {
-	struct stat sb;
-	mode_t numask, oumask;
-	int first, last, retval;
-	char *p;
-
-	p = path;
-	oumask = 0;
-	retval = 1;
-	if (p[0] == '/')		/* Skip leading '/'. */
-		++p;
-	for (first = 1, last = 0; !last ; ++p) {
-		if (p[0] == '\0')
-			last = 1;
-		else if (p[0] != '/')
+	size_t i;
+	struct t_rename_dir *d;
+
+	assert(plan != NULL);
+
+	for (i = 0; i < plan->dircapacity; i++) {
+		if ((d = plan->dirs[i]) == NULL)
 			continue;
-		*p = '\0';
-		if (!last && p[1] == '\0')
-			last = 1;
-		if (first) {
-			/*
-			 * POSIX 1003.2:
-			 * For each dir operand that does not name an existing
-			 * directory, effects equivalent to those caused by the
-			 * following command shall occcur:
-			 *
-			 * mkdir -p -m $(umask -S),u+wx $(dirname dir) &&
-			 *    mkdir [-m mode] dir
-			 *
-			 * We change the user's umask and then restore it,
-			 * instead of doing chmod's.
-			 */
-			oumask = umask(0);
-			numask = oumask & ~(S_IWUSR | S_IXUSR);
-			(void)umask(numask);
-			first = 0;
-		}
-		if (last)
-			(void)umask(oumask);
-		if (mkdir(path, last ? omode : S_IRWXU | S_IRWXG | S_IRWXO) < 0) {
-			if (errno == EEXIST || errno == EISDIR) {
-				if (stat(path, &sb) < 0) {
-					warn("build: %s", path);
-					retval = 0;
-					break;
-				} else if (!S_ISDIR(sb.st_mode)) {
-					if (last)
-						errno = EEXIST;
-					else
-						errno = ENOTDIR;
-					retval = 0;
-					break;
-				}
-				if (last)
-					retval = 2;
-			} else {
-				retval = 0;
-				break;
-			}
+		if (d->fd != -1)
+			(void)close(d->fd);
+		free(d->path);
+		free(d);
+		plan->dirs[i] = NULL;
+	}
+	plan->dircount  = 0;
+	plan->opencount = 0;
+	TAILQ_INIT(plan->open);
+}
+
+
+static const char *
+t_rename_split(const char *path, char *dir, size_t dirsize)
+{
+	const char *s;
+
+	assert(path != NULL);
+	assert(dir != NULL);
+
+	if ((s = t_dirname(path)) == NULL) {
+		warn("dirname");
+		return (NULL);
+	}
+	if (strlcpy(dir, s, dirsize) >= dirsize) {
+		warnx("path exceeding MAXPATHLEN");
+		return (NULL);
+	}
+
+	s = strrchr(path, '/');
+	return (s == NULL ? path : s + 1);
+}
+
+
+static char *
+t_rename_tmp(const char *path)
+{
+	static unsigned int serial = 0;
+	char dir[MAXPATHLEN], *tmp;
+	int i;
+
+	assert(path != NULL);
+
+	if (t_rename_split(path, dir, sizeof(dir)) == NULL)
+		return (NULL);
+
+	/* the pid avoid most clashes with concurrent runs */
+	for (i = 0; i < 100; i++) {
+		if (asprintf(&tmp, "%s/.tagutil-%ld-%u", dir, (long)getpid(),
+		    serial++) < 0) {
+			warn("malloc");
+			return (NULL);
 		}
-		if (!last)
-		    *p = '/';
+		if (t_rename_noreplace(AT_FDCWD, path, AT_FDCWD, tmp) == 0)
+			return (tmp);
+		free(tmp);
+		if (errno != EEXIST)
+			break;
+	}
+	warn("%s: could not move to a temporary name", path);
+	return (NULL);
+}
+
+
+static int
+t_rename_noreplace(int fromfd, const char *from, int tofd, const char *to)
+{
+	struct stat st;
+
+	assert(from != NULL);
+	assert(to != NULL);
+
+#if defined(HAS_RENAMEAT2)
+	if (renameat2(fromfd, from, tofd, to, RENAME_NOREPLACE) == 0)
+		return (0);
+	/* RENAME_NOREPLACE is not supported by every file system */
+	if (errno != EINVAL && errno != ENOSYS)
+		return (-1);
+#endif
+	/* not atomic, but better than nothing */
+	if (fstatat(tofd, to, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+		errno = EEXIST;
+		return (-1);
+	} else if (errno != ENOENT)
+		return (-1);
+
+	return (renameat(fromfd, from, tofd, to));
+}
+
+
+static int
+t_rename_entry_filecmp(const void *va, const void *vb)
+{
+	const struct t_rename_entry *a, *b;
+
+	assert(va != NULL);
+	assert(vb != NULL);
+
+	a = *(struct t_rename_entry * const *)va;
+	b = *(struct t_rename_entry * const *)vb;
+	if (a->dev != b->dev)
+		return (a->dev < b->dev ? -1 : 1);
+	if (a->ino != b->ino)
+		return (a->ino < b->ino ? -1 : 1);
+	return (0);
+}
+
+
+static int
+t_rename_entry_filesort(const void *va, const void *vb)
+{
+	const struct t_rename_entry *a, *b;
+	int cmp;
+
+	assert(va != NULL);
+	assert(vb != NULL);
+
+	a = *(struct t_rename_entry * const *)va;
+	b = *(struct t_rename_entry * const *)vb;
+	cmp = t_rename_entry_filecmp(va, vb);
+	if (cmp == 0 && a != b)
+		/* same array, so this is the plan order */
+		cmp = (a < b ? -1 : 1);
+	return (cmp);
+}
+
+
+static int
+t_rename_entry_npathsort(const void *va, const void *vb)
+{
+	const struct t_rename_entry *a, *b;
+	int cmp;
+
+	assert(va != NULL);
+	assert(vb != NULL);
+
+	a = *(struct t_rename_entry * const *)va;
+	b = *(struct t_rename_entry * const *)vb;
+	cmp = strcmp(a->npath, b->npath);
+	if (cmp == 0 && a != b)
+		/* same array, so this is the plan order */
+		cmp = (a < b ? -1 : 1);
+	return (cmp);
+}
+
+
+static int
+t_rename_emit(struct sbuf *ops, struct sbuf *pool, int code, struct sbuf *str)
+{
+	struct t_rename_op op;
+	const char *c;
+
+	assert(ops != NULL);
+	assert(pool != NULL);
+	assert(str != NULL);
+
+	if (sbuf_finish(str) == -1)
+		return (-1);
+
+	memset(&op, 0, sizeof(op));
+	op.code = code;
+	op.len  = (size_t)sbuf_len(str);
+	op.str  = (size_t)sbuf_len(pool);
+	(void)sbuf_bcat(pool, sbuf_data(str), op.len + 1);
+	op.key  = (size_t)sbuf_len(pool);
+	if (code == T_RENAME_OP_TAG) {
+		for (c = sbuf_data(str); *c != '\0'; c++)
+			(void)sbuf_putc(pool, tolower((unsigned char)*c));
 	}
-	if (!first && !last)
-		(void)umask(oumask);
-	return (retval);
+	(void)sbuf_putc(pool, '\0');
+	(void)sbuf_bcat(ops, &op, sizeof(op));
+
+	return (sbuf_len(ops) < 0 || sbuf_len(pool) < 0 ? -1 : 0);
 }
@@ -9,12 +9,24 @@
 #include "t_tune.h"
 
 
+/* maximum number of directories kept open by a rename plan */
+#define	T_RENAME_DIRFDS	64
+
 /* declaration of a rename pattern type */
 struct t_rename_pattern;
+/* declaration of a rename plan type */
+struct t_rename_plan;
+
+/*
+ * called by t_rename_plan_run() for each file of the plan, renamed is 0 when
+ * the file was not renamed (error, duplicate or not confirmed).
+ */
+typedef void	t_rename_report(const char *opath, const char *npath,
+		    int renamed, void *arg);
 
 
 /*
- * create a pattern usable for t_rename().
+ * create a pattern usable for t_rename_plan_new().
  *
  * The tag keys in pattern should look like shell variables (%artist or/and
  * %{album}). If the tag key is not defined for a file, the tag key is replaced
@@ -27,21 +39,69 @@ struct t_rename_pattern;
 struct t_rename_pattern	*t_rename_parse(const char *pattern);
 
 /*
- * rename the given file (tune) using pattern.
+ * create a rename plan for pattern (see t_rename_parse()).
  *
- * This routine will require user confirmation unless the Yflag or Nflag was
- * set.
+ * The files added to the plan are not renamed until t_rename_plan_run() is
+ * called, so that the whole plan can be checked and confirmed at once.
  *
- * @param tune
- *   The file to rename.
+ * @return
+ *   a new plan or NULL on error, in which case errno is set to EINVAL (bad
+ *   pattern) or ENOMEM. The plan has to be given to t_rename_plan_delete()
+ *   after use.
+ */
+struct t_rename_plan	*t_rename_plan_new(const char *pattern);
+
+/*
+ * add the given file (tune) to the plan, evaluating the pattern against its
+ * tags. Nothing is added when the file would keep its name.
  *
- * @param pattern
- *   The pattern for the new filename.
+ * The file is only a candidate until t_rename_plan_commit() is called, so
+ * that it is not renamed if its tags could not be saved.
  *
  * @return
  *   -1 on error, 0 on success.
  */
-int	t_rename(struct t_tune *tune, const struct t_rename_pattern *pattern);
+int	t_rename_plan_add(struct t_rename_plan *plan, struct t_tune *tune);
+
+/*
+ * keep (when keep is not 0) or drop the candidate added by the last call to
+ * t_rename_plan_add(), if any.
+ *
+ * @return
+ *   1 if a rename was kept in the plan, 0 otherwise.
+ */
+int	t_rename_plan_commit(struct t_rename_plan *plan, int keep);
+
+/*
+ * check and carry out the renames of the plan, which is emptied.
+ *
+ * Files that would be renamed to the same path, or to an existing file which
+ * is not renamed itself, are reported and left untouched. Renames are ordered
+ * so that a file is only renamed once its destination has been freed, cycles
+ * (like a swap) going through a temporary name. The whole plan require a
+ * single user confirmation unless the Yflag or Nflag was set.
+ *
+ * A rename never replace an existing file, so that concurrent runs can not
+ * overwrite each other's files.
+ *
+ * The directories involved are looked up (and created when the pflag is set)
+ * once per run, and kept open (up to T_RENAME_DIRFDS) to rename relative to
+ * them.
+ *
+ * @param report
+ *   If not NULL, called with arg for each file once the renames are done, in
+ *   the order they were added to the plan.
+ *
+ * @return
+ *   -1 if a file could not be renamed, 0 on success.
+ */
+int	t_rename_plan_run(struct t_rename_plan *plan, t_rename_report *report,
+	    void *arg);
+
+/*
+ * free all memory associated with a plan (the pending renames are dropped).
+ */
+void	t_rename_plan_delete(struct t_rename_plan *plan);
 
 /*
  * free all memory associated with a pattern.
@@ -0,0 +1,360 @@
+/*
+ * t_rewrite.c
+ *
+ * full file rewrite helper for the backends.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(HAS_FICLONERANGE)
+#	include <sys/ioctl.h>
+#	include <linux/fs.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "t_config.h"
+#include "t_toolkit.h"
+#include "t_rewrite.h"
+
+
+static int	t_rewrite_tmpfile(struct t_rewrite *rw, mode_t mode);
+static int	t_rewrite_link(struct t_rewrite *rw);
+static int	t_rewrite_clone(struct t_rewrite *rw, off_t in, off_t out);
+static int	t_rewrite_kcopy(struct t_rewrite *rw, off_t *in, off_t *out);
+static int	t_rewrite_ucopy(struct t_rewrite *rw, off_t in, off_t out, off_t end);
+
+
+int
+t_rewrite_open(struct t_rewrite *rw, const char *path)
+{
+	struct stat st;
+
+	assert(rw != NULL);
+	assert(path != NULL);
+
+	rw->path     = path;
+	rw->tempfile = NULL;
+	rw->fd_in    = -1;
+	rw->fd_out   = -1;
+	rw->blksize  = 1;
+
+	if ((rw->fd_in = open(path, O_RDONLY)) == -1)
+		goto error;
+	if (fstat(rw->fd_in, &st) == -1)
+		goto error;
+	rw->size = st.st_size;
+#if defined(HAS_POSIX_FADVISE)
+	(void)posix_fadvise(rw->fd_in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	/* prefer an unnamed file, see t_rewrite_tmpfile() */
+	if (t_rewrite_tmpfile(rw, st.st_mode & 07777) == -1) {
+		if (asprintf(&rw->tempfile, "%s/.__%s_XXXXXX", t_dirname(path), getprogname()) < 0) {
+			rw->tempfile = NULL;
+			goto error;
+		}
+		if ((rw->fd_out = mkstemps(rw->tempfile, 0)) == -1)
+			goto error;
+	}
+	/* the new file is created with 0600 (or the umask applied), keep the
+	   original mode */
+	if (fchmod(rw->fd_out, st.st_mode & 07777) == -1)
+		goto error;
+#if defined(HAS_FICLONERANGE)
+	/* both files are in the same directory, thus on the same filesystem */
+	if (fstat(rw->fd_out, &st) == -1)
+		goto error;
+	if (st.st_blksize > 1)
+		rw->blksize = st.st_blksize;
+#endif
+#if defined(HAS_POSIX_FADVISE)
+	(void)posix_fadvise(rw->fd_out, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	return (0);
+error:
+	t_rewrite_abort(rw);
+	return (-1);
+}
+
+
+off_t
+t_rewrite_align(const struct t_rewrite *rw, off_t in, off_t out)
+{
+	off_t d;
+
+	assert(rw != NULL);
+
+	d = (in - out) % rw->blksize;
+	return (d < 0 ? d + rw->blksize : d);
+}
+
+
+void
+t_rewrite_reserve(struct t_rewrite *rw, off_t len)
+{
+	assert(rw != NULL);
+
+#if defined(HAS_FALLOCATE)
+	/* only a hint, errors (i.e. unsupported by the filesystem) are
+	   ignored */
+	if (len > 0)
+		(void)fallocate(rw->fd_out, FALLOC_FL_KEEP_SIZE, 0, len);
+#else
+	(void)len;
+#endif
+}
+
+
+int
+t_rewrite_copy(struct t_rewrite *rw, off_t from)
+{
+	off_t out, head;
+
+	assert(rw != NULL);
+	assert(rw->fd_out != -1);
+
+	if ((out = lseek(rw->fd_out, 0, SEEK_CUR)) == -1)
+		return (-1);
+	if (from >= rw->size)
+		return (0);
+
+	if (rw->blksize > 1 && t_rewrite_align(rw, from, out) == 0) {
+		/* copy up to the first block boundary, then share the
+		   remaining blocks. */
+		head = (rw->blksize - from % rw->blksize) % rw->blksize;
+		if (head > rw->size - from)
+			head = rw->size - from;
+		if (t_rewrite_ucopy(rw, from, out, from + head) == -1)
+			return (-1);
+		from += head;
+		out  += head;
+		if (from == rw->size || t_rewrite_clone(rw, from, out) == 0)
+			return (0);
+	}
+
+	if (t_rewrite_kcopy(rw, &from, &out) == 0)
+		return (0);
+	/* copy_file_range(2) is unsupported (or failed midway), continue with
+	   a read / write loop. */
+#if defined(HAS_FALLOCATE)
+	(void)fallocate(rw->fd_out, FALLOC_FL_KEEP_SIZE, out, rw->size - from);
+#endif
+	return (t_rewrite_ucopy(rw, from, out, rw->size));
+}
+
+
+int
+t_rewrite_commit(struct t_rewrite *rw)
+{
+	int ret;
+
+	assert(rw != NULL);
+	assert(rw->fd_out != -1);
+
+	/* an unnamed file has to be linked into the directory first */
+	ret = (rw->tempfile == NULL ? t_rewrite_link(rw) : 0);
+	if (close(rw->fd_out) == -1)
+		ret = -1;
+	rw->fd_out = -1;
+	if (ret == 0)
+		ret = rename(rw->tempfile, rw->path);
+	if (ret == -1 && rw->tempfile != NULL)
+		(void)unlink(rw->tempfile);
+	t_rewrite_abort(rw);
+
+	return (ret);
+}
+
+
+void
+t_rewrite_abort(struct t_rewrite *rw)
+{
+	assert(rw != NULL);
+
+	if (rw->fd_out != -1) {
+		(void)close(rw->fd_out);
+		/* an unnamed file vanish on close */
+		if (rw->tempfile != NULL)
+			(void)unlink(rw->tempfile);
+		rw->fd_out = -1;
+	}
+	free(rw->tempfile);
+	rw->tempfile = NULL;
+	if (rw->fd_in != -1) {
+		(void)close(rw->fd_in);
+		rw->fd_in = -1;
+	}
+}
+
+
+/*
+ * create an unnamed file (O_TMPFILE) in the directory of the file to rewrite.
+ *
+ * Unlike a mkstemps(3) file it is not visible in the directory while being
+ * written (so directory watchers don't see it) and it doesn't stay behind
+ * when tagutil is interrupted. It is given a name only by
+ * t_rewrite_commit(), just before being renamed over the original file.
+ *
+ * linkat(2) can only link an unnamed file without privilege through its
+ * /proc/self/fd entry, so /proc must be available.
+ */
+static int
+t_rewrite_tmpfile(struct t_rewrite *rw, mode_t mode)
+{
+#if defined(HAS_O_TMPFILE)
+	assert(rw != NULL);
+	assert(rw->tempfile == NULL);
+
+	if (eaccess("/proc/self/fd", X_OK) == -1)
+		return (-1);
+	rw->fd_out = open(t_dirname(rw->path), O_TMPFILE | O_WRONLY, mode);
+	return (rw->fd_out == -1 ? -1 : 0);
+#else
+	(void)rw;
+	(void)mode;
+	return (-1);
+#endif
+}
+
+
+/*
+ * give a temporary name to the unnamed file created by t_rewrite_tmpfile().
+ */
+static int
+t_rewrite_link(struct t_rewrite *rw)
+{
+#if defined(HAS_O_TMPFILE)
+	char fdpath[32];
+	unsigned i;
+
+	assert(rw != NULL);
+	assert(rw->tempfile == NULL);
+
+	(void)snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", rw->fd_out);
+	/* linkat(2) can't replace an existing file, try a few names */
+	for (i = 0; i < 16; i++) {
+		if (asprintf(&rw->tempfile, "%s/.__%s_%ld_%u", t_dirname(rw->path),
+		    getprogname(), (long)getpid(), i) < 0) {
+			rw->tempfile = NULL;
+			return (-1);
+		}
+		if (linkat(AT_FDCWD, fdpath, AT_FDCWD, rw->tempfile, AT_SYMLINK_FOLLOW) == 0)
+			return (0);
+		free(rw->tempfile);
+		rw->tempfile = NULL;
+		if (errno != EEXIST)
+			break;
+	}
+	return (-1);
+#else
+	(void)rw;
+	return (-1);
+#endif
+}
+
+
+/*
+ * share the blocks of the original file from in up to its end. Both in and
+ * out must be multiples of rw->blksize.
+ */
+static int
+t_rewrite_clone(struct t_rewrite *rw, off_t in, off_t out)
+{
+#if defined(HAS_FICLONERANGE)
+	struct file_clone_range fcr;
+
+	assert(rw != NULL);
+
+	fcr.src_fd      = rw->fd_in;
+	fcr.src_offset  = (uint64_t)in;
+	fcr.src_length  = 0; /* up to the end of the file */
+	fcr.dest_offset = (uint64_t)out;
+	return (ioctl(rw->fd_out, FICLONERANGE, &fcr) == -1 ? -1 : 0);
+#else
+	(void)rw;
+	(void)in;
+	(void)out;
+	return (-1);
+#endif
+}
+
+
+/*
+ * copy the original file from *in up to its end, using copy_file_range(2).
+ * On error, *in and *out are the offsets where the copy stopped.
+ */
+static int
+t_rewrite_kcopy(struct t_rewrite *rw, off_t *in, off_t *out)
+{
+#if defined(HAS_COPY_FILE_RANGE)
+	ssize_t n;
+
+	assert(rw != NULL);
+	assert(in != NULL);
+	assert(out != NULL);
+
+	while (*in < rw->size) {
+		n = copy_file_range(rw->fd_in, in, rw->fd_out, out,
+		    (size_t)(rw->size - *in), 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (-1);
+	}
+	return (0);
+#else
+	(void)rw;
+	(void)in;
+	(void)out;
+	return (-1);
+#endif
+}
+
+
+/*
+ * copy the original file from in to end through a T_REWRITE_BUFSIZE buffer.
+ */
+static int
+t_rewrite_ucopy(struct t_rewrite *rw, off_t in, off_t out, off_t end)
+{
+	char *buf, *p;
+	size_t len;
+	ssize_t r, w;
+	int ret = -1;
+
+	assert(rw != NULL);
+
+	if (in >= end)
+		return (0);
+	len = (end - in < T_REWRITE_BUFSIZE ? (size_t)(end - in) : T_REWRITE_BUFSIZE);
+	if ((buf = malloc(len)) == NULL)
+		return (-1);
+	while (in < end) {
+		if ((size_t)(end - in) < len)
+			len = (size_t)(end - in);
+		r = pread(rw->fd_in, buf, len, in);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			goto cleanup;
+		in += r;
+		for (p = buf; r > 0; p += w, r -= w, out += w) {
+			w = pwrite(rw->fd_out, p, (size_t)r, out);
+			if (w == -1 && errno == EINTR)
+				w = 0;
+			else if (w <= 0)
+				goto cleanup;
+		}
+	}
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	free(buf);
+	return (ret);
+}
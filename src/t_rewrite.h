@@ -0,0 +1,106 @@
+#ifndef T_REWRITE_H
+#define T_REWRITE_H
+/*
+ * t_rewrite.h
+ *
+ * full file rewrite helper for the backends.
+ *
+ * When the new tags don't fit in the file, the backend write the new header
+ * region into a temporary file and then let t_rewrite_copy() append the
+ * unchanged part of the original file (usually the audio data). This part is
+ * shared with the original file when the filesystem support it (reflink), or
+ * copied by the kernel. Finally t_rewrite_commit() replace the original file
+ * by the temporary one.
+ *
+ * When supported, the temporary file is created unnamed (O_TMPFILE) and only
+ * linked into the directory on commit, so that nothing is left behind if
+ * tagutil is interrupted.
+ */
+#include <sys/types.h>
+
+#include "t_config.h"
+
+
+/*
+ * size of the I/O buffers used by backends when a file has to be rewritten.
+ * Can be set at build time, see the T_REWRITE_BUFSIZE CMake variable.
+ */
+#if !defined(T_REWRITE_BUFSIZE)
+#	define	T_REWRITE_BUFSIZE	(1024 * 1024)
+#endif
+
+struct t_rewrite {
+	const char	*path;     /* the file to rewrite */
+	char		*tempfile; /* the new file, renamed to path on commit.
+	                              NULL while the new file is unnamed */
+	int		 fd_in;    /* opened read only on path */
+	int		 fd_out;   /* opened write only on tempfile */
+	off_t		 size;     /* size of the original file */
+	off_t		 blksize;  /* alignment required to share blocks, 1 if
+	                              unsupported */
+};
+
+/*
+ * start the rewrite of a file.
+ *
+ * @param rw
+ *   The rewrite to initialize.
+ *
+ * @param path
+ *   The file to rewrite. It is not copied and must remain valid until
+ *   t_rewrite_commit() or t_rewrite_abort() is called.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_rewrite_open(struct t_rewrite *rw, const char *path);
+
+/*
+ * compute how many bytes must be added to the new file so that a copy from
+ * offset in (in the original file) to offset out (in the new file) can share
+ * the blocks of the original file.
+ *
+ * @return
+ *   A value between 0 and rw->blksize - 1.
+ */
+off_t	t_rewrite_align(const struct t_rewrite *rw, off_t in, off_t out);
+
+/*
+ * hint the expected size of the new file, so that its blocks can be reserved
+ * at once. Should be used when the new file is written without
+ * t_rewrite_copy().
+ */
+void	t_rewrite_reserve(struct t_rewrite *rw, off_t len);
+
+/*
+ * copy the original file, from the given offset up to its end, at the
+ * current offset of rw->fd_out.
+ *
+ * The blocks are shared with the original file (FICLONERANGE) when possible,
+ * see t_rewrite_align(). Otherwise they are copied by copy_file_range(2) or a
+ * read / write loop as last resort.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_rewrite_copy(struct t_rewrite *rw, off_t from);
+
+/*
+ * replace the original file by the new one.
+ *
+ * After this function return, rw must not be used anymore (but can be given
+ * to t_rewrite_abort()).
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_rewrite_commit(struct t_rewrite *rw);
+
+/*
+ * remove the new file and release all the resources associated with rw.
+ *
+ * This is a no-op if rw has already been committed or aborted.
+ */
+void	t_rewrite_abort(struct t_rewrite *rw);
+
+#endif /* ndef T_REWRITE_H */
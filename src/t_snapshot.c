@@ -0,0 +1,449 @@
+/*
+ * t_snapshot.c
+ *
+ * snapshot of the tags of the processed files.
+ *
+ * The snapshot file layout is a header followed by the entries sorted by path
+ * hash. Integers are stored in native byte order, like the cache file. The
+ * whole file is loaded in memory by t_snapshot_open(), and t_snapshot_close()
+ * write a new one merging the recorded entries with the loaded ones.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "t_config.h"
+#include "t_toolkit.h"
+#include "t_taglist.h"
+#include "t_tune.h"
+#include "t_snapshot.h"
+
+
+#define	T_SNAPSHOT_MAGIC	"tagsnap"
+#define	T_SNAPSHOT_VERSION	1
+
+struct t_snapshot_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	count;	/* number of entries */
+};
+
+struct t_snapshot_entry {
+	uint64_t	phash;	/* t_strhash() of the path */
+	int64_t		size;
+	int64_t		mtime_sec;
+	int64_t		mtime_nsec;
+	uint8_t		digest[T_TAGLIST_DIGEST_SIZE];
+};
+
+/* a recorded entry */
+struct t_snapshot_record {
+	struct t_snapshot_entry	e;
+	size_t			seq;	/* t_snapshot_record() call order */
+	int			forget;	/* 1 to drop the entry (only e.phash) */
+};
+
+static struct {
+	char	*path;
+	int	 existed;
+	struct t_snapshot_entry	*entries; /* from the snapshot file */
+	size_t	 count;
+	struct t_snapshot_record *stored;
+	size_t	 nstored;
+	size_t	 capacity;
+	/* the last file compared by t_snapshot_check() */
+	struct t_snapshot_entry	 last;
+	int	 lastvalid;
+} t_snapshot;
+
+
+static int	t_snapshot_load(int fd, const struct stat *st);
+static void	t_snapshot_key(struct t_snapshot_entry *e, const char *path,
+		    const struct stat *sb);
+static int	t_snapshot_digest(const char *path,
+		    uint8_t digest[T_TAGLIST_DIGEST_SIZE]);
+static int	t_snapshot_store(const struct t_snapshot_entry *e, int forget);
+static int	t_snapshot_cmp(const void *va, const void *vb);
+static int	t_snapshot_seqcmp(const void *va, const void *vb);
+
+
+int
+t_snapshot_open(const char *path)
+{
+	struct stat st;
+	int fd, status;
+
+	assert(path != NULL);
+	assert(t_snapshot.path == NULL);
+
+	if ((t_snapshot.path = strdup(path)) == NULL)
+		return (-1);
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno == ENOENT)
+			return (0); /* empty snapshot */
+		goto error;
+	}
+	t_snapshot.existed = 1;
+	status = (fstat(fd, &st) == -1 ? -1 : t_snapshot_load(fd, &st));
+	(void)close(fd);
+	if (status == -1)
+		goto error;
+
+	return (0);
+error:
+	free(t_snapshot.path);
+	t_snapshot.path = NULL;
+	return (-1);
+}
+
+
+int
+t_snapshot_check(const char *path)
+{
+	struct t_snapshot_entry key;
+	const struct t_snapshot_entry *e;
+	struct stat sb;
+
+	assert(path != NULL);
+
+	t_snapshot.lastvalid = 0;
+	if (t_snapshot.path == NULL)
+		return (T_SNAPSHOT_CHANGED);
+	if (stat(path, &sb) == -1) {
+		if (errno == ENOENT && t_snapshot_forget(path) == -1)
+			err(EXIT_FAILURE, "malloc");
+		return (T_SNAPSHOT_CHANGED);
+	}
+
+	t_snapshot_key(&key, path, &sb);
+	e = bsearch(&key, t_snapshot.entries, t_snapshot.count,
+	    sizeof(struct t_snapshot_entry), t_snapshot_cmp);
+	if (e != NULL && e->size == key.size &&
+	    e->mtime_sec == key.mtime_sec && e->mtime_nsec == key.mtime_nsec)
+		return (T_SNAPSHOT_UNCHANGED);
+
+	if (t_snapshot_digest(path, key.digest) == -1)
+		return (T_SNAPSHOT_CHANGED);
+	t_snapshot.last      = key;
+	t_snapshot.lastvalid = 1;
+	if (e == NULL || memcmp(e->digest, key.digest, sizeof(key.digest)) != 0)
+		return (T_SNAPSHOT_CHANGED);
+
+	/* only the audio (or anything but the tags) changed */
+	if (t_snapshot_store(&key, 0) == -1)
+		err(EXIT_FAILURE, "malloc");
+	return (T_SNAPSHOT_MODIFIED);
+}
+
+
+int
+t_snapshot_record(const char *path, const struct stat *sb)
+{
+	struct t_snapshot_entry e;
+
+	assert(path != NULL);
+	assert(sb != NULL);
+
+	if (t_snapshot.path == NULL)
+		return (0);
+
+	t_snapshot_key(&e, path, sb);
+	if (t_snapshot.lastvalid && t_snapshot.last.phash == e.phash &&
+	    t_snapshot.last.size == e.size &&
+	    t_snapshot.last.mtime_sec  == e.mtime_sec &&
+	    t_snapshot.last.mtime_nsec == e.mtime_nsec) {
+		/* the actions did not modify the file */
+		(void)memcpy(e.digest, t_snapshot.last.digest, sizeof(e.digest));
+	} else if (t_snapshot_digest(path, e.digest) == -1) {
+		/* renamed or not readable anymore, it will show up as changed
+		   on the next run */
+		return (0);
+	}
+
+	return (t_snapshot_store(&e, 0));
+}
+
+
+int
+t_snapshot_forget(const char *path)
+{
+	struct t_snapshot_entry e;
+
+	assert(path != NULL);
+
+	if (t_snapshot.path == NULL)
+		return (0);
+
+	bzero(&e, sizeof(e));
+	e.phash = t_strhash(path);
+	return (t_snapshot_store(&e, 1));
+}
+
+
+int
+t_snapshot_close(void)
+{
+	struct t_snapshot_header h;
+	struct t_snapshot_entry *out = NULL;
+	size_t i, j, n;
+	char *tempfile = NULL;
+	FILE *fp = NULL;
+	int fd, k, ret = -1;
+
+	if (t_snapshot.path == NULL)
+		return (0);
+	if (t_snapshot.nstored == 0 && t_snapshot.existed) {
+		ret = 0;
+		goto cleanup;
+	}
+
+	/*
+	 * sort the stored entries, keeping only the last one for each file. A
+	 * recorded entry wins over a forgotten one, since a file may be renamed
+	 * to the old path of another (see t_snapshot_forget()).
+	 */
+	qsort(t_snapshot.stored, t_snapshot.nstored,
+	    sizeof(struct t_snapshot_record), t_snapshot_seqcmp);
+	for (i = n = 0; i < t_snapshot.nstored; i = j) {
+		size_t last = i;
+		for (j = i + 1; j < t_snapshot.nstored &&
+		    t_snapshot.stored[j].e.phash == t_snapshot.stored[i].e.phash;
+		    j++) {
+			if (!t_snapshot.stored[j].forget ||
+			    t_snapshot.stored[last].forget)
+				last = j;
+		}
+		t_snapshot.stored[n++] = t_snapshot.stored[last];
+	}
+	t_snapshot.nstored = n;
+
+	/* merge them with the snapshot file entries */
+	out = calloc(t_snapshot.count + t_snapshot.nstored + 1,
+	    sizeof(struct t_snapshot_entry));
+	if (out == NULL)
+		goto cleanup;
+	i = j = n = 0;
+	while (i < t_snapshot.count || j < t_snapshot.nstored) {
+		int cmp;
+		if (i == t_snapshot.count)
+			cmp = 1;
+		else if (j == t_snapshot.nstored)
+			cmp = -1;
+		else
+			cmp = t_snapshot_cmp(&t_snapshot.entries[i],
+			    &t_snapshot.stored[j].e);
+		if (cmp < 0) {
+			out[n++] = t_snapshot.entries[i++];
+		} else {
+			if (cmp == 0) /* replaced or dropped */
+				i++;
+			if (!t_snapshot.stored[j].forget)
+				out[n++] = t_snapshot.stored[j].e;
+			j++;
+		}
+	}
+
+	/* write the new snapshot file next to the old one and replace it */
+	if (asprintf(&tempfile, "%s.XXXXXX", t_snapshot.path) < 0) {
+		tempfile = NULL;
+		goto cleanup;
+	}
+	if ((fd = mkstemp(tempfile)) == -1)
+		goto cleanup;
+	if (t_fchmod_umask(fd) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		(void)close(fd);
+		goto cleanup;
+	}
+	bzero(&h, sizeof(h));
+	(void)memcpy(h.magic, T_SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = T_SNAPSHOT_VERSION;
+	h.count   = (uint32_t)n;
+	if (fwrite(&h, sizeof(h), 1, fp) != 1 ||
+	    fwrite(out, sizeof(struct t_snapshot_entry), n, fp) != n)
+		goto cleanup;
+	k = fclose(fp);
+	fp = NULL;
+	if (k != 0)
+		goto cleanup;
+	if (rename(tempfile, t_snapshot.path) == -1)
+		goto cleanup;
+	free(tempfile);
+	tempfile = NULL;
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	if (ret == -1)
+		warn("%s", t_snapshot.path);
+	if (fp != NULL)
+		(void)fclose(fp);
+	if (tempfile != NULL) {
+		(void)unlink(tempfile);
+		free(tempfile);
+	}
+	free(out);
+	free(t_snapshot.stored);
+	free(t_snapshot.entries);
+	free(t_snapshot.path);
+	bzero(&t_snapshot, sizeof(t_snapshot));
+	return (ret);
+}
+
+
+/*
+ * read the snapshot file entries.
+ *
+ * @return
+ *   -1 on error, 0 on success (an invalid snapshot file is empty).
+ */
+static int
+t_snapshot_load(int fd, const struct stat *st)
+{
+	struct t_snapshot_header h;
+	size_t size;
+	ssize_t n;
+
+	assert(fd != -1);
+	assert(st != NULL);
+
+	n = read(fd, &h, sizeof(h));
+	if (n == -1)
+		return (-1);
+	if (n == 0)
+		return (0);
+	if ((size_t)n != sizeof(h) ||
+	    memcmp(h.magic, T_SNAPSHOT_MAGIC, sizeof(h.magic)) != 0 ||
+	    h.version != T_SNAPSHOT_VERSION ||
+	    (uintmax_t)st->st_size != sizeof(h) +
+	    (uintmax_t)h.count * sizeof(struct t_snapshot_entry)) {
+		/* start over, the file will be replaced on t_snapshot_close() */
+		warnx("%s: invalid snapshot file, ignored", t_snapshot.path);
+		t_snapshot.existed = 0;
+		return (0);
+	}
+
+	size = h.count * sizeof(struct t_snapshot_entry);
+	if ((t_snapshot.entries = malloc(size + 1)) == NULL)
+		return (-1);
+	n = read(fd, t_snapshot.entries, size);
+	if (n == -1 || (size_t)n != size) {
+		if (n != -1)
+			errno = EIO;
+		free(t_snapshot.entries);
+		t_snapshot.entries = NULL;
+		return (-1);
+	}
+	t_snapshot.count = h.count;
+
+	return (0);
+}
+
+
+/*
+ * fill the path hash, size and modification time fields of e.
+ */
+static void
+t_snapshot_key(struct t_snapshot_entry *e, const char *path,
+    const struct stat *sb)
+{
+
+	assert(e != NULL);
+	assert(path != NULL);
+	assert(sb != NULL);
+
+	bzero(e, sizeof(struct t_snapshot_entry));
+	e->phash      = t_strhash(path);
+	e->size       = (int64_t)sb->st_size;
+	e->mtime_sec  = (int64_t)sb->st_mtim.tv_sec;
+	e->mtime_nsec = (int64_t)sb->st_mtim.tv_nsec;
+}
+
+
+/*
+ * compute the tags digest of the file at path.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+static int
+t_snapshot_digest(const char *path, uint8_t digest[T_TAGLIST_DIGEST_SIZE])
+{
+	struct t_tune *tune;
+	struct t_taglist *tlist = NULL;
+	int status = -1;
+
+	assert(path != NULL);
+
+	if ((tune = t_tune_new(path)) == NULL)
+		return (-1);
+	if ((tlist = t_tune_tags(tune)) != NULL)
+		status = t_taglist_digest(tlist, digest);
+	t_taglist_delete(tlist);
+	t_tune_delete(tune);
+
+	return (status);
+}
+
+
+static int
+t_snapshot_store(const struct t_snapshot_entry *e, int forget)
+{
+	struct t_snapshot_record *r;
+	size_t capacity;
+
+	assert(e != NULL);
+
+	if (t_snapshot.nstored == t_snapshot.capacity) {
+		capacity = (t_snapshot.capacity == 0 ? 1024 :
+		    2 * t_snapshot.capacity);
+		r = realloc(t_snapshot.stored, capacity * sizeof(*r));
+		if (r == NULL)
+			return (-1);
+		t_snapshot.stored   = r;
+		t_snapshot.capacity = capacity;
+	}
+	r = &t_snapshot.stored[t_snapshot.nstored];
+	r->e      = *e;
+	r->forget = forget;
+	r->seq    = t_snapshot.nstored++;
+
+	return (0);
+}
+
+
+/* compare the path hash */
+static int
+t_snapshot_cmp(const void *va, const void *vb)
+{
+	const struct t_snapshot_entry *a = va, *b = vb;
+
+	assert(a != NULL);
+	assert(b != NULL);
+
+	if (a->phash != b->phash)
+		return (a->phash < b->phash ? -1 : 1);
+	return (0);
+}
+
+
+/* compare the path hash, and then the t_snapshot_record() call order */
+static int
+t_snapshot_seqcmp(const void *va, const void *vb)
+{
+	const struct t_snapshot_record *a = va, *b = vb;
+	int cmp;
+
+	assert(a != NULL);
+	assert(b != NULL);
+
+	if ((cmp = t_snapshot_cmp(&a->e, &b->e)) != 0)
+		return (cmp);
+	return (a->seq < b->seq ? -1 : (a->seq > b->seq));
+}
@@ -0,0 +1,78 @@
+#ifndef T_SNAPSHOT_H
+#define T_SNAPSHOT_H
+/*
+ * t_snapshot.h
+ *
+ * snapshot of the tags of the processed files (see the -c option), to only
+ * process the files whose tags changed since the previous run.
+ *
+ * The snapshot file map a hash of each file path to its size, modification
+ * time and tags digest (see t_taglist_digest()). The tags of a file whose
+ * size and modification time did not change are not read at all. The entries
+ * of the files found missing by t_snapshot_check() or moved away (see
+ * t_snapshot_forget()) are dropped, the other entries are kept.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "t_config.h"
+
+
+/* t_snapshot_check() results */
+#define	T_SNAPSHOT_UNCHANGED	0 /* the file did not change */
+#define	T_SNAPSHOT_CHANGED	1 /* new file or tags changed */
+#define	T_SNAPSHOT_MODIFIED	2 /* the file changed, but not its tags */
+
+/*
+ * open the snapshot file at path. A missing file is an empty snapshot, it
+ * will be created by t_snapshot_close().
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_snapshot_open(const char *path);
+
+/*
+ * compare the file at path with the snapshot.
+ *
+ * Files which can not be read are reported as T_SNAPSHOT_CHANGED, so that
+ * the error show up when the actions are applied. The entry of a missing file
+ * is forgotten. When no snapshot is open,
+ * every file is T_SNAPSHOT_CHANGED. A T_SNAPSHOT_MODIFIED file is recorded
+ * (see t_snapshot_record()).
+ *
+ * @return
+ *   T_SNAPSHOT_UNCHANGED, T_SNAPSHOT_CHANGED or T_SNAPSHOT_MODIFIED.
+ */
+int	t_snapshot_check(const char *path);
+
+/*
+ * record the file at path in the snapshot. sb is the stat(2) of the file,
+ * the tags are only read again when it changed since t_snapshot_check().
+ * Nothing is done when no snapshot is open.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_snapshot_record(const char *path, const struct stat *sb);
+
+/*
+ * drop the entry of the file at path from the snapshot, like when it was
+ * renamed. A t_snapshot_record() of the same path during the run wins over
+ * its t_snapshot_forget(), whatever their order. Nothing is done when no
+ * snapshot is open.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_snapshot_forget(const char *path);
+
+/*
+ * write the snapshot file with the recorded files, and close it.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_snapshot_close(void);
+
+#endif /* ndef T_SNAPSHOT_H */
@@ -0,0 +1,530 @@
+/*
+ * t_sort.c
+ *
+ * sorted listing of files (the sort action).
+ *
+ * A record hold the sort values (one NUL terminated string per key, empty
+ * when the file has no such tag) followed by the rendered file. Records are
+ * written to the runs as they are in memory, header included, and the runs
+ * are merged using a binary heap.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "t_config.h"
+#include "t_toolkit.h"
+#include "t_tag.h"
+#include "t_taglist.h"
+#include "t_format.h"
+#include "t_sort.h"
+
+
+struct t_sort_record {
+	size_t	seq;  /* the order in which records were added */
+	size_t	vlen; /* length of the values */
+	size_t	len;  /* length of data */
+	char	data[];
+};
+
+struct t_sort {
+	size_t	 nkeys;
+	char	**keys;
+	size_t	 seq;
+	/* records in memory */
+	struct t_sort_record	**records;
+	size_t	 count, size;
+	size_t	 memory;
+	/* sorted runs, written to temporary files */
+	FILE	**runs;
+	size_t	 nruns;
+};
+
+/* a run being merged and its current record */
+struct t_sort_head {
+	struct t_sort_record	*rec;
+	FILE			*fp;
+};
+
+
+static int	t_sort_spill(struct t_sort *s);
+static FILE	*t_sort_tmpfile(void);
+static int	t_sort_read(FILE *fp, struct t_sort_record **recp);
+static int	t_sort_merge(struct t_sort *s, FILE *run);
+static void	t_sort_sift(struct t_sort_head *heap, size_t n, size_t i);
+static int	t_sort_output(const struct t_sort_record *rec, FILE *run);
+static int	t_sort_reccmp(const struct t_sort_record *a,
+		    const struct t_sort_record *b);
+/* qsort(3) wrapper for t_sort_reccmp() */
+static int	t_sort_qsortcmp(const void *va, const void *vb);
+static int	t_sort_valcmp(const char *a, const char *b);
+
+
+struct t_sort *
+t_sort_new(const char *keys)
+{
+	struct t_sort *s;
+	const char *c, *end;
+	size_t i;
+
+	assert(keys != NULL);
+
+	if ((s = calloc(1, sizeof(struct t_sort))) == NULL)
+		return (NULL);
+
+	s->nkeys = 1;
+	for (c = keys; *c != '\0'; c++)
+		s->nkeys += (*c == ',');
+	if ((s->keys = calloc(s->nkeys, sizeof(*s->keys))) == NULL)
+		goto error_label;
+
+	for (i = 0, c = keys; i < s->nkeys; i++, c = end + 1) {
+		if ((end = strchr(c, ',')) == NULL)
+			end = c + strlen(c);
+		if (c == end) {
+			warnx("sort: empty tag key in `%s'", keys);
+			errno = EINVAL;
+			goto error_label;
+		}
+		if ((s->keys[i] = strndup(c, end - c)) == NULL)
+			goto error_label;
+	}
+
+	return (s);
+error_label:
+	t_sort_delete(s);
+	return (NULL);
+}
+
+
+int
+t_sort_add(struct t_sort *s, const struct t_taglist *tlist, const char *path)
+{
+	int success = 0;
+	struct sbuf *sb = NULL;
+	struct t_sort_record *rec = NULL, **records;
+	const struct t_tag *t;
+	char *fmtdata = NULL;
+	size_t i, size;
+	extern const struct t_format *Fflag;
+
+	assert(s != NULL);
+	assert(tlist != NULL);
+	assert(path != NULL);
+
+	if (t_format_load(Fflag) == -1)
+		goto cleanup;
+	if ((fmtdata = Fflag->tags2fmt(tlist, path)) == NULL)
+		goto cleanup;
+
+	/* the values, and then the rendered file */
+	if ((sb = sbuf_new_auto()) == NULL)
+		goto cleanup;
+	for (i = 0; i < s->nkeys; i++) {
+		TAILQ_FOREACH(t, tlist->tags, entries) {
+			if (t_tag_keycmp(t->key, s->keys[i]) == 0) {
+				(void)sbuf_bcat(sb, t->val, t->vlen);
+				break;
+			}
+		}
+		(void)sbuf_putc(sb, '\0');
+	}
+	size = sbuf_len(sb);
+	(void)sbuf_bcat(sb, fmtdata, strlen(fmtdata) + 1);
+	if (sbuf_finish(sb) == -1)
+		goto cleanup;
+
+	if ((rec = malloc(sizeof(struct t_sort_record) + sbuf_len(sb))) == NULL)
+		goto cleanup;
+	rec->seq  = s->seq++;
+	rec->vlen = size;
+	rec->len  = sbuf_len(sb);
+	memcpy(rec->data, sbuf_data(sb), rec->len);
+
+	if (s->count == s->size) {
+		size = (s->size == 0 ? 1024 : 2 * s->size);
+		records = realloc(s->records, size * sizeof(*records));
+		if (records == NULL)
+			goto cleanup;
+		s->records = records;
+		s->size    = size;
+	}
+	s->records[s->count++] = rec;
+	s->memory += sizeof(struct t_sort_record) + rec->len + sizeof(rec);
+	rec = NULL;
+
+	if (s->memory >= T_SORT_MEMORY && t_sort_spill(s) == -1)
+		goto cleanup;
+
+	/* All went well. */
+	success = 1;
+
+	/* FALLTHROUGH */
+cleanup:
+	free(rec);
+	if (sb != NULL)
+		sbuf_delete(sb);
+	free(fmtdata);
+	return (success ? 0 : -1);
+}
+
+
+int
+t_sort_print(struct t_sort *s)
+{
+	size_t i;
+
+	assert(s != NULL);
+
+	if (s->nruns > 0) {
+		if (s->count > 0 && t_sort_spill(s) == -1)
+			return (-1);
+		return (t_sort_merge(s, NULL));
+	}
+
+	/* everything fit in memory */
+	qsort(s->records, s->count, sizeof(*s->records), t_sort_qsortcmp);
+	for (i = 0; i < s->count; i++) {
+		if (t_sort_output(s->records[i], NULL) == -1)
+			return (-1);
+	}
+
+	return (0);
+}
+
+
+void
+t_sort_delete(struct t_sort *s)
+{
+	size_t i;
+
+	if (s != NULL) {
+		for (i = 0; s->keys != NULL && i < s->nkeys; i++)
+			free(s->keys[i]);
+		free(s->keys);
+		for (i = 0; i < s->count; i++)
+			free(s->records[i]);
+		free(s->records);
+		for (i = 0; i < s->nruns; i++)
+			(void)fclose(s->runs[i]);
+		free(s->runs);
+	}
+	free(s);
+}
+
+
+/*
+ * sort the records in memory and move them to a new run. When there are
+ * T_SORT_MAXRUNS runs, they are first merged into one.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+static int
+t_sort_spill(struct t_sort *s)
+{
+	FILE *fp, **runs;
+	size_t i;
+
+	assert(s != NULL);
+
+	if (s->nruns == T_SORT_MAXRUNS) {
+		if ((fp = t_sort_tmpfile()) == NULL)
+			return (-1);
+		if (t_sort_merge(s, fp) == -1 || fflush(fp) != 0) {
+			(void)fclose(fp);
+			return (-1);
+		}
+		for (i = 0; i < s->nruns; i++)
+			(void)fclose(s->runs[i]);
+		s->runs[0] = fp;
+		s->nruns   = 1;
+	}
+
+	runs = realloc(s->runs, (s->nruns + 1) * sizeof(*runs));
+	if (runs == NULL)
+		return (-1);
+	s->runs = runs;
+	if ((fp = t_sort_tmpfile()) == NULL)
+		return (-1);
+	s->runs[s->nruns++] = fp;
+
+	qsort(s->records, s->count, sizeof(*s->records), t_sort_qsortcmp);
+	for (i = 0; i < s->count; i++) {
+		if (t_sort_output(s->records[i], fp) == -1)
+			return (-1);
+	}
+	if (fflush(fp) != 0) {
+		warn("sort: fflush");
+		return (-1);
+	}
+
+	for (i = 0; i < s->count; i++)
+		free(s->records[i]);
+	s->count  = 0;
+	s->memory = 0;
+
+	return (0);
+}
+
+
+/*
+ * create a temporary file in $TMPDIR, removed once closed.
+ */
+static FILE *
+t_sort_tmpfile(void)
+{
+	const char *tmpdir;
+	char *tmp;
+	FILE *fp = NULL;
+	int fd;
+
+	tmpdir = getenv("TMPDIR");
+	if (tmpdir == NULL)
+		tmpdir = "/tmp";
+	if (asprintf(&tmp, "%s/%s-XXXXXX", tmpdir, getprogname()) < 0)
+		return (NULL);
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("sort: %s", tmp);
+		goto cleanup;
+	}
+	(void)unlink(tmp);
+	if ((fp = fdopen(fd, "w+")) == NULL) {
+		warn("sort: fdopen");
+		(void)close(fd);
+	}
+
+	/* FALLTHROUGH */
+cleanup:
+	free(tmp);
+	return (fp);
+}
+
+
+/*
+ * read the next record of a run.
+ *
+ * @return
+ *   1 when a record was read and recp is set, 0 at the end of the run, -1 on
+ *   error.
+ */
+static int
+t_sort_read(FILE *fp, struct t_sort_record **recp)
+{
+	struct t_sort_record hdr, *rec;
+
+	assert(fp != NULL);
+	assert(recp != NULL);
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto eof_label;
+	if ((rec = malloc(sizeof(hdr) + hdr.len)) == NULL)
+		return (-1);
+	*rec = hdr;
+	if (fread(rec->data, hdr.len, 1, fp) != 1) {
+		free(rec);
+		goto eof_label;
+	}
+
+	*recp = rec;
+	return (1);
+eof_label:
+	if (ferror(fp)) {
+		warn("sort: fread");
+		return (-1);
+	}
+	return (0);
+}
+
+
+/*
+ * merge all the runs, either into run or to stdout when run is NULL.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+static int
+t_sort_merge(struct t_sort *s, FILE *run)
+{
+	int status, success = 0;
+	struct t_sort_head *heap;
+	size_t i, n;
+
+	assert(s != NULL);
+
+	if ((heap = calloc(s->nruns, sizeof(*heap))) == NULL)
+		return (-1);
+
+	for (i = n = 0; i < s->nruns; i++) {
+		rewind(s->runs[i]);
+		heap[n].fp = s->runs[i];
+		if ((status = t_sort_read(heap[n].fp, &heap[n].rec)) == -1)
+			goto cleanup;
+		n += status;
+	}
+	for (i = n / 2; i > 0; i--)
+		t_sort_sift(heap, n, i - 1);
+
+	while (n > 0) {
+		if (t_sort_output(heap[0].rec, run) == -1)
+			goto cleanup;
+		free(heap[0].rec);
+		heap[0].rec = NULL;
+		if ((status = t_sort_read(heap[0].fp, &heap[0].rec)) == -1)
+			goto cleanup;
+		if (status == 0) {
+			/* this run is done */
+			heap[0] = heap[--n];
+			heap[n].rec = NULL;
+		}
+		t_sort_sift(heap, n, 0);
+	}
+
+	/* All went well. */
+	success = 1;
+
+	/* FALLTHROUGH */
+cleanup:
+	for (i = 0; i < s->nruns; i++)
+		free(heap[i].rec);
+	free(heap);
+	return (success ? 0 : -1);
+}
+
+
+/* move down heap[i] until both its children are greater */
+static void
+t_sort_sift(struct t_sort_head *heap, size_t n, size_t i)
+{
+	struct t_sort_head tmp;
+	size_t min, child;
+
+	assert(heap != NULL || n == 0);
+
+	for (;;) {
+		min = i;
+		for (child = 2 * i + 1; child <= 2 * i + 2 && child < n; child++) {
+			if (t_sort_reccmp(heap[child].rec, heap[min].rec) < 0)
+				min = child;
+		}
+		if (min == i)
+			return;
+		tmp       = heap[i];
+		heap[i]   = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+
+/*
+ * write rec to run, or display it when run is NULL.
+ */
+static int
+t_sort_output(const struct t_sort_record *rec, FILE *run)
+{
+	const char *fmtdata;
+	int nprinted;
+
+	assert(rec != NULL);
+
+	if (run != NULL) {
+		if (fwrite(rec, sizeof(*rec) + rec->len, 1, run) != 1) {
+			warn("sort: fwrite");
+			return (-1);
+		}
+		return (0);
+	}
+
+	fmtdata = rec->data + rec->vlen;
+	nprinted = printf("%s\n", fmtdata);
+	// +1 for the trailing \n
+	if (nprinted < 0 || (unsigned)nprinted != (strlen(fmtdata) + 1))
+		return (-1);
+
+	return (0);
+}
+
+
+static int
+t_sort_reccmp(const struct t_sort_record *a, const struct t_sort_record *b)
+{
+	const char *va, *vb;
+	int cmp;
+
+	assert(a != NULL);
+	assert(b != NULL);
+
+	/* both have one value per key */
+	va = a->data;
+	vb = b->data;
+	while (va < a->data + a->vlen) {
+		if ((cmp = t_sort_valcmp(va, vb)) != 0)
+			return (cmp);
+		va += strlen(va) + 1;
+		vb += strlen(vb) + 1;
+	}
+
+	return (a->seq < b->seq ? -1 : (a->seq > b->seq));
+}
+
+
+static int
+t_sort_qsortcmp(const void *va, const void *vb)
+{
+
+	assert(va != NULL);
+	assert(vb != NULL);
+
+	return (t_sort_reccmp(*(const struct t_sort_record * const *)va,
+	    *(const struct t_sort_record * const *)vb));
+}
+
+
+/*
+ * compare two values case insensitively, the digits sequences being compared
+ * as numbers.
+ */
+static int
+t_sort_valcmp(const char *a, const char *b)
+{
+	const unsigned char *ua, *ub;
+	size_t alen, blen;
+	int cmp;
+
+	assert(a != NULL);
+	assert(b != NULL);
+
+	ua = (const unsigned char *)a;
+	ub = (const unsigned char *)b;
+	while (*ua != '\0' && *ub != '\0') {
+		if (isdigit(*ua) && isdigit(*ub)) {
+			/* the longest number (without leading zeros) is the
+			   greatest, or the first different digit decide */
+			while (*ua == '0')
+				ua++;
+			while (*ub == '0')
+				ub++;
+			for (alen = 0; isdigit(ua[alen]); alen++)
+				continue;
+			for (blen = 0; isdigit(ub[blen]); blen++)
+				continue;
+			if (alen != blen)
+				return (alen < blen ? -1 : 1);
+			if ((cmp = memcmp(ua, ub, alen)) != 0)
+				return (cmp);
+			ua += alen;
+			ub += blen;
+		} else {
+			if ((cmp = tolower(*ua) - tolower(*ub)) != 0)
+				return (cmp);
+			ua++;
+			ub++;
+		}
+	}
+
+	return (*ua - *ub);
+}
@@ -0,0 +1,62 @@
+#ifndef T_SORT_H
+#define T_SORT_H
+/*
+ * t_sort.h
+ *
+ * sorted listing of files (the sort action).
+ *
+ * Each file is rendered in the -F format as it is added, and kept with the
+ * values it is sorted by. When the records kept in memory exceed
+ * T_SORT_MEMORY bytes, they are sorted and written to a temporary file (a
+ * run), and the runs are merged when the listing is displayed. This way
+ * listings larger than the memory can be sorted.
+ */
+#include "t_config.h"
+#include "t_taglist.h"
+
+
+/* memory used by the records before they are written to a run */
+#define	T_SORT_MEMORY	(64 * 1024 * 1024)
+/* number of runs merged into a single one before adding more */
+#define	T_SORT_MAXRUNS	32
+
+struct t_sort;
+
+/*
+ * create a sorted listing by the comma separated list of tag keys keys, like
+ * `albumartist,album,tracknumber'.
+ *
+ * @return
+ *   A t_sort that should be passed to t_sort_delete() after use, or NULL on
+ *   error and errno is set to EINVAL (a warning is displayed) or ENOMEM.
+ */
+struct t_sort	*t_sort_new(const char *keys);
+
+/*
+ * add the file at path with the tags tlist to the listing.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_sort_add(struct t_sort *s, const struct t_taglist *tlist,
+	    const char *path);
+
+/*
+ * display the listing.
+ *
+ * Files are ordered by the value of the first tag of each key, compared case
+ * insensitively and with the digits sequences compared as numbers (so that
+ * "2" is before "10"). Files without the tag are first, and equal files are
+ * kept in the order they were added.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_sort_print(struct t_sort *s);
+
+/*
+ * free a listing and remove its temporary files.
+ */
+void	t_sort_delete(struct t_sort *s);
+
+#endif /* ndef T_SORT_H */
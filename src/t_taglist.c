@@ -11,6 +11,12 @@
 #include "t_taglist.h"
 
 
+static uint64_t	t_taglist_fmix64(uint64_t k);
+static void	t_taglist_murmur3(const uint8_t *data, size_t len,
+		    uint64_t h[2]);
+static void	t_taglist_le64(struct sbuf *sb, uint64_t x);
+
+
 struct t_taglist *
 t_taglist_new(void)
 {
@@ -140,6 +146,48 @@ t_taglist_join(const struct t_taglist *tlist, const char *glue)
 }
 
 
+/*
+ * The canonical form of the tag list is, for each tag, the length of the
+ * key, the lowercase key, the length of the value and the value (lengths as
+ * 64 bits little endian integers), hashed with MurmurHash3 x64 128.
+ */
+int
+t_taglist_digest(const struct t_taglist *tlist,
+    uint8_t digest[T_TAGLIST_DIGEST_SIZE])
+{
+	struct sbuf *sb;
+	const struct t_tag *t;
+	uint64_t h[2];
+	size_t i;
+
+	assert(tlist != NULL);
+	assert(digest != NULL);
+
+	if ((sb = sbuf_new_auto()) == NULL)
+		return (-1);
+	TAILQ_FOREACH(t, tlist->tags, entries) {
+		t_taglist_le64(sb, t->klen);
+		for (i = 0; i < t->klen; i++)
+			(void)sbuf_putc(sb, tolower((unsigned char)t->key[i]));
+		t_taglist_le64(sb, t->vlen);
+		(void)sbuf_bcat(sb, t->val, t->vlen);
+	}
+	if (sbuf_finish(sb) == -1) {
+		sbuf_delete(sb);
+		return (-1);
+	}
+	t_taglist_murmur3((const uint8_t *)sbuf_data(sb), sbuf_len(sb), h);
+	sbuf_delete(sb);
+
+	for (i = 0; i < 8; i++) {
+		digest[i]     = (uint8_t)(h[0] >> (56 - 8 * i));
+		digest[i + 8] = (uint8_t)(h[1] >> (56 - 8 * i));
+	}
+
+	return (0);
+}
+
+
 void
 t_taglist_delete(struct t_taglist *tlist)
 {
@@ -156,3 +204,86 @@ t_taglist_delete(struct t_taglist *tlist)
 	}
 	free(tlist);
 }
+
+
+#define	ROTL64(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t
+t_taglist_fmix64(uint64_t k)
+{
+
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return (k);
+}
+
+
+/*
+ * MurmurHash3_x64_128 by Austin Appleby (public domain), with a zero seed and
+ * the blocks read as little endian whatever the host byte order.
+ */
+static void
+t_taglist_murmur3(const uint8_t *data, size_t len, uint64_t h[2])
+{
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	const uint8_t *tail;
+	uint64_t h1 = 0, h2 = 0, k1, k2;
+	size_t i, j, rem;
+
+	assert(data != NULL || len == 0);
+	assert(h != NULL);
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		k1 = k2 = 0;
+		for (j = 0; j < 8; j++) {
+			k1 |= (uint64_t)data[i + j] << (8 * j);
+			k2 |= (uint64_t)data[i + 8 + j] << (8 * j);
+		}
+		k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = ROTL64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = ROTL64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	tail = data + i;
+	rem  = len - i;
+	k1 = k2 = 0;
+	for (j = rem; j > 8; j--)
+		k2 |= (uint64_t)tail[j - 1] << (8 * (j - 9));
+	if (rem > 8) {
+		k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+	}
+	for (j = (rem > 8 ? 8 : rem); j > 0; j--)
+		k1 |= (uint64_t)tail[j - 1] << (8 * (j - 1));
+	if (rem > 0) {
+		k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= (uint64_t)len;
+	h2 ^= (uint64_t)len;
+	h1 += h2;
+	h2 += h1;
+	h1 = t_taglist_fmix64(h1);
+	h2 = t_taglist_fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+
+	h[0] = h1;
+	h[1] = h2;
+}
+
+
+static void
+t_taglist_le64(struct sbuf *sb, uint64_t x)
+{
+	size_t i;
+
+	assert(sb != NULL);
+
+	for (i = 0; i < 8; i++)
+		(void)sbuf_putc(sb, (int)((x >> (8 * i)) & 0xff));
+}
@@ -5,10 +5,16 @@
  *
  * tagutil's tag lists.
  */
+#include <stdint.h>
+
 #include "t_config.h"
 #include "t_tag.h"
 
 
+/* size (in bytes) of a t_taglist_digest() digest */
+#define	T_TAGLIST_DIGEST_SIZE	16
+
+
 /*
  * a list of tags.
  *
@@ -96,6 +102,22 @@ struct t_tag	*t_taglist_tag_at(const struct t_taglist *tlist, unsigned int index
  */
 char	*t_taglist_join(const struct t_taglist *tlist, const char *glue);
 
+/*
+ * compute a 128 bits digest of tlist.
+ *
+ * The digest only depends on the tags keys (case insensitively) and values,
+ * in order. It is the same on every platform, so it can be stored and
+ * compared across runs and machines.
+ *
+ * @param digest
+ *   Set to the digest (the first byte being the most significant).
+ *
+ * @return
+ *   0 on success, -1 on error (malloc(3) failed).
+ */
+int	t_taglist_digest(const struct t_taglist *tlist,
+	    uint8_t digest[T_TAGLIST_DIGEST_SIZE]);
+
 /*
  * free the t_taglist and all its tags.
  *
@@ -12,6 +12,7 @@
 
 #include <locale.h>
 #include <iconv.h>
+#include <stdint.h>
 
 #include "t_config.h"
 #include "t_toolkit.h"
@@ -254,6 +255,65 @@ cleanup:
 }
 
 
+uint64_t
+t_strhash(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	assert(s != NULL);
+
+	for (; *s != '\0'; s++) {
+		h ^= (unsigned char)*s;
+		h *= 0x100000001b3ULL;
+	}
+
+	return (h);
+}
+
+
+/*
+ * The path is hashed with FNV-1a and the shard is chosen with the jump
+ * consistent hash of Lamping and Veach ("A Fast, Minimal Memory, Consistent
+ * Hash Algorithm", 2014): when the shard count change from n to n + 1, only
+ * 1 / (n + 1) of the files move to another shard.
+ */
+int
+t_shard_mine(const char *path)
+{
+	extern unsigned long Sflag_index, Sflag_count;
+	uint64_t h;
+	int64_t b = -1, j = 0;
+
+	assert(path != NULL);
+
+	if (Sflag_count == 0)
+		return (1);
+
+	h = t_strhash(path);
+	while (j < (int64_t)Sflag_count) {
+		b = j;
+		h = h * 2862933555777941757ULL + 1;
+		j = (int64_t)((b + 1) *
+		    ((double)(1LL << 31) / (double)((h >> 33) + 1)));
+	}
+
+	return ((unsigned long)b == Sflag_index);
+}
+
+
+int
+t_fchmod_umask(int fd)
+{
+	mode_t mask;
+
+	/* the umask can only be read by setting it */
+	mask = umask(0);
+	(void)umask(mask);
+
+	return (fchmod(fd, 0666 & ~mask));
+}
+
+
 void
 xasprintf(char **strp, const char *fmt, ...)
 {
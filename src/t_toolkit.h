@@ -12,6 +12,7 @@
 #include <err.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -69,6 +70,31 @@ char	*t_dirname(const char *);
  */
 char	*t_basename(const char *);
 
+/*
+ * 64 bits FNV-1a hash of a string.
+ */
+uint64_t	t_strhash(const char *s);
+
+/*
+ * tell if path belongs to the shard selected by the -S option.
+ *
+ * The shard only depends on path, so that every process given the same path
+ * agree on it whatever the other files are.
+ *
+ * @return
+ *   1 if path is in the shard (or -S was not given), 0 otherwise.
+ */
+int	t_shard_mine(const char *path);
+
+/*
+ * give the file opened as fd the mode open(2) would have created it with
+ * (0666 with the umask applied), for files created by mkstemp(3) (0600).
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_fchmod_umask(int fd);
+
 /* XXX: to avoid -Werror=return-type */
 void	 xasprintf(char **strp, const char *fmt, ...);
 #endif /* ndef T_TOOLKIT_H */
@@ -3,8 +3,11 @@
  *
  * A tune represent a music file with tags (or comments) attributes.
  */
+#include <sys/stat.h>
+
 #include "t_config.h"
 #include "t_backend.h"
+#include "t_cache.h"
 #include "t_tag.h"
 #include "t_tune.h"
 
@@ -13,9 +16,11 @@
 struct t_tune {
 	char	*path;    /* the file's path */
 	int	 dirty;   /* 0 if clean (tags have not changed), >0 otherwise. */
-	void	*opaque;  /* pointer used by the backend's read and write routines */
+	void	*opaque;  /* pointer used by the backend's read and write routines,
+	                     NULL until t_tune_open() when the tags are cached. */
 	const struct t_backend	*backend; /* backend used to handle this file. */
 	struct t_taglist	*tlist; /* used internal by t_tune routines. use t_tune_tags() instead */
+	struct stat	 sb;      /* the file's stat(2) at init, used as cache key */
 };
 
 
@@ -29,6 +34,22 @@ struct t_tune {
  */
 static int	t_tune_init(struct t_tune *tune, const char *path);
 
+/*
+ * initialize the tune's backend if it was deferred by t_tune_init().
+ *
+ * @return
+ *   0 on success, -1 on error.
+ */
+static int	t_tune_open(struct t_tune *tune);
+
+/*
+ * store the tags of a saved tune in the cache, as read back from the file.
+ *
+ * The backend may not write the tags exactly as given (key mapping, tags it
+ * cannot represent) so the file is reopened and read again.
+ */
+static void	t_tune_recache(struct t_tune *tune);
+
 /*
  * free all the memory used internally by the t_tune.
  */
@@ -67,11 +88,31 @@ t_tune_init(struct t_tune *tune, const char *path)
 	tune->path = strdup(path);
 	if (tune->path == NULL)
 		return (-1);
+	bQ = t_all_backends();
+
+	/*
+	 * when the tags are cached, the backend is initialized only if the tune
+	 * is saved (see t_tune_open()).
+	 */
+	if (t_cache_enabled() && stat(tune->path, &tune->sb) == 0) {
+		const char *libid;
+		tune->tlist = t_cache_lookup(&tune->sb, &libid);
+		if (tune->tlist != NULL) {
+			TAILQ_FOREACH(b, bQ, entries) {
+				if (strcmp(b->libid, libid) == 0) {
+					tune->backend = b;
+					return (0);
+				}
+			}
+			/* this backend is not available anymore */
+			t_taglist_delete(tune->tlist);
+			tune->tlist = NULL;
+		}
+	}
 
 	/* find the first backend able to handle path */
-	bQ = t_all_backends();
 	TAILQ_FOREACH(b, bQ, entries) {
-		if (b->init != NULL) {
+		if (t_backend_load(b, tune->path) == 0) {
 			void *o = b->init(tune->path);
 			if (o != NULL) {
 				tune->backend = b;
@@ -91,13 +132,31 @@ t_tune_init(struct t_tune *tune, const char *path)
 struct t_taglist *
 t_tune_tags(struct t_tune *tune)
 {
+	const struct t_taglist *tlist;
 
 	assert(tune != NULL);
 
-	if (tune->tlist == NULL)
+	if ((tlist = t_tune_taglist(tune)) == NULL)
+		return (NULL);
+	return (t_taglist_clone(tlist));
+}
+
+
+const struct t_taglist *
+t_tune_taglist(struct t_tune *tune)
+{
+
+	assert(tune != NULL);
+
+	if (tune->tlist == NULL) {
 		tune->tlist = tune->backend->read(tune->opaque);
+		if (tune->tlist != NULL && t_cache_enabled()) {
+			(void)t_cache_store(&tune->sb, tune->backend->libid,
+			    tune->tlist);
+		}
+	}
 
-	return (t_taglist_clone(tune->tlist));
+	return (tune->tlist);
 }
 
 
@@ -147,15 +206,62 @@ t_tune_save(struct t_tune *tune)
 	assert(tune != NULL);
 
 	if (tune->dirty) {
+		if (t_tune_open(tune) == -1)
+			return (-1);
 		int ret = tune->backend->write(tune->opaque, tune->tlist);
 		if (ret == 0) /* success */
 			tune->dirty = 0;
+		/* the file has changed, update its cache entry */
+		if (ret == 0 && t_cache_enabled())
+			t_tune_recache(tune);
 	}
 
 	return (tune->dirty ? -1 : 0);
 }
 
 
+static int
+t_tune_open(struct t_tune *tune)
+{
+	void *o;
+
+	assert(tune != NULL);
+	assert(tune->backend != NULL);
+
+	if (tune->opaque != NULL)
+		return (0);
+	if (t_backend_load(tune->backend, tune->path) == -1 ||
+	    (o = tune->backend->init(tune->path)) == NULL) {
+		warnx("%s: could not be opened by the %s backend", tune->path,
+		    tune->backend->libid);
+		return (-1);
+	}
+	tune->opaque = o;
+
+	return (0);
+}
+
+
+static void
+t_tune_recache(struct t_tune *tune)
+{
+	struct t_taglist *tlist;
+
+	assert(tune != NULL);
+	assert(tune->opaque != NULL);
+
+	/* the backend data may still reflect the file before the write */
+	tune->backend->clear(tune->opaque);
+	tune->opaque = NULL;
+	if (stat(tune->path, &tune->sb) == -1 || t_tune_open(tune) == -1)
+		return;
+	if ((tlist = tune->backend->read(tune->opaque)) != NULL) {
+		(void)t_cache_store(&tune->sb, tune->backend->libid, tlist);
+		t_taglist_delete(tlist);
+	}
+}
+
+
 static void
 t_tune_clear(struct t_tune *tune)
 {
@@ -163,8 +269,9 @@ t_tune_clear(struct t_tune *tune)
 	assert(tune != NULL);
 
 	/* tune is either initialized with both path and backend set, or it's
-	 uninitialized */
-	if (tune->backend != NULL)
+	 uninitialized. The backend is not initialized when the tags were
+	 cached and the tune never saved. */
+	if (tune->backend != NULL && tune->opaque != NULL)
 		tune->backend->clear(tune->opaque);
 	t_taglist_delete(tune->tlist);
 	free(tune->path);
@@ -180,15 +287,3 @@ t_tune_delete(struct t_tune *tune)
 		t_tune_clear(tune);
 	free(tune);
 }
-
-/* this is needed because we don't expose t_tune_init nor t_tune_clear. The
-   renamer does something pretty unusual so it's implemented that way for the
-   time being. */
-int
-t__tune_reload__(struct t_tune *tune, const char *path)
-{
-	assert(tune != NULL);
-
-	t_tune_clear(tune);
-	return (t_tune_init(tune, path));
-}
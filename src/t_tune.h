@@ -33,6 +33,16 @@ struct t_tune	*t_tune_new(const char *path);
  */
 struct t_taglist	*t_tune_tags(struct t_tune *tune);
 
+/*
+ * get the tags of a tune without copying them, for read only access.
+ *
+ * @return
+ *   A complete and ordered t_taglist on success, NULL on error. The returned
+ *   t_taglist belongs to the tune and is only valid until the next call to
+ *   t_tune_set_tags() or t_tune_delete().
+ */
+const struct t_taglist	*t_tune_taglist(struct t_tune *tune);
+
 /*
  * get the tune's path.
  *
@@ -0,0 +1,487 @@
+/*
+ * t_watch.c
+ *
+ * apply actions to the files written or moved into a directory tree.
+ *
+ * Each inotify(7) event put the file in the pending queue (or move it to the
+ * end of the queue if it was already there), sorted by due time. The actions
+ * are applied when a file is due, one file at a time.
+ *
+ * When the actions are done, the identity of the file (device, inode, size
+ * and mtime) is remembered for a while: the events caused by the actions
+ * themselves (in place writes, rewrites and renames) then find a file that
+ * did not change since and are ignored. The temporary files of the rewrites
+ * are hidden, and so ignored as well.
+ */
+#if defined(HAS_INOTIFY)
+#	include <sys/inotify.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fts.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "t_config.h"
+#include "t_toolkit.h"
+#include "t_action.h"
+#include "t_watch.h"
+
+
+#if defined(HAS_INOTIFY)
+/*
+ * how long (in milliseconds) the identity of a file is remembered after the
+ * actions have been applied to it.
+ */
+#define	T_WATCH_EXPIRE	(10 * 1000)
+
+#define	T_WATCH_DIRMASK		(IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+#define	T_WATCH_FILEMASK	(IN_CLOSE_WRITE | IN_MOVED_TO)
+
+/* a watched directory */
+struct t_watch_dir {
+	int	 wd;
+	char	*path;
+	TAILQ_ENTRY(t_watch_dir)	entries;
+};
+TAILQ_HEAD(t_watch_dirQ, t_watch_dir);
+
+/* a file waiting for the actions to be applied */
+struct t_watch_file {
+	char	*path;
+	int64_t	 due;
+	TAILQ_ENTRY(t_watch_file)	entries;
+};
+TAILQ_HEAD(t_watch_fileQ, t_watch_file);
+
+/* a file processed recently */
+struct t_watch_done {
+	dev_t		 dev;
+	ino_t		 ino;
+	off_t		 size;
+	struct timespec	 mtim;
+	int64_t		 expire;
+	TAILQ_ENTRY(t_watch_done)	entries;
+};
+TAILQ_HEAD(t_watch_doneQ, t_watch_done);
+
+struct t_watch {
+	int			fd; /* the inotify instance */
+	struct t_watch_dirQ	dirs;
+	struct t_watch_fileQ	pending;
+	struct t_watch_doneQ	done;
+};
+
+/* set by the signal handler */
+static volatile sig_atomic_t	t_watch_stop;
+
+
+static void	t_watch_signal(int sig);
+static int64_t	t_watch_now(void);
+static int	t_watch_add(struct t_watch *w, const char *dir, int queue);
+static int	t_watch_read(struct t_watch *w);
+static int	t_watch_queue(struct t_watch *w, const char *path);
+static void	t_watch_apply(struct t_watch *w, struct t_actionQ *aQ,
+		    struct t_watch_file *f);
+static void	t_watch_clear(struct t_watch *w);
+
+
+int
+t_watch(const char *dir, struct t_actionQ *aQ)
+{
+	struct t_watch w;
+	struct t_watch_file *f;
+	struct sigaction sa;
+	struct pollfd pfd;
+	int64_t now;
+	int timeout, ret = -1;
+
+	assert(dir != NULL);
+	assert(aQ != NULL);
+
+	w.fd = -1;
+	TAILQ_INIT(&w.dirs);
+	TAILQ_INIT(&w.pending);
+	TAILQ_INIT(&w.done);
+
+	/* no SA_RESTART, so that poll(2) is interrupted */
+	bzero(&sa, sizeof(sa));
+	sa.sa_handler = t_watch_signal;
+	(void)sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGINT, &sa, NULL) == -1 ||
+	    sigaction(SIGTERM, &sa, NULL) == -1) {
+		warn("sigaction");
+		goto cleanup;
+	}
+
+	if ((w.fd = inotify_init1(IN_CLOEXEC)) == -1) {
+		warn("inotify_init1");
+		goto cleanup;
+	}
+	if (t_watch_add(&w, dir, 0) == -1)
+		goto cleanup;
+
+	pfd.fd     = w.fd;
+	pfd.events = POLLIN;
+	while (!t_watch_stop) {
+		now = t_watch_now();
+		/* apply the actions to the files due */
+		while ((f = TAILQ_FIRST(&w.pending)) != NULL && f->due <= now) {
+			TAILQ_REMOVE(&w.pending, f, entries);
+			t_watch_apply(&w, aQ, f);
+			if (t_watch_stop)
+				break;
+		}
+
+		if ((f = TAILQ_FIRST(&w.pending)) == NULL)
+			timeout = -1;
+		else if ((now = t_watch_now()) >= f->due)
+			continue;
+		else
+			timeout = (int)(f->due - now);
+		switch (poll(&pfd, 1, timeout)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			warn("poll");
+			goto cleanup;
+		case 0:
+			continue;
+		default:
+			if (t_watch_read(&w) == -1)
+				goto cleanup;
+		}
+	}
+
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	t_watch_clear(&w);
+	return (ret);
+}
+
+
+static void
+t_watch_signal(t__unused int sig)
+{
+
+	t_watch_stop = 1;
+}
+
+
+/*
+ * @return
+ *   a monotonic time in milliseconds.
+ */
+static int64_t
+t_watch_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+	return ((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+/*
+ * watch dir and its subdirectories.
+ *
+ * @param queue
+ *   If set, the files found in the directories are queued (used for
+ *   directories moved into a watched one).
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+static int
+t_watch_add(struct t_watch *w, const char *dir, int queue)
+{
+	struct t_watch_dir *d;
+	char *paths[] = { NULL, NULL };
+	FTS *fts;
+	FTSENT *ent;
+	int wd, ret = -1;
+
+	assert(w != NULL);
+	assert(dir != NULL);
+
+	if ((paths[0] = strdup(dir)) == NULL)
+		return (-1);
+	if ((fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) == NULL) {
+		warn("%s", dir);
+		free(paths[0]);
+		return (-1);
+	}
+
+	while ((ent = fts_read(fts)) != NULL) {
+		/* skip the hidden files and directories */
+		if (ent->fts_level > 0 && ent->fts_name[0] == '.') {
+			if (ent->fts_info == FTS_D)
+				(void)fts_set(fts, ent, FTS_SKIP);
+			continue;
+		}
+		if (ent->fts_info == FTS_F && queue) {
+			if (t_watch_queue(w, ent->fts_path) == -1)
+				goto cleanup;
+		}
+		if (ent->fts_info != FTS_D)
+			continue;
+
+		wd = inotify_add_watch(w->fd, ent->fts_path,
+		    T_WATCH_DIRMASK | T_WATCH_FILEMASK);
+		if (wd == -1) {
+			warn("%s", ent->fts_path);
+			/* only the top directory is required */
+			if (ent->fts_level == 0)
+				goto cleanup;
+			continue;
+		}
+		/* a directory can be seen twice if moved while walking */
+		TAILQ_FOREACH(d, &w->dirs, entries) {
+			if (d->wd == wd)
+				break;
+		}
+		if (d != NULL)
+			continue;
+		if ((d = malloc(sizeof(struct t_watch_dir))) == NULL)
+			goto cleanup;
+		if ((d->path = strdup(ent->fts_path)) == NULL) {
+			free(d);
+			goto cleanup;
+		}
+		d->wd = wd;
+		TAILQ_INSERT_TAIL(&w->dirs, d, entries);
+	}
+
+	ret = 0;
+	/* FALLTHROUGH */
+cleanup:
+	(void)fts_close(fts);
+	free(paths[0]);
+	return (ret);
+}
+
+
+/*
+ * read the available inotify events.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+static int
+t_watch_read(struct t_watch *w)
+{
+	union {
+		struct inotify_event	ev;
+		char			buf[64 * 1024];
+	} u;
+	const struct inotify_event *ev;
+	struct t_watch_dir *d;
+	char *path;
+	ssize_t len;
+	size_t off;
+
+	assert(w != NULL);
+
+	len = read(w->fd, &u, sizeof(u));
+	if (len == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return (0);
+		warn("read");
+		return (-1);
+	}
+
+	for (off = 0; off < (size_t)len; off += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *)(const void *)(u.buf + off);
+		if (ev->mask & IN_Q_OVERFLOW) {
+			warnx("watch: too many events, some files were missed");
+			continue;
+		}
+		TAILQ_FOREACH(d, &w->dirs, entries) {
+			if (d->wd == ev->wd)
+				break;
+		}
+		if (d == NULL)
+			continue;
+		if (ev->mask & IN_IGNORED) {
+			/* the directory was removed */
+			TAILQ_REMOVE(&w->dirs, d, entries);
+			free(d->path);
+			free(d);
+			continue;
+		}
+		/* skip the hidden files, like the rewrites temporary files */
+		if (ev->len == 0 || ev->name[0] == '.' || ev->name[0] == '\0')
+			continue;
+
+		if (asprintf(&path, "%s/%s", d->path, ev->name) < 0)
+			return (-1);
+		if (ev->mask & IN_ISDIR) {
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+				(void)t_watch_add(w, path, 1);
+		} else if (ev->mask & T_WATCH_FILEMASK) {
+			if (t_watch_queue(w, path) == -1) {
+				free(path);
+				return (-1);
+			}
+		}
+		free(path);
+	}
+
+	return (0);
+}
+
+
+/*
+ * add a file to the pending queue, or delay it if it is already queued.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+static int
+t_watch_queue(struct t_watch *w, const char *path)
+{
+	struct t_watch_file *f;
+
+	assert(w != NULL);
+	assert(path != NULL);
+
+	/* another process take care of this one, see -S */
+	if (!t_shard_mine(path))
+		return (0);
+
+	TAILQ_FOREACH(f, &w->pending, entries) {
+		if (strcmp(f->path, path) == 0)
+			break;
+	}
+	if (f != NULL) {
+		TAILQ_REMOVE(&w->pending, f, entries);
+	} else {
+		if ((f = malloc(sizeof(struct t_watch_file))) == NULL)
+			return (-1);
+		if ((f->path = strdup(path)) == NULL) {
+			free(f);
+			return (-1);
+		}
+	}
+	f->due = t_watch_now() + T_WATCH_DELAY;
+	TAILQ_INSERT_TAIL(&w->pending, f, entries);
+
+	return (0);
+}
+
+
+/*
+ * apply the actions to a file unless it has not changed since the last time.
+ * f is freed.
+ */
+static void
+t_watch_apply(struct t_watch *w, struct t_actionQ *aQ, struct t_watch_file *f)
+{
+	struct t_watch_done *d, *next;
+	struct stat sb;
+	int64_t now;
+	int applied;
+
+	assert(w != NULL);
+	assert(aQ != NULL);
+	assert(f != NULL);
+
+	now = t_watch_now();
+	TAILQ_FOREACH_SAFE(d, &w->done, entries, next) {
+		if (d->expire <= now) {
+			TAILQ_REMOVE(&w->done, d, entries);
+			free(d);
+		}
+	}
+
+	/* the file may be gone already */
+	if (stat(f->path, &sb) == -1 || !S_ISREG(sb.st_mode))
+		goto cleanup;
+	TAILQ_FOREACH(d, &w->done, entries) {
+		if (d->dev == sb.st_dev && d->ino == sb.st_ino &&
+		    d->size == sb.st_size &&
+		    d->mtim.tv_sec  == sb.st_mtim.tv_sec &&
+		    d->mtim.tv_nsec == sb.st_mtim.tv_nsec) {
+			/* our own changes */
+			goto cleanup;
+		}
+	}
+
+	/*
+	 * remember the file even when the actions failed, backends may have
+	 * opened it for writing (and so triggered a new event) anyway.
+	 */
+	applied = (t_actionQ_apply(aQ, f->path, &sb) != -1);
+	/* rename now rather than when the watch ends */
+	(void)t_actionQ_flush(aQ, NULL, NULL);
+	if (!applied && stat(f->path, &sb) == -1)
+		goto cleanup;
+	if ((d = malloc(sizeof(struct t_watch_done))) != NULL) {
+		d->dev    = sb.st_dev;
+		d->ino    = sb.st_ino;
+		d->size   = sb.st_size;
+		d->mtim   = sb.st_mtim;
+		d->expire = t_watch_now() + T_WATCH_EXPIRE;
+		TAILQ_INSERT_TAIL(&w->done, d, entries);
+	}
+	/* output as soon as possible, when piped */
+	(void)fflush(stdout);
+
+cleanup:
+	free(f->path);
+	free(f);
+}
+
+
+static void
+t_watch_clear(struct t_watch *w)
+{
+	struct t_watch_dir *d;
+	struct t_watch_file *f;
+	struct t_watch_done *done;
+
+	assert(w != NULL);
+
+	while ((d = TAILQ_FIRST(&w->dirs)) != NULL) {
+		TAILQ_REMOVE(&w->dirs, d, entries);
+		free(d->path);
+		free(d);
+	}
+	while ((f = TAILQ_FIRST(&w->pending)) != NULL) {
+		TAILQ_REMOVE(&w->pending, f, entries);
+		free(f->path);
+		free(f);
+	}
+	while ((done = TAILQ_FIRST(&w->done)) != NULL) {
+		TAILQ_REMOVE(&w->done, done, entries);
+		free(done);
+	}
+	if (w->fd != -1)
+		(void)close(w->fd);
+}
+
+#else /* !HAS_INOTIFY */
+
+int
+t_watch(const char *dir, t__unused struct t_actionQ *aQ)
+{
+
+	assert(dir != NULL);
+	assert(aQ != NULL);
+
+	errno = ENOTSUP;
+	warn("%s: watch", dir);
+	return (-1);
+}
+
+#endif /* HAS_INOTIFY */
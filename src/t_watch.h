@@ -0,0 +1,32 @@
+#ifndef T_WATCH_H
+#define T_WATCH_H
+/*
+ * t_watch.h
+ *
+ * apply actions to the files written or moved into a directory tree.
+ */
+#include "t_config.h"
+#include "t_action.h"
+
+
+/*
+ * delay (in milliseconds) without new event on a file before the actions are
+ * applied to it.
+ */
+#define	T_WATCH_DELAY	200
+
+/*
+ * watch dir and its subdirectories (except the hidden ones) until SIGINT or
+ * SIGTERM is received. The actions are applied to every file closed after
+ * being written or moved into a watched directory, once it has not changed
+ * for T_WATCH_DELAY milliseconds. The changes made by the actions themselves
+ * are ignored.
+ *
+ * Only supported where inotify(7) is available.
+ *
+ * @return
+ *   -1 on error, 0 on success.
+ */
+int	t_watch(const char *dir, struct t_actionQ *aQ);
+
+#endif /* ndef T_WATCH_H */
@@ -11,12 +11,21 @@
  *
  * tagutil is under a BSD 2-Clause license, see LICENSE.
  */
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+
 #include "t_config.h"
 #include "t_toolkit.h"
 #include "t_tune.h"
 #include "t_backend.h"
 #include "t_format.h"
 #include "t_action.h"
+#include "t_cache.h"
+#include "t_journal.h"
+#include "t_snapshot.h"
+#include "t_index.h"
+#include "t_watch.h"
 
 
 /*
@@ -24,12 +33,65 @@
  */
 static void	usage(int status) t__dead2;
 
+/*
+ * parse the -P option argument.
+ */
+static void	parse_padding(const char *arg);
+
+/*
+ * parse the -S option argument.
+ */
+static void	parse_shard(const char *arg);
+
+/*
+ * the files whose journal and snapshot records wait for their deferred work
+ * (see t_actionQ_flush()), in the order they were processed.
+ */
+struct t_deferred {
+	struct t_deferred_file {
+		const char	*path;
+		struct stat	 sb;
+	} *files;
+	size_t	count;
+	size_t	capacity;
+	size_t	next; /* the next file to be reported */
+	int	success;
+};
+
+/*
+ * t_actionQ_report for the deferred files, record them in the journal and the
+ * snapshot now that their work is done.
+ */
+static void	record_deferred(const char *path, const char *npath,
+		    int success, void *arg);
+
 
 /* options */
 int			 pflag; /* create directory with rename */
 const struct t_format	*Fflag; /* output format */
 int			 Nflag; /* answer no to all questions */
 int			 Yflag; /* answer yes to all questions */
+size_t			 Pflag_reserve = 8 * 1024; /* padding reserve (bytes) */
+unsigned		 Pflag_growth  = 2; /* padding growth factor */
+int			 Rflag; /* refuse to rewrite whole files */
+int			 sflag; /* display write statistics at exit */
+const char		*Cflag; /* tag cache file */
+const char		*Jflag; /* journal file */
+const char		*cflag; /* snapshot file */
+unsigned long		 Sflag_index; /* shard to process */
+unsigned long		 Sflag_count; /* number of shards, 0 without -S */
+
+static const struct option longopts[] = {
+	{ "cache",	required_argument,	NULL,	'C' },
+	{ "changed-since", required_argument,	NULL,	'c' },
+	{ "help",	no_argument,		NULL,	'h' },
+	{ "journal",	required_argument,	NULL,	'J' },
+	{ "padding",	required_argument,	NULL,	'P' },
+	{ "no-rewrite",	no_argument,		NULL,	'R' },
+	{ "stats",	no_argument,		NULL,	's' },
+	{ "shard",	required_argument,	NULL,	'S' },
+	{ NULL,		0,			NULL,	0 },
+};
 
 
 /*
@@ -40,8 +102,6 @@ int
 main(int argc, char *argv[])
 {
 	int	i;
-	struct t_tune		*tune;
-	struct t_action		*a;
 	struct t_format		*fmt;
 	struct t_actionQ	*aQ;
 
@@ -49,11 +109,32 @@ main(int argc, char *argv[])
 
 	Fflag = TAILQ_FIRST(t_all_formats());
 
-	while ((i = getopt(argc, argv, "hpF:NY")) != -1) {
+	while ((i = getopt_long(argc, argv, "hpC:c:F:J:NYP:RsS:", longopts, NULL)) != -1) {
 		switch ((char)i) {
 		case 'p':
 			pflag = 1;
 			break;
+		case 'P':
+			parse_padding(optarg);
+			break;
+		case 'R':
+			Rflag = 1;
+			break;
+		case 's':
+			sflag = 1;
+			break;
+		case 'S':
+			parse_shard(optarg);
+			break;
+		case 'C':
+			Cflag = optarg;
+			break;
+		case 'J':
+			Jflag = optarg;
+			break;
+		case 'c':
+			cflag = optarg;
+			break;
 		case 'F':
 			Fflag = NULL;
 			TAILQ_FOREACH(fmt, t_all_formats(), entries) {
@@ -94,6 +175,29 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (Cflag != NULL && t_cache_open(Cflag) == -1)
+		err(EXIT_FAILURE, "%s", Cflag);
+
+	/* the index command, see t_index.h */
+	if (argc > 0 && strcmp(argv[0], "index") == 0) {
+		int success = (t_index_command(argc - 1, argv + 1) == 0);
+		if (t_cache_close() == -1)
+			success = 0;
+		return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	/* the watch command, see t_watch.h */
+	const char *watchdir = NULL;
+	if (argc > 0 && strcmp(argv[0], "watch") == 0) {
+		if (argc < 2) {
+			errx(EINVAL, "watch: missing directory argument.\n"
+			    "Try `%s -h' for help.", getprogname());
+		}
+		watchdir = argv[1];
+		argc -= 2;
+		argv += 2;
+	}
+
 	aQ = t_actionQ_new(&argc, &argv);
 	if (aQ == NULL) {
 		if (errno == ENOMEM)
@@ -106,62 +210,96 @@ main(int argc, char *argv[])
 		/* NOTREACHED */
 	}
 
+	if (watchdir != NULL) {
+		if (argc > 0) {
+			errx(EINVAL, "watch: %s: unexpected argument.\n"
+			    "Try `%s -h' for help.", argv[0], getprogname());
+		}
+		int success = (t_watch(watchdir, aQ) == 0);
+		if (t_actionQ_finish(aQ) == -1)
+			success = 0;
+		t_actionQ_delete(aQ);
+		if (t_cache_close() == -1)
+			success = 0;
+		if (sflag)
+			t_backend_stats(stderr);
+		return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
 	if (argc == 0) {
 		errx(EINVAL, "missing file argument.\nTry `%s -h' for help.",
 		    getprogname());
 	}
 
-	/* find if any action need write access */
-	int write = 0;
-	TAILQ_FOREACH(a, aQ, entries)
-		write += a->write;
+	if (Jflag != NULL && t_journal_open(Jflag) == -1)
+		err(EXIT_FAILURE, "%s", Jflag);
+	if (cflag != NULL && t_snapshot_open(cflag) == -1)
+		err(EXIT_FAILURE, "%s", cflag);
 
 	/*
 	 * main loop, foreach files
 	 */
 	int grand_success = 1;
+	int records = (Jflag != NULL || cflag != NULL);
+	struct t_deferred deferred = { .success = 1 };
 	for (i = 0; i < argc; i++) {
-		/* check file path and access */
-		const char *path = argv[i];
-		int success = 1;
-		if (access(path, (write ? (R_OK | W_OK) : R_OK)) == -1) {
-			warn("%s", path);
-			grand_success = 0;
+		struct stat sb;
+		int status, success;
+		if (!t_shard_mine(argv[i]) || t_journal_done(argv[i]))
 			continue;
-		}
-
-		if ((tune = t_tune_new(path)) == NULL) {
-			if (errno == ENOMEM)
-				err(EXIT_FAILURE, "malloc");
-			warnx("%s: unsupported file format", path);
-			grand_success = 0;
+		switch (t_snapshot_check(argv[i])) {
+		case T_SNAPSHOT_UNCHANGED:
 			continue;
+		case T_SNAPSHOT_MODIFIED:
+			warnx("%s: modified, but not its tags", argv[i]);
+			continue;
+		default:
+			break;
 		}
-
-		/* apply every actions */
-		TAILQ_FOREACH(a, aQ, entries) {
-			if (a->apply(a, tune) != 0) {
-				/*
-				 * prevent further action on this particular
-				 * file.
-				 */
-				success = 0;
-				break;
-			}
-		}
-		if (write && success) {
-			/* all actions went well and at least one of them
-			   require the tags to be written back to the file */
-			if (t_tune_save(tune) == -1) {
-				warnx("%s: could not write tags to the file,",
-				    t_tune_path(tune));
-				grand_success = 0;
+		status  = t_actionQ_apply(aQ, argv[i], &sb);
+		success = (status != -1);
+		if (!success)
+			grand_success = 0;
+		if (status == T_ACTION_DEFERRED && records) {
+			/* recorded by record_deferred() once renamed */
+			if (deferred.count == deferred.capacity) {
+				size_t capacity = (deferred.capacity == 0 ?
+				    64 : 2 * deferred.capacity);
+				struct t_deferred_file *files = realloc(
+				    deferred.files, capacity * sizeof(*files));
+				if (files == NULL)
+					err(EXIT_FAILURE, "malloc");
+				deferred.files    = files;
+				deferred.capacity = capacity;
 			}
+			deferred.files[deferred.count].path = argv[i];
+			deferred.files[deferred.count].sb   = sb;
+			deferred.count++;
+			continue;
 		}
-		t_tune_delete(tune);
-		grand_success &= success;
+		if (t_journal_record(argv[i], (success ? &sb : NULL),
+		    success) == -1)
+			grand_success = 0;
+		if (success && t_snapshot_record(argv[i], &sb) == -1)
+			grand_success = 0;
 	}
+	if (t_actionQ_flush(aQ, (records ? record_deferred : NULL),
+	    &deferred) == -1)
+		grand_success = 0;
+	if (!deferred.success)
+		grand_success = 0;
+	free(deferred.files);
+	if (t_actionQ_finish(aQ) == -1)
+		grand_success = 0;
 	t_actionQ_delete(aQ);
+	if (t_journal_close() == -1)
+		grand_success = 0;
+	if (t_snapshot_close() == -1)
+		grand_success = 0;
+	if (t_cache_close() == -1)
+		grand_success = 0;
+	if (sflag)
+		t_backend_stats(stderr);
 	return (grand_success ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
@@ -180,15 +318,26 @@ usage(int status)
 	fprintf(stderr, "tagutil v"T_TAGUTIL_VERSION "\n\n");
 	fprintf(stderr, "usage: %s [OPTION]... [ACTION:ARG]... [FILE]...\n",
 	    getprogname());
+	fprintf(stderr, "       %s [OPTION]... index build DIR | index query EXPR [DIR]\n",
+	    getprogname());
+	fprintf(stderr, "       %s [OPTION]... watch DIR [ACTION:ARG]...\n",
+	    getprogname());
 	fprintf(stderr, "Modify or display music file's tag.\n");
 	fprintf(stderr, "\n");
 
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "  -h     show this help\n");
 	fprintf(stderr, "  -p     create destination directories if needed (used by rename)\n");
+	fprintf(stderr, "  -C path cache the tags of unchanged files in path (--cache)\n");
+	fprintf(stderr, "  -J path record the processed files in path, and skip them on the next run (--journal)\n");
+	fprintf(stderr, "  -c path only process the files whose tags changed since the snapshot path (--changed-since)\n");
 	fprintf(stderr, "  -F fmt use the fmt format for print, edit and load actions (see Formats)\n");
 	fprintf(stderr, "  -Y     answer yes to all questions\n");
 	fprintf(stderr, "  -N     answer no  to all questions\n");
+	fprintf(stderr, "  -P k[,f] reserve k KiB of padding when rewriting, grown by f when exceeded\n");
+	fprintf(stderr, "  -R     refuse to rewrite whole files (--no-rewrite)\n");
+	fprintf(stderr, "  -s     show in place and full rewrite counters at exit (--stats)\n");
+	fprintf(stderr, "  -S i/n only process the files of the shard i (from 0) out of n (--shard)\n");
 	fprintf(stderr, "\n");
 
 	fprintf(stderr, "Actions:\n");
@@ -196,11 +345,18 @@ usage(int status)
 	fprintf(stderr, "  backend          print the backend used (see Backend)\n");
 	fprintf(stderr, "  clear:TAG        clear all tag TAG. If TAG is "
 	    "empty, all tags are cleared\n");
+	fprintf(stderr, "  digest           print a digest of the tags\n");
 	fprintf(stderr, "  add:TAG=VALUE    add a TAG=VALUE pair\n");
 	fprintf(stderr, "  set:TAG=VALUE    set TAG to VALUE\n");
 	fprintf(stderr, "  edit             prompt for editing\n");
 	fprintf(stderr, "  load:PATH        load PATH yaml tag file\n");
 	fprintf(stderr, "  rename:PATTERN   rename to PATTERN\n");
+	fprintf(stderr, "  aggregate:TAG,... print statistics about the TAG values "
+	    "at exit\n");
+	fprintf(stderr, "  sort:TAG,...     print tags at exit, sorted by the TAG "
+	    "values\n");
+	fprintf(stderr, "  where:EXPR       apply the next actions only if EXPR "
+	    "match, like genre=Jazz&year<1970\n");
 	fprintf(stderr, "\n");
 
 	fprintf(stderr, "Formats:\n");
@@ -215,3 +371,94 @@ usage(int status)
 
 	exit(status);
 }
+
+
+/*
+ * parse the -P option argument, kib[,factor]
+ */
+static void
+parse_padding(const char *arg)
+{
+	char *endptr;
+	unsigned long kib, factor;
+
+	assert(arg != NULL);
+
+	errno = 0;
+	kib = strtoul(arg, &endptr, 10);
+	if (endptr == arg || errno != 0 || kib > SIZE_MAX / 1024)
+		goto invalid;
+	factor = Pflag_growth;
+	if (*endptr == ',') {
+		const char *f = endptr + 1;
+		factor = strtoul(f, &endptr, 10);
+		if (endptr == f || errno != 0 || factor > UINT_MAX)
+			goto invalid;
+	}
+	if (*endptr != '\0')
+		goto invalid;
+
+	Pflag_reserve = kib * 1024;
+	Pflag_growth  = (unsigned)factor;
+	return;
+invalid:
+	errx(errno = EINVAL, "%s: invalid -P option, expected kib[,factor]", arg);
+}
+
+
+/*
+ * parse the -S option argument, index/count
+ */
+static void
+parse_shard(const char *arg)
+{
+	char *endptr;
+	const char *c;
+	unsigned long index, count;
+
+	assert(arg != NULL);
+
+	errno = 0;
+	index = strtoul(arg, &endptr, 10);
+	if (endptr == arg || errno != 0 || *endptr != '/')
+		goto invalid;
+	c = endptr + 1;
+	count = strtoul(c, &endptr, 10);
+	if (endptr == c || errno != 0 || *endptr != '\0')
+		goto invalid;
+	if (count == 0 || count > INT32_MAX || index >= count)
+		goto invalid;
+
+	Sflag_index = index;
+	Sflag_count = count;
+	return;
+invalid:
+	errx(errno = EINVAL, "%s: invalid -S option, expected index/count "
+	    "with index < count", arg);
+}
+
+
+static void
+record_deferred(const char *path, const char *npath, int success, void *arg)
+{
+	struct t_deferred *deferred;
+	struct stat sb;
+
+	assert(path  != NULL);
+	assert(npath != NULL);
+	assert(arg   != NULL);
+	deferred = arg;
+	assert(deferred->next < deferred->count);
+	assert(strcmp(deferred->files[deferred->next].path, path) == 0);
+
+	/* a rename keep the journal key, but the snapshot is keyed by path */
+	sb = deferred->files[deferred->next++].sb;
+	if (t_journal_record(path, (success ? &sb : NULL), success) == -1)
+		deferred->success = 0;
+	if (success && stat(npath, &sb) == -1) {
+		warn("%s", npath);
+		deferred->success = 0;
+	} else if (success && (t_snapshot_record(npath, &sb) == -1 ||
+	    t_snapshot_forget(path) == -1))
+		deferred->success = 0;
+}
@@ -39,14 +39,4 @@ Feature: Adding tags to a file
             | music-file |
             | track.flac |
             | track.ogg  |
-
-    Scenario Outline: multiples tags with the same key (using TagLib)
-        Given there is a music file <music-file>
-        When  I run tagutil add:artist="Richard Wright" add:"artist=David Gilmour" <music-file>
-        And   I run tagutil print <music-file>
-        Then  I expect tagutil to succeed
-        And   I should see the YAML tag list:
-            | artist | David Gilmour  |
-    Examples:
-            | music-file |
             | track.mp3  |
@@ -0,0 +1,38 @@
+Feature: Tag values statistics with the aggregate action
+
+    Scenario: values are counted once per file
+        Given there is a music file track.flac tagged with:
+            | genre | Jazz |
+            | genre | Jazz |
+        And   there is a music file other.ogg tagged with:
+            | genre | Jazz |
+        And   there is a music file last.mp3 tagged with:
+            | genre | Rock |
+        And   there is a music file none.flac tagged with:
+            | title | Silence |
+        When  I run tagutil aggregate:GENRE track.flac other.ogg last.mp3 none.flac
+        Then  I expect tagutil to succeed
+        And   I should see the YAML tag list:
+            | files    | 4      |
+            | missing  | 1      |
+            | distinct | 2      |
+            | genre    | 2 Jazz |
+            | genre    | 1 Rock |
+
+    Scenario: distinct values can be estimated
+        Given there is a music file track.flac tagged with:
+            | artist | Pink Floyd |
+        And   there is a music file other.ogg tagged with:
+            | artist | Miles Davis |
+        When  I run tagutil aggregate:#artist track.flac other.ogg
+        Then  I expect tagutil to succeed
+        And   I should see the YAML tag list:
+            | files    | 2 |
+            | missing  | 0 |
+            | distinct | 2 |
+
+    Scenario: empty keys are rejected
+        Given there is a music file track.flac
+        When  I run tagutil aggregate:genre,,year track.flac
+        Then  I expect tagutil to fail
+        And   I should see "empty tag key"
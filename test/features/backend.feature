@@ -12,7 +12,14 @@ Feature: Printing the backend used for a file
         Then  I expect tagutil to succeed
         And   I should see "libvorbis"
 
-    Scenario: using the taglib backend
+    Scenario: using the ID3v2 backend
+        Given there is a music file track.mp3 tagged with:
+            | title | Echoes |
+        When  I run tagutil backend track.mp3
+        Then  I expect tagutil to succeed
+        And   I should see "ID3v2"
+
+    Scenario: leaving MP3 files without an ID3v2 tag to TagLib
         Given there is a music file track.mp3
         When  I run tagutil backend track.mp3
         Then  I expect tagutil to succeed
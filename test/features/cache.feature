@@ -0,0 +1,46 @@
+Feature: Caching the tags of unchanged files
+
+    Scenario Outline: the cache is created and used
+        Given there is a music file <music-file> tagged with:
+            | title | Atom Heart Mother |
+        When  I run tagutil -C tags.cache print <music-file>
+        And   I run tagutil --cache tags.cache print <music-file>
+        Then  I expect tagutil to succeed
+        And   I expect the file "tags.cache" to exist
+        And   I should see the YAML tag list:
+            | title | Atom Heart Mother |
+    Examples:
+            | music-file |
+            | track.flac |
+            | track.ogg  |
+            | track.mp3  |
+
+    Scenario Outline: saved tags update the cache
+        Given there is a music file <music-file> tagged with:
+            | title | Atom Heart Mother |
+        When  I run tagutil -C tags.cache print <music-file>
+        And   I run tagutil -C tags.cache set:title=Echoes <music-file>
+        And   I run tagutil -C tags.cache print <music-file>
+        Then  I expect tagutil to succeed
+        And   I should see the YAML tag list:
+            | title | Echoes |
+    Examples:
+            | music-file |
+            | track.flac |
+            | track.ogg  |
+            | track.mp3  |
+
+    Scenario Outline: files modified without the cache are read again
+        Given there is a music file <music-file> tagged with:
+            | title | Atom Heart Mother |
+        When  I run tagutil -C tags.cache print <music-file>
+        And   I run tagutil set:title=Echoes <music-file>
+        And   I run tagutil -C tags.cache print <music-file>
+        Then  I expect tagutil to succeed
+        And   I should see the YAML tag list:
+            | title | Echoes |
+    Examples:
+            | music-file |
+            | track.flac |
+            | track.ogg  |
+            | track.mp3  |
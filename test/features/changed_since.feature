@@ -0,0 +1,22 @@
+Feature: Processing only the files whose tags changed
+
+    Scenario: files modified without their tags are reported
+        Given there is a music file track.flac tagged with:
+            | title | Echoes |
+        When  I run tagutil -c tags.snapshot print track.flac
+        Then  I expect the file "tags.snapshot" to exist
+        When  I run tagutil set:title=Echoes track.flac
+        And   I run tagutil -c tags.snapshot print track.flac
+        Then  I expect tagutil to succeed
+        And   I should see "track.flac: modified, but not its tags"
+        And   I should not see "Echoes"
+
+    Scenario: retagged files are processed
+        Given there is a music file track.flac tagged with:
+            | title | Echoes |
+        When  I run tagutil -c tags.snapshot print track.flac
+        And   I run tagutil set:title=Time track.flac
+        And   I run tagutil -c tags.snapshot print track.flac
+        Then  I expect tagutil to succeed
+        And   I should see the YAML tag list:
+            | title | Time |
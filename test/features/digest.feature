@@ -0,0 +1,22 @@
+Feature: Tags digest
+
+    Scenario Outline: the digest only depends on the tags
+        Given there is a music file <music-file> tagged with:
+            | title  | Echoes     |
+            | artist | Pink Floyd |
+        When  I run tagutil digest <music-file>
+        Then  I expect tagutil to succeed
+        And   I should see "028d9c3a0de657a1a803c0dfec3bc865 <music-file>"
+    Examples:
+            | music-file |
+            | track.flac |
+            | track.ogg  |
+            | track.mp3  |
+
+    Scenario: the digest change with the tags
+        Given there is a music file track.flac tagged with:
+            | title | Echoes |
+        When  I run tagutil digest set:TITLE=Time digest track.flac
+        Then  I expect tagutil to succeed
+        And   I should see "0ff0551440468e8a849c8801a0a594db track.flac"
+        And   I should see "41b42773ae634fc054dffe0b46ab50cd track.flac"
@@ -0,0 +1,42 @@
+Feature: Querying the tags index of a directory
+
+    Scenario: files are found by tag
+        Given there is a music file track.flac tagged with:
+            | artist | Pink Floyd |
+            | year   | 1971       |
+        And   there is a music file other.ogg tagged with:
+            | artist      | Pink Floyd |
+            | year        | 1973       |
+            | tracknumber | 1          |
+        When  I run tagutil index build .
+        And   I run tagutil index query "artist=pink floyd|ARTIST=Pink Floyd&year<1972" .
+        Then  I expect tagutil to succeed
+        And   I should see "./track.flac"
+        And   I should not see "./other.ogg"
+
+    Scenario: files without a tag
+        Given there is a music file track.flac tagged with:
+            | title | Echoes |
+        And   there is a music file other.ogg tagged with:
+            | title       | Time |
+            | tracknumber | 4    |
+        When  I run tagutil index build .
+        And   I run tagutil index query !tracknumber
+        Then  I expect tagutil to succeed
+        And   I should see "./track.flac"
+        And   I should not see "./other.ogg"
+
+    Scenario: updating the index
+        Given there is a music file track.flac tagged with:
+            | title | Echoes |
+        And   there is a music file other.ogg tagged with:
+            | title | Money |
+        When  I run tagutil index build .
+        And   I run tagutil set:title=Time track.flac
+        And   I run tagutil index build .
+        And   I run tagutil index query title=Time
+        Then  I expect tagutil to succeed
+        And   I should see "./track.flac"
+        And   I should not see "./other.ogg"
+        When  I run tagutil index query title=Echoes
+        Then  I should not see "./track.flac"
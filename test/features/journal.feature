@@ -0,0 +1,51 @@
+Feature: Resuming a run with a journal
+
+    Scenario: failed files are processed again
+        Given there is a music file track.flac tagged with:
+            | title | Echoes |
+        When  I run tagutil -J run.journal load:missing.yml track.flac
+        Then  I expect tagutil to fail
+        When  I run tagutil -J run.journal add:mood=calm track.flac
+        And   I run tagutil print track.flac
+        Then  I expect tagutil to succeed
+        And   I should see the YAML tag list:
+            | title | Echoes |
+            | mood  | calm   |
+
+    Scenario: a cut last journal line is ignored
+        Given there is a music file track.flac tagged with:
+            | title | Echoes |
+        And   there is a text file named run.journal containing:
+            """
+            ok 2049 1310
+            """
+        When  I run tagutil -J run.journal add:mood=calm track.flac
+        Then  I expect tagutil to succeed
+        When  I run tagutil --journal=run.journal add:mood=calm track.flac
+        And   I run tagutil print track.flac
+        Then  I expect tagutil to succeed
+        And   I should see the YAML tag list:
+            | title | Echoes |
+            | mood  | calm   |
+
+    Scenario: modified files are processed again
+        Given there is a music file track.flac tagged with:
+            | title | Echoes |
+        When  I run tagutil -J run.journal add:mood=calm track.flac
+        And   I run tagutil set:title=Time track.flac
+        And   I run tagutil -J run.journal add:mood=calm track.flac
+        And   I run tagutil print track.flac
+        Then  I expect tagutil to succeed
+        And   I should see the YAML tag list:
+            | title | Time |
+            | mood  | calm |
+            | mood  | calm |
+
+    Scenario: files whose rename was declined are processed again
+        Given there is a music file track.flac tagged with:
+            | title | Echoes |
+        When  I run tagutil -N -J run.journal rename:%title track.flac
+        And   I run tagutil -Y -J run.journal rename:%title track.flac
+        Then  I expect tagutil to succeed
+        And   I expect the file "track.flac" not to exist
+        And   I expect the file "Echoes.flac" to exist
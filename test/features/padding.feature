@@ -0,0 +1,40 @@
+Feature: Updating tags in place thanks to padding
+
+    Scenario Outline: later edits are done in place
+        Given there is a music file <music-file> tagged with:
+            | title | Atom Heart Mother |
+        When  I run tagutil -s set:artist=Pink\ Floyd <music-file>
+        Then  I expect tagutil to succeed
+        And   I should see "in place writes:  1"
+        And   I should see "full rewrites:    0"
+    Examples:
+            | music-file |
+            | track.flac |
+            | track.ogg  |
+            | track.mp3  |
+
+    Scenario Outline: refusing to rewrite does not prevent in place edits
+        Given there is a music file <music-file> tagged with:
+            | title | Atom Heart Mother |
+        When  I run tagutil -R set:title=Echoes <music-file>
+        And   I run tagutil print <music-file>
+        Then  I expect tagutil to succeed
+        And   I should see the YAML tag list:
+            | title | Echoes |
+    Examples:
+            | music-file |
+            | track.flac |
+            | track.ogg  |
+            | track.mp3  |
+
+    Scenario: tags not fitting into the padding are written by a full rewrite
+        Given there is a music file track.flac tagged with:
+            | title | Atom Heart Mother |
+        And   there is a YAML file named big.yml with a "comment" tag of 10000 characters
+        When  I run tagutil -s load:big.yml add:title=Echoes track.flac
+        Then  I expect tagutil to succeed
+        And   I should see "full rewrites:    1"
+        When  I run tagutil print track.flac
+        Then  I expect tagutil to succeed
+        And   I should see "comment: xxxxxxxxxx"
+        And   I should see "title: Echoes"
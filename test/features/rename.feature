@@ -26,3 +26,35 @@ Feature: Renaming a file
         Then  I expect tagutil to succeed
         And   I expect the file "track.flac" not to exist
         And   I expect the file "Pink Floyd/Atom Heart Mother.flac" to exist
+
+    Scenario: swapping the names of two files
+        Given there is a music file one.flac tagged with:
+            | title       | two               |
+        And   there is a music file two.flac tagged with:
+            | title       | one               |
+        When  I run tagutil -Y rename:"%{title}" one.flac two.flac
+        Then  I expect tagutil to succeed
+        And   I should see "rename these 2 files? [y/n] yes"
+        When  I run tagutil print one.flac
+        Then  I should see "title: one"
+
+    Scenario: failing to rename two files to the same name
+        Given there is a music file one.flac tagged with:
+            | title       | Atom Heart Mother |
+        And   there is a music file two.flac tagged with:
+            | title       | Atom Heart Mother |
+        When  I run tagutil -Y rename:"%{title}" one.flac two.flac
+        Then  I expect tagutil to fail
+        And   I should see "`one.flac' and `two.flac' would both be renamed to `Atom Heart Mother.flac'"
+        And   I expect the file "one.flac" to exist
+        And   I expect the file "two.flac" to exist
+        And   I expect the file "Atom Heart Mother.flac" not to exist
+
+    Scenario: not renaming a file whose tags could not be saved
+        Given there is a music file track.flac tagged with:
+            | title       | Atom Heart Mother |
+        And   there is a YAML file named big.yml with a "comment" tag of 10000 characters
+        When  I run tagutil -Y -R load:big.yml rename:renamed track.flac
+        Then  I expect tagutil to fail
+        And   I expect the file "track.flac" to exist
+        And   I expect the file "renamed.flac" not to exist
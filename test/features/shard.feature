@@ -0,0 +1,26 @@
+Feature: Splitting the work with the -S option
+
+    Scenario: a single shard process every file
+        Given there is a music file track.flac tagged with:
+            | title | Echoes |
+        When  I run tagutil --shard=0/1 print track.flac
+        Then  I expect tagutil to succeed
+        And   I should see the YAML tag list:
+            | title | Echoes |
+
+    Scenario: each file belongs to exactly one shard
+        Given there is a music file track.flac tagged with:
+            | title | Echoes |
+        When  I run tagutil -S 0/2 add:mood=calm track.flac
+        And   I run tagutil -S 1/2 add:mood=calm track.flac
+        And   I run tagutil print track.flac
+        Then  I expect tagutil to succeed
+        And   I should see the YAML tag list:
+            | title | Echoes |
+            | mood  | calm   |
+
+    Scenario: the shard index must be lower than the count
+        Given there is a music file track.flac
+        When  I run tagutil -S 2/2 track.flac
+        Then  I expect tagutil to fail
+        And   I should see "invalid -S option"
@@ -0,0 +1,21 @@
+Feature: Sorted listing with the sort action
+
+    Scenario: files are displayed sorted by tag values
+        Given there is a music file a.flac tagged with:
+            | album       | Meddle |
+            | tracknumber | 10     |
+        And   there is a music file b.flac tagged with:
+            | album       | meddle |
+            | tracknumber | 2      |
+        And   there is a music file c.flac tagged with:
+            | title | Untitled |
+        When  I run tagutil sort:ALBUM,tracknumber a.flac b.flac c.flac
+        Then  I expect tagutil to succeed
+        And   I expect "# c.flac" to be displayed before "# b.flac"
+        And   I expect "# b.flac" to be displayed before "# a.flac"
+
+    Scenario: empty keys are rejected
+        Given there is a music file track.flac
+        When  I run tagutil sort:album,,year track.flac
+        Then  I expect tagutil to fail
+        And   I should see "empty tag key"
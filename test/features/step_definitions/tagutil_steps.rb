@@ -20,6 +20,10 @@ Given(/^there is a text file named (\w+\.\w+) containing:$/) do |filename, conte
   File.write filename, content
 end
 
+Given(/^there is a YAML file named (\S+) with a "(\w+)" tag of (\d+) characters$/) do |filename, key, len|
+  File.write filename, [{key => 'x' * len.to_i}].to_yaml
+end
+
 Given(/^my favourite editor is ([^\s]+)$/) do |desc|
   name = desc.strip
   editor = Tagutil::Editor.find(name.strip)
@@ -49,6 +53,17 @@ Then(/^I should see "(.*?)"$/) do |text|
 end
 
 
+Then(/^I should not see "(.*?)"$/) do |text|
+  expect(@output).not_to include(text)
+end
+
+
+Then(/^I expect "(.*?)" to be displayed before "(.*?)"$/) do |first, second|
+  expect(@output).to include(first, second)
+  expect(@output.index(first)).to be < @output.index(second)
+end
+
+
 Then(/^I should see the help about (.+)$/) do |section|
   expect(@output).to match(/^#{section}/m)
 end
@@ -0,0 +1,40 @@
+Feature: Filtering files with the where action
+
+    Scenario Outline: actions are applied to matching files
+        Given there is a music file <music-file> tagged with:
+            | genre | Jazz |
+            | year  | 1959 |
+        When  I run tagutil "where:GENRE=Jazz&year<1970" set:mood=blue <music-file>
+        And   I run tagutil print <music-file>
+        Then  I expect tagutil to succeed
+        And   I should see the YAML tag list:
+            | genre | Jazz |
+            | year  | 1959 |
+            | mood  | blue |
+    Examples:
+            | music-file |
+            | track.flac |
+            | track.ogg  |
+            | track.mp3  |
+
+    Scenario Outline: other files are skipped
+        Given there is a music file <music-file> tagged with:
+            | genre | Jazz |
+            | year  | 1975 |
+        When  I run tagutil "where:genre=Jazz&(year<1970|!year)" set:mood=blue <music-file>
+        Then  I expect tagutil to succeed
+        When  I run tagutil print <music-file>
+        Then  I should see the YAML tag list:
+            | genre | Jazz |
+            | year  | 1975 |
+    Examples:
+            | music-file |
+            | track.flac |
+            | track.ogg  |
+            | track.mp3  |
+
+    Scenario: malformed expressions are rejected
+        Given there is a music file track.flac
+        When  I run tagutil "where:(genre=Jazz" track.flac
+        Then  I expect tagutil to fail
+        And   I should see "missing closing `)'"